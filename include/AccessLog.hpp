@@ -0,0 +1,80 @@
+#ifndef ACCESSLOG_HPP
+#define ACCESSLOG_HPP
+
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+enum AccessLogVariable {
+	LOG_LITERAL,
+	LOG_REMOTE_ADDR,
+	LOG_TIME_LOCAL,
+	LOG_TIME_ISO8601,
+	LOG_MSEC,
+	LOG_REQUEST,
+	LOG_REQUEST_METHOD,
+	LOG_REQUEST_URI,
+	LOG_SERVER_PROTOCOL,
+	LOG_STATUS,
+	LOG_BYTES_SENT,
+	LOG_BODY_BYTES_SENT,
+	LOG_REQUEST_LENGTH,
+	LOG_REQUEST_TIME,
+	LOG_UPSTREAM_RESPONSE_TIME,
+	LOG_HOST,
+	LOG_SERVER_NAME,
+	LOG_CONNECTION,
+	LOG_CONNECTION_REQUESTS,
+	LOG_HTTP_REFERER,
+	LOG_HTTP_USER_AGENT
+};
+
+struct AccessLogField {
+	AccessLogVariable variable;
+	std::string literal;
+};
+
+// what one request did, filled in while it is answered. the connection
+// fields stay across the requests of a keep-alive connection
+struct AccessEntry {
+	std::string remote_addr;
+	size_t connection;			// serial number of the connection
+	size_t connection_requests;
+
+	bool active;				// this request is logged
+	struct timeval start;		// first byte of the request
+	struct timeval upstream_start;
+	struct timeval upstream_end;
+	std::string method;
+	std::string uri;
+	std::string protocol;
+	std::string host;
+	std::string server_name;
+	std::string referer;
+	std::string user_agent;
+	int status;					// 0 until a response head was queued
+	size_t head_length;
+	size_t bytes_sent;
+	size_t bytes_received;
+
+	AccessEntry();
+	void reset();				// per request fields only
+};
+
+// a log_format compiled once at load into literals and variables
+class AccessLogFormat {
+private:
+	std::vector<AccessLogField> _fields;
+	bool _needs_headers;		// referer and user agent are only copied when used
+
+public:
+	AccessLogFormat();
+
+	bool compile(const std::string& format, std::string& error);
+	void render(std::string& out, const AccessEntry& entry, const struct timeval& now) const;
+	bool needsHeaders() const { return _needs_headers; }
+
+	static const char* COMBINED;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <vector>
+
+// bump allocator for state that lives exactly as long as one request:
+// header slices and parser temporaries. reset() drops everything at once
+// and keeps the chunks, so a connection that serves request after request
+// stops allocating once its first chunk is big enough
+class Arena {
+private:
+	std::vector<char*> _chunks;
+	std::vector<size_t> _sizes;
+	size_t _current;	// chunk being filled
+	size_t _used;		// bytes used in it
+	size_t _allocations;	// chunks taken from the heap, for the stats
+
+	static const size_t CHUNK_SIZE = 4096;
+
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+
+public:
+	Arena();
+	~Arena();
+
+	void* allocate(size_t size);
+	const char* copy(const char* data, size_t length);
+	void reset();
+
+	size_t capacity() const;
+	size_t heapAllocations() const { return _allocations; }
+};
+
+#endif
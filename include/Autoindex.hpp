@@ -0,0 +1,61 @@
+#ifndef AUTOINDEX_HPP
+#define AUTOINDEX_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <sys/types.h>
+#include "BufferChain.hpp"
+
+class MimeTypes;
+
+// directory listings for autoindex. a directory is read once with the
+// entry types readdir already gives, sorted and rendered to table rows, and
+// kept until its mtime changes. sizes can change without the mtime moving,
+// so they are left out of the kept rows and looked up on every request for
+// the rows of the page being served. large directories are paged with
+// ?offset=&limit=
+class Autoindex {
+private:
+	struct Entry {
+		std::string name;
+		bool directory;
+		std::string row;		// the table row, escaped and typed
+		size_t size_pos;		// where the size goes in row, npos for directories
+	};
+
+	struct Listing {
+		dev_t dev;
+		ino_t ino;
+		struct timespec mtime;
+		std::vector<Entry> entries;		// directories first, then by name
+		size_t bytes;					// names and rows held
+		unsigned long used;				// _clock at the last request
+	};
+
+	std::map<std::string, Listing> _listings;	// by directory path
+	size_t _bytes;
+	unsigned long _clock;
+
+	static bool before(const Entry& a, const Entry& b);
+	bool scan(const std::string& dir_path, const MimeTypes& mime_types, Listing& listing, std::string& error);
+	void renderPage(const std::string& dir_path, const Listing& listing, const std::string& uri,
+					size_t offset, size_t limit, BufferChain& body) const;
+	void evict(const std::string& keep);
+
+public:
+	static const size_t MAX_UNPAGED = 10000;	// bigger directories default to pages
+	static const size_t DEFAULT_LIMIT = 1000;
+	static const size_t MAX_LIMIT = 10000;
+
+	Autoindex();
+
+	// appends the html listing of dir_path to body, false with error set when
+	// the directory cannot be read
+	bool render(const std::string& dir_path, const std::string& uri, const std::string& query,
+				const MimeTypes& mime_types, BufferChain& body, std::string& error);
+	void clear();
+};
+
+#endif
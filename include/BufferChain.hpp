@@ -0,0 +1,81 @@
+#ifndef BUFFERCHAIN_HPP
+#define BUFFERCHAIN_HPP
+
+#include <string>
+#include <deque>
+#include <sys/types.h>
+
+// storage behind chain segments, shared by every chain that references it
+struct BufferStorage {
+	int refs;
+
+	BufferStorage() : refs(0) {}
+	virtual ~BufferStorage() {}
+	virtual void recycle() { delete this; }	// the last reference is gone
+};
+
+// fixed size block from the pool, appends fill it front to back
+struct BufferBlock : public BufferStorage {
+	static const size_t SIZE = 16 * 1024;
+	char data[SIZE];
+	size_t used;
+
+	BufferBlock() : used(0) {}
+	virtual void recycle();
+};
+
+// bytes built once and never changed again, e.g. a prebuilt error page
+struct SharedBuffer : public BufferStorage {
+	std::string data;
+};
+
+// an open file, sent with sendfile and closed with the last reference
+struct SharedFile : public BufferStorage {
+	int fd;
+
+	explicit SharedFile(int file_fd) : fd(file_fd) {}
+	virtual ~SharedFile();
+};
+
+struct BufferSegment {
+	BufferStorage* storage;
+	const char* data;	// first unsent byte, NULL for a file
+	off_t offset;		// file position of the first unsent byte
+	size_t length;
+};
+
+// outgoing bytes as a list of segments over pooled blocks, shared buffers
+// and files. appending copies memory into blocks once, shared buffers and
+// files are only referenced; copying a chain shares its segments
+class BufferChain {
+private:
+	std::deque<BufferSegment> _segments;
+	size_t _size;
+	BufferBlock* _tail;		// last segment's block while this chain may still fill it
+
+	void push(BufferStorage* storage, const char* data, off_t offset, size_t length);
+	static void release(BufferStorage* storage);
+	static BufferBlock* allocateBlock();
+
+public:
+	BufferChain();
+	BufferChain(const BufferChain& other);
+	BufferChain& operator=(const BufferChain& other);
+	~BufferChain();
+
+	void append(const char* data, size_t length);
+	void append(const std::string& data);
+	void append(const BufferChain& other);
+	void appendShared(std::string& data);			// takes the bytes, data is left empty
+	void appendFile(int fd, off_t offset, size_t length);	// takes the fd
+
+	size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+	void clear();
+	void consume(size_t length);
+	ssize_t writeTo(int fd);	// writev/sendfile as much as fd takes, sent bytes are dropped
+	std::string str() const;	// flat copy, for the few places that edit a response
+	size_t peek(char* out, size_t length) const;	// leading memory bytes, stops at a file
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <map>
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -15,53 +16,171 @@
 #include <cstdlib>
 #include <poll.h>
 #include <signal.h>
+#include <spawn.h>
+#include <cstring>
+#include <ctime>
 #include "HttpRequest.hpp"
+#include "CgiOutput.hpp"
+#include "CgiCache.hpp"
+#include "BufferChain.hpp"
 #include "WebServer.hpp"
 #include "utils.hpp"
 
+extern char** environ;
+
 class WebServer;
+struct LocationConfig;
+struct ServerConfig;
+
+// a pre-forked interpreter running a worker shim (see tools/cgi_worker.py).
+// requests and responses travel as frames over its stdin/stdout:
+//   request:  "<env bytes> <body bytes>\n" env ("KEY=value\0"...) body
+//   response: "<output bytes>\n" raw cgi output
+struct CgiWorker {
+	pid_t pid;
+	int stdin_fd;
+	int stdout_fd;
+	size_t requests_served;
+	time_t idle_since;
+	bool busy;
+
+	CgiWorker() : pid(-1), stdin_fd(-1), stdout_fd(-1), requests_served(0),
+		idle_since(0), busy(false) {}
+};
+
+struct CgiWorkerPool {
+	std::string interpreter;
+	std::string shim;
+	size_t min_workers;
+	size_t max_workers;
+	size_t max_requests;	// a worker is recycled after this many requests
+	int idle_timeout;		// idle workers above min_workers exit after this
+	std::vector<CgiWorker*> workers;
+};
+
+// one running cgi script. the pipes are polled by the main loop, stdout is
+// relayed to the client as it arrives and the response is finished once both
+// stdout hit EOF and the child was reaped on SIGCHLD
+struct CgiProcess {
+	pid_t pid;
+	int client_fd;			// -1 once the client is gone
+	int stdout_fd;
+	int stdin_fd;			// -1 once the body is written
+	std::string body;
+	size_t bytes_written;
+	CgiOutputStream output;
+	time_t last_activity;	// start or last output, for the timeout
+	bool output_done;
+	bool exited;
+	int exit_status;
+	CgiWorker* worker;		// set when a pooled worker runs the script
+	const LocationConfig* location;	// for the concurrency limit and the timeout
+	ConfigRef config;			// keeps location alive across a reload
+	std::string cache_key;		// set when the output fills the cache
+	std::string recorded;		// copy of the response for the cache and the waiters
+	bool record_overflow;
+	bool detached;			// killed or abandoned, only waiting to be reaped
+	std::string frame_header;	// worker mode: "<length>\n" line of the response frame
+	bool frame_started;
+	size_t frame_remaining;
+
+	CgiProcess() : pid(-1), client_fd(-1), stdout_fd(-1), stdin_fd(-1), bytes_written(0),
+		last_activity(0), output_done(false), exited(false), exit_status(0), worker(NULL),
+		location(NULL), record_overflow(false), detached(false), frame_started(false), frame_remaining(0) {}
+};
+
+// a cache miss that is being executed; identical requests arriving
+// meanwhile wait for its result instead of starting their own script
+struct CgiCacheFill {
+	HttpRequest request;	// replayed for the waiters if the result was too big to keep
+	const LocationConfig* location;
+	std::string script_path;
+	std::vector<int> waiters;
+
+	CgiCacheFill() : location(NULL) {}
+};
+
+// a request waiting for a free slot of its location's cgi_max_concurrent
+struct CgiQueuedRequest {
+	HttpRequest request;
+	const LocationConfig* location;
+	std::string script_path;
+	std::string cache_key;
+	time_t queued_at;
+
+	CgiQueuedRequest() : location(NULL), queued_at(0) {}
+};
 
 class CgiHandler {
 private:
 	std::string _cgi_bin_path;
-	std::map<std::string, std::string> _interpreters;
 	WebServer* _web_server;
 
+	// running scripts
+	std::map<pid_t, CgiProcess*> _processes;
+	std::map<int, pid_t> _pipe_owners;		// pipe fd -> pid
+	std::map<int, pid_t> _client_processes;	// client fd -> pid
+	std::map<std::string, CgiWorkerPool*> _worker_pools;	// location key -> pool
+	std::vector<pid_t> _retired_workers;	// waiting to be reaped
+	CgiCache _cache;
+	std::map<std::string, CgiCacheFill> _cache_fills;	// cache key -> running fill
+	std::map<int, std::string> _cache_waiters;			// client fd -> cache key
+	std::map<std::string, size_t> _running;			// location key -> scripts running
+	std::map<std::string, std::deque<CgiQueuedRequest> > _queues;	// location key -> waiting requests
+	std::map<int, std::string> _queued_clients;		// client fd -> location key
+	static const int CGI_TIMEOUT = 30;				// without any output, unless the location sets cgi_timeout
+	static const int CGI_RETRY_AFTER = 5;
+	static const size_t CGI_READ_SIZE = 65536;
+
 	// pipes
 	bool createPipes(int pipe_stdout[2], int pipe_stdin[2]) const;
-	void setupCgiPipes(std::vector<struct pollfd>& cgi_fds, int pipe_stdout[2], 
-					  int pipe_stdin[2], const HttpRequest& request) const;
-	void closeCgiPipes(int pipe_stdout[2], int pipe_stdin[2], bool stdin_closed) const;
+	void registerProcess(CgiProcess* process);
+	void closeStdin(CgiProcess* process);
+	void closeStdout(CgiProcess* process);
 
 	// process management
-	void setupChildProcess(int pipe_stdout[2], int pipe_stdin[2], 
-						  const HttpRequest& request, const std::string& script_path,
-						  const std::map<std::string, std::string>& interpreters) const;
-	bool checkCgiProcessFinished(pid_t child_pid, int pipe_stdout, std::string& output) const;
-	bool waitForCgiCompletion(pid_t child_pid) const;
+	pid_t spawnChild(const std::vector<std::string>& argv, const std::vector<std::string>* env,
+					 int stdin_fd, int stdout_fd) const;
+	void finishProcess(CgiProcess* process);
+	void detachProcess(CgiProcess* process);
+	void releasePipe(CgiProcess* process, int fd);
 
-	// poll i/o
-	bool handleCgiStdoutRead(int pipe_stdout, std::string& output) const;
-	bool handleCgiStdinWrite(int pipe_stdin, const std::string& body, 
-							size_t& bytes_written, bool& stdin_closed, 
-							std::vector<struct pollfd>& cgi_fds) const;
-	std::string handleParentProcess(int pipe_stdout[2], int pipe_stdin[2], 
-								   const HttpRequest& request, pid_t child_pid) const;
-
-	// cgi environment and execution
-	void initializeInterpreters();
-	std::vector<std::string> setupEnvironment(const HttpRequest& request, 
-                                                     const std::string& script_path) const;
-	std::string getInterpreter(const std::string& script_path,
-							  const std::map<std::string, std::string>& interpreters) const;
+	// worker pool
+	CgiWorkerPool* getWorkerPool(const LocationConfig* location);
+	void configureWorkerPool(CgiWorkerPool* pool, const LocationConfig* location);
+	CgiWorker* spawnWorker(CgiWorkerPool* pool);
+	CgiWorker* acquireWorker(CgiWorkerPool* pool);
+	void releaseWorker(CgiWorker* worker, bool healthy);
+	void retireWorker(CgiWorkerPool* pool, CgiWorker* worker);
+	BufferChain executeOnWorker(CgiWorker* worker, const std::string& script_path,
+								const HttpRequest& request, const std::string& cache_key,
+								const LocationConfig* location);
+	bool readWorkerFrame(CgiProcess* process, const char* data, size_t len);
+	void shrinkWorkerPools();
 
-	// cgi output
-	std::string readFromPipe(int pipe_fd) const;
-	std::string parseCgiOutput(const std::string& raw_output) const;
-	std::string generateCgiResponse(const std::string& cgi_headers, const std::string& body) const;
+	// concurrency limit
+	BufferChain enqueue(const HttpRequest& request, const LocationConfig* location,
+						const std::string& script_path, const std::string& cache_key);
+	void releaseSlot(CgiProcess* process);
+	void startQueued(const std::string& key);
+	void failQueued(const CgiQueuedRequest& queued, const BufferChain& error);
+	void expireQueued();
+	BufferChain overloadedResponse() const;
+
+	// response cache
+	BufferChain runScript(const HttpRequest& request, const LocationConfig* location,
+						  const std::string& script_path, const std::string& cache_key);
+	BufferChain handleCachedRequest(const HttpRequest& request, const LocationConfig* location,
+									const std::string& script_path);
+	void completeCacheFill(CgiProcess* process, const std::string& tail, bool complete);
+
+	// poll i/o
+	void handleCgiStdoutRead(CgiProcess* process);
+	void handleCgiStdinWrite(CgiProcess* process);
+	void relayOutput(CgiProcess* process, const char* data, size_t len);
 
 	// cgi utilities
-	std::string generateErrorResponse(int status_code, const std::string& status_text) const;
+	BufferChain generateErrorResponse(int status_code, const std::string& status_text) const;
 	bool isExecutable(const std::string& path) const;
 	std::string getScriptPath(const std::string& uri) const;
 
@@ -72,13 +191,29 @@ public:
 	CgiHandler(const std::string& cgi_bin_path, WebServer* web_server);
 	~CgiHandler();
 	
-	bool isCgiRequest(const std::string& uri) const;
+	bool isCgiRequest(const HttpRequest& request) const;
 	void setCgiBinPath(const std::string& path);
-	std::string execute(const std::string& script_path, 
+	// both return an error response, or "" once the script runs in the background
+	BufferChain execute(const std::string& script_path, 
 					   const HttpRequest& request,
-					   const std::map<std::string, std::string>& interpreters) const;
-	std::string handleCgiRequest(const HttpRequest& request) const;
+					   const std::string& interpreter,
+					   const std::string& cache_key = "",
+					   const LocationConfig* location = NULL);
+	BufferChain handleCgiRequest(const HttpRequest& request, const LocationConfig* location = NULL);
+	void startWorkerPools(const std::vector<ServerConfig>& servers);
 	void setWebServer(WebServer* web_server);
+	std::vector<std::string> setupEnvironment(const HttpRequest& request, 
+                                                     const std::string& script_path) const;
+
+	// event loop hooks
+	bool isCgiFd(int fd) const;
+	bool hasPendingResponse(int client_fd) const;
+	short getPollEvents(int fd) const;
+	void handleCgiEvent(int fd, short revents);
+	void reapChildren();
+	void checkTimeouts();
+	void abortClient(int client_fd);
+	void shutdown();
 };
 
 #endif
\ No newline at end of file
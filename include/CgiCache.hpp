@@ -0,0 +1,45 @@
+#ifndef CGICACHE_HPP
+#define CGICACHE_HPP
+
+#include <string>
+#include <map>
+#include <vector>
+#include <ctime>
+#include "HttpRequest.hpp"
+#include "BufferChain.hpp"
+
+struct CgiCacheEntry {
+	BufferChain response;	// complete http response as the first client got it, shared by every hit
+	time_t expires;
+	time_t stale_until;		// served while a refresh runs, until then
+
+	CgiCacheEntry() : expires(0), stale_until(0) {}
+};
+
+// micro-cache for GET cgi responses, enabled per location with cgi_cache.
+// lifetimes come from the script's Cache-Control, the location gives defaults
+class CgiCache {
+private:
+	std::map<std::string, CgiCacheEntry> _entries;
+	size_t _size;
+	static const size_t MAX_SIZE = 64 * 1024 * 1024;
+
+	static bool parseHead(const std::string& response, int& status,
+						  std::map<std::string, std::string>& headers);
+	static bool cacheControlValue(const std::string& cache_control, const std::string& name, int& value);
+	void erase(std::map<std::string, CgiCacheEntry>::iterator it);
+	void purgeExpired(time_t now);
+
+public:
+	enum Lookup { MISS, HIT, STALE };
+	static const size_t MAX_ENTRY_SIZE = 1024 * 1024;
+
+	CgiCache();
+
+	static std::string makeKey(const HttpRequest& request, const std::vector<std::string>& headers);
+
+	Lookup lookup(const std::string& key, BufferChain& response);
+	bool store(const std::string& key, const BufferChain& response, int valid, int stale);
+};
+
+#endif
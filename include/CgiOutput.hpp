@@ -0,0 +1,41 @@
+#ifndef CGIOUTPUT_HPP
+#define CGIOUTPUT_HPP
+
+#include <string>
+#include <cstddef>
+
+// turns the stdout of a cgi style application into an http response while it
+// is still being produced. the header block is parsed once it is complete
+// (Status:, Location:, Content-Length:), after that the body is passed through,
+// chunked if the application did not announce a length. HTTP/1.0 clients
+// can't read chunks, their unannounced bodies end when the connection closes
+class CgiOutputStream {
+private:
+	std::string _pending;		// output before the end of the header block
+	bool _headers_done;
+	bool _chunked;
+	bool _http10;
+	bool _finished;
+	int _status_code;
+	size_t _body_bytes;
+
+	bool findHeaderEnd(size_t& headers_len, size_t& body_start) const;
+	std::string buildHead(const std::string& cgi_headers, bool has_length);
+	std::string encodeBody(const char* data, size_t len);
+
+public:
+	CgiOutputStream();
+
+	void setClientVersion(const std::string& version) { _http10 = version == "HTTP/1.0"; }
+
+	// both return the bytes that are ready to go to the client
+	std::string feed(const char* data, size_t len);
+	std::string finish();
+
+	bool headersDone() const { return _headers_done; }
+	bool hasOutput() const { return _headers_done || !_pending.empty(); }
+	int getStatusCode() const { return _status_code; }
+	size_t getBodyBytes() const { return _body_bytes; }
+};
+
+#endif
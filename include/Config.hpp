@@ -10,6 +10,19 @@
 #include <algorithm>
 
 #include "WebServer.hpp"
+#include "LocationTree.hpp"
+#include "BufferChain.hpp"
+#include "MimeTypes.hpp"
+#include "AccessLog.hpp"
+#include "Metrics.hpp"
+
+// what runs a cgi script of one extension
+struct CgiInterpreter {
+	std::string path;		// "" runs the script itself
+	bool usable;			// exec check, done once when the config is loaded
+
+	CgiInterpreter() : usable(true) {}
+};
 
 struct LocationConfig {
 	std::string path;
@@ -17,32 +30,111 @@ struct LocationConfig {
 	std::vector<std::string> allowed_methods;
 	std::string index;
 	bool autoindex;
-	std::string cgi_extension;
-	std::string cgi_path;
+	std::vector<std::string> cgi_extensions;	// "cgi_extension .py .sh;"
+	std::vector<std::string> cgi_paths;		// "cgi_path /usr/bin/python3 /bin/bash;", paired by position
+	std::map<std::string, CgiInterpreter> cgi_handlers;	// extension -> interpreter, empty = no cgi
 	std::string upload_path;
 	std::map<int, std::string> error_pages;
 	std::string redirect;
+	std::string fastcgi_pass;	// "unix:/path" or "host:port"
+	std::string proxy_pass;		// "http://<upstream name>" or "http://host:port"
+	std::string cgi_worker;		// shim run by the persistent worker pool, empty = fork per request
+	std::string cgi_worker_interpreter;
+	size_t cgi_workers_min;
+	size_t cgi_workers_max;
+	size_t cgi_worker_max_requests;
+	int cgi_worker_idle_timeout;
+	int cgi_cache_valid;		// seconds a GET cgi response is reused, 0 = no cache
+	int cgi_cache_stale;		// seconds it may still be served while refreshing
+	std::vector<std::string> cgi_cache_key;	// request headers that select a variant
+	size_t cgi_max_concurrent;	// scripts running at once, 0 = unlimited
+	size_t cgi_queue_size;		// requests waiting for a slot before 503s
+	int cgi_timeout;			// seconds without output, also the longest wait in the queue
+	bool stub_status;			// answered with the metrics page
+	int metrics_slot;			// latency histogram, set by Config::buildRoutes
+	std::string key;			// listen address, server name and path, unique per config;
+								// cgi worker pools and limits are kept per key
 	
-	LocationConfig() : autoindex(false) {}
+	LocationConfig() : autoindex(false), cgi_workers_min(1), cgi_workers_max(4),
+		cgi_worker_max_requests(500), cgi_worker_idle_timeout(60),
+		cgi_cache_valid(0), cgi_cache_stale(0), cgi_max_concurrent(0), cgi_queue_size(0),
+		cgi_timeout(30), stub_status(false), metrics_slot(-1) {}
+};
+
+struct UpstreamServerConfig {
+	std::string address;	// host:port
+	int weight;
+	int max_fails;			// failures within fail_timeout that take it out, 0 = never
+	int fail_timeout;		// seconds, also how long it stays out
+
+	UpstreamServerConfig() : weight(1), max_fails(1), fail_timeout(10) {}
+};
+
+struct UpstreamConfig {
+	std::string name;
+	std::vector<UpstreamServerConfig> servers;
+	std::string balance;	// "round_robin", "least_conn" or "hash"
+	std::string hash_key;	// $request_uri or $http_<header>
+	size_t keepalive;		// idle connections kept per server
+
+	UpstreamConfig() : balance("round_robin"), keepalive(8) {}
 };
 
 struct ServerConfig {
     std::string host;
     int port;
-    std::string server_name;
+    bool default_server;	// "listen ... default_server", else the first block on the address
+    std::vector<std::string> server_names;	// exact, "*.example.com" or "www.example.*"
     std::string root;
     std::string index;
     size_t client_max_body_size;
     std::map<int, std::string> error_pages;
+    std::map<int, BufferChain> error_bodies;	// error_pages contents, read at load
     std::vector<LocationConfig> locations;
+    LocationTree location_tree;	// over locations[i].path, built by Config::buildRoutes
+    std::string access_log;		// "access_log <path> [format] [sample=N];", empty = off
+    std::string access_log_format;
+    size_t access_log_sample;	// log one request in N
+    int access_log_id;			// Logger::openAccessLog, set by Config::buildAccessLogs
+    AccessLogFormat access_format;
+
+    ServerConfig() : port(0), default_server(false), client_max_body_size(0),
+        access_log_format("combined"), access_log_sample(1), access_log_id(-1) {}
+};
+
+// the server blocks sharing one listen address, by name. built once after
+// parsing, a request's server is then picked from its listener and Host
+struct ListenRoutes {
+	std::string host;
+	int port;
+	const ServerConfig* default_server;
+	std::map<std::string, const ServerConfig*> exact_names;
+	std::map<std::string, const ServerConfig*> leading_wildcards;	// "*.example.com" kept as ".example.com"
+	std::map<std::string, const ServerConfig*> trailing_wildcards;	// "www.example.*" kept as "www.example."
+
+	ListenRoutes() : port(0), default_server(NULL) {}
+	const ServerConfig* resolve(const std::string& host_header) const;
 };
 
 class Config {
 private:
+    int _refs;	// ConfigRef handles on this snapshot
     std::vector<ServerConfig> _servers;
+    std::map<std::string, UpstreamConfig> _upstreams;
+    std::map<std::string, ListenRoutes> _routes;	// "host:port" -> virtual hosts
+    std::string _error_log;	// top level error_log, empty logs to stdout/stderr
+    std::map<std::string, std::string> _log_formats;	// top level log_format, by name
+    MimeTypes _mime_types;	// built-in, then mime_types files and types blocks in order
     void parseSimpleDirective(const std::string& line, ServerConfig& server);
     ServerConfig getDefaultServerConfig();
     bool finalizeConfig(bool in_server_block);
+    void buildRoutes();
+    bool buildAccessLogs();
+    bool parseTopLevelDirective(const std::string& line);
+    void loadErrorPages(ServerConfig& server);
+    void buildCgiHandlers(LocationConfig& location, std::map<std::string, bool>& checked);
+    static CgiInterpreter makeInterpreter(const std::string& path, std::map<std::string, bool>& checked);
+    static std::string getExtension(const std::string& uri);
 
     //conf utility
     bool shouldSkipLine(const std::string& line);
@@ -56,6 +148,12 @@ private:
     bool handleDirective(bool in_server_block, const std::string& line, ServerConfig& current_server,
                             int line_number, std::ifstream& file);
     
+    bool isUpstreamStart(const std::string& line);
+    bool parseUpstreamBlock(std::ifstream& file, const std::string& line, int& line_number);
+    bool isTypesStart(const std::string& line);
+    bool parseTypesBlock(std::ifstream& file, int& line_number);
+    void parseUpstreamServer(const std::vector<std::string>& tokens, UpstreamConfig& upstream);
+
     bool isLocationStart(const std::string& line);
     bool isLocationEnd(const std::string& line);
     std::string extractLocationPath(const std::string& line);
@@ -80,6 +178,13 @@ public:
 	bool validateConfig() const;
     
     const std::vector<ServerConfig>& getServers() const { return _servers; }
+    const std::map<std::string, ListenRoutes>& getRoutes() const { return _routes; }
+    const std::string& getErrorLog() const { return _error_log; }
+    const MimeTypes& getMimeTypes() const { return _mime_types; }
+    const UpstreamConfig* findUpstream(const std::string& name) const;
+    const CgiInterpreter* findCgiHandler(const LocationConfig* location, const std::string& uri) const;
+
+    friend class ConfigRef;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef CONFIGREF_HPP
+#define CONFIGREF_HPP
+
+class Config;
+
+// shared handle on a parsed config. a reload swaps in a new snapshot, requests
+// and scripts that started on the old one hold it until they are done. the
+// count is not atomic, everything runs on the event loop
+class ConfigRef {
+private:
+	Config* _config;
+
+	void release();
+
+public:
+	ConfigRef();
+	explicit ConfigRef(Config* config);	// takes ownership
+	ConfigRef(const ConfigRef& other);
+	ConfigRef& operator=(const ConfigRef& other);
+	~ConfigRef();
+
+	const Config* operator->() const { return _config; }
+	const Config* get() const { return _config; }
+	void reset();
+};
+
+#endif
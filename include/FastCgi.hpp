@@ -0,0 +1,120 @@
+#ifndef FASTCGI_HPP
+#define FASTCGI_HPP
+
+#include <string>
+#include <map>
+#include <vector>
+#include <ctime>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "CgiOutput.hpp"
+#include "BufferChain.hpp"
+#include "utils.hpp"
+
+class WebServer;
+
+// fastcgi record types we send or expect (FastCGI spec 1.0, section 8)
+enum FastCgiRecordType {
+	FCGI_BEGIN_REQUEST = 1,
+	FCGI_ABORT_REQUEST = 2,
+	FCGI_END_REQUEST = 3,
+	FCGI_PARAMS = 4,
+	FCGI_STDIN = 5,
+	FCGI_STDOUT = 6,
+	FCGI_STDERR = 7,
+	FCGI_GET_VALUES = 9,
+	FCGI_GET_VALUES_RESULT = 10
+};
+
+struct FastCgiRequest {
+	unsigned short id;
+	int client_fd;			// -1 once the client is gone, records are then dropped
+	std::string records;	// encoded request, kept to retry on a stale connection
+	CgiOutputStream output;
+	bool received;			// got any record back
+	time_t last_activity;	// start, last record or abort, for the timeout
+
+	FastCgiRequest() : id(0), client_fd(-1), received(false), last_activity(0) {}
+};
+
+// one persistent connection to a backend. requests are demultiplexed by id;
+// more than one runs at a time only if the backend announced FCGI_MPXS_CONNS
+struct FastCgiConnection {
+	int fd;
+	std::string address;
+	bool connected;
+	bool mpxs;
+	bool reused;
+	std::string write_buffer;
+	std::string read_buffer;
+	std::map<unsigned short, FastCgiRequest*> requests;
+	unsigned short next_id;
+	time_t idle_since;
+
+	FastCgiConnection() : fd(-1), connected(false), mpxs(false), reused(false),
+		next_id(1), idle_since(0) {}
+};
+
+class FastCgiClient {
+private:
+	WebServer* _web_server;
+	std::map<std::string, std::vector<FastCgiConnection*> > _pools;	// address -> connections
+	std::map<int, FastCgiConnection*> _connections;					// socket -> connection
+	std::map<int, FastCgiConnection*> _client_connections;			// client fd -> connection
+	static const size_t MAX_IDLE_CONNECTIONS = 8;		// per backend address
+	static const size_t MAX_REQUESTS_PER_CONNECTION = 16;	// only with FCGI_MPXS_CONNS
+	static const int REQUEST_TIMEOUT = 30;		// seconds without a record
+	static const int IDLE_TIMEOUT = 60;
+
+	// connections
+	FastCgiConnection* acquireConnection(const std::string& address);
+	FastCgiConnection* openConnection(const std::string& address);
+	int connectSocket(const std::string& address) const;
+	void closeConnection(FastCgiConnection* conn, bool retry);
+	bool releaseIfIdle(FastCgiConnection* conn);
+
+	// records
+	static void appendRecord(std::string& out, unsigned char type, unsigned short id,
+							 const char* data, size_t len);
+	static void appendNameValue(std::string& out, const std::string& name, const std::string& value);
+	std::string encodeRequest(unsigned short id, const std::vector<std::string>& env,
+							  const std::string& body) const;
+	void processRecords(FastCgiConnection* conn);
+	bool handleRecord(FastCgiConnection* conn, unsigned char type, unsigned short id,
+					  const std::string& content);
+	void handleValuesResult(FastCgiConnection* conn, const std::string& content);
+
+	// i/o
+	void handleConnect(FastCgiConnection* conn);
+	void handleRead(FastCgiConnection* conn);
+	void handleWrite(FastCgiConnection* conn);
+	void startRequest(FastCgiConnection* conn, FastCgiRequest* request);
+	bool completeRequest(FastCgiConnection* conn, FastCgiRequest* request);
+	void failRequest(FastCgiRequest* request, int status_code, const std::string& status_text);
+	void abortRequest(FastCgiConnection* conn, FastCgiRequest* request);
+	bool clientsBehind(const FastCgiConnection* conn) const;
+
+public:
+	FastCgiClient(WebServer* web_server);
+	~FastCgiClient();
+
+	// returns an error response, or "" once the request is on its way
+	BufferChain handleRequest(const std::string& address, int client_fd, const std::string& version,
+							  const std::vector<std::string>& env, const std::string& body);
+
+	// event loop hooks
+	bool isFastCgiFd(int fd) const;
+	bool hasPendingResponse(int client_fd) const;
+	short getPollEvents(int fd) const;
+	void handleEvent(int fd, short revents);
+	void checkTimeouts();
+	void abortClient(int client_fd);
+	void shutdown();
+};
+
+#endif
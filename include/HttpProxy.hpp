@@ -0,0 +1,157 @@
+#ifndef HTTPPROXY_HPP
+#define HTTPPROXY_HPP
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <ctime>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "HttpRequest.hpp"
+#include "BufferChain.hpp"
+#include "utils.hpp"
+
+class WebServer;
+struct UpstreamConfig;
+struct ProxyConnection;
+
+struct UpstreamPeer {
+	std::string address;
+	int weight;
+	int current_weight;		// smooth weighted round robin
+	size_t active;			// requests in flight, for least_conn
+	int max_fails;
+	int fail_timeout;
+	int fails;
+	time_t first_fail;
+	time_t down_until;		// passive health check: skipped until then
+	std::vector<ProxyConnection*> idle;
+
+	UpstreamPeer() : weight(1), current_weight(0), active(0), max_fails(1), fail_timeout(10),
+		fails(0), first_fail(0), down_until(0) {}
+};
+
+struct Upstream {
+	std::string name;
+	std::vector<UpstreamPeer> peers;
+	std::string balance;
+	std::string hash_key;
+	size_t keepalive;
+	std::vector<std::pair<unsigned int, size_t> > ring;	// consistent hash points -> peer
+	bool retired;			// replaced by a reload, freed once its last connection closed
+
+	Upstream() : keepalive(8), retired(false) {}
+};
+
+enum ProxyBodyMode {
+	PROXY_BODY_NONE,
+	PROXY_BODY_LENGTH,
+	PROXY_BODY_CHUNKED,
+	PROXY_BODY_UNTIL_CLOSE
+};
+
+// one client request on its way through an upstream. the response head is
+// rewritten for the client, the body is passed through untouched while its
+// framing is tracked to know when the connection can be reused
+struct ProxyRequest {
+	int client_fd;			// -1 once the client is gone
+	Upstream* upstream;
+	std::string data;		// encoded request, kept to retry on another peer
+	std::string hash_key;
+	bool retryable;			// safe to send again after the peer saw it
+	std::set<size_t> tried;
+	size_t bytes_sent;
+	bool received;
+	std::string head;
+	bool head_done;
+	bool keep_alive;		// the upstream lets us reuse the connection
+	ProxyBodyMode body_mode;
+	size_t remaining;		// body bytes, or bytes of the current chunk
+	int chunk_state;
+	std::string chunk_line;
+	time_t last_activity;
+
+	ProxyRequest() : client_fd(-1), upstream(NULL), retryable(false), bytes_sent(0),
+		received(false), head_done(false), keep_alive(false), body_mode(PROXY_BODY_NONE),
+		remaining(0), chunk_state(0), last_activity(0) {}
+};
+
+// an http/1.1 connection to one peer, carrying one request at a time
+struct ProxyConnection {
+	int fd;
+	Upstream* upstream;
+	size_t peer;
+	bool connected;
+	bool reused;
+	ProxyRequest* request;
+	time_t idle_since;
+
+	ProxyConnection() : fd(-1), upstream(NULL), peer(0), connected(false), reused(false),
+		request(NULL), idle_since(0) {}
+};
+
+class HttpProxy {
+private:
+	WebServer* _web_server;
+	std::map<std::string, Upstream*> _upstreams;		// proxy_pass target -> upstream
+	std::vector<Upstream*> _retired_upstreams;
+	std::map<int, ProxyConnection*> _connections;		// socket -> connection
+	std::map<int, ProxyConnection*> _client_connections;	// client fd -> connection
+	int _splice_pipe[2];
+	static const int CONNECT_TIMEOUT = 10;
+	static const int READ_TIMEOUT = 60;
+	static const int IDLE_TIMEOUT = 60;
+
+	// upstreams and balancing
+	Upstream* getUpstream(const std::string& target, const UpstreamConfig* config);
+	void buildRing(Upstream* upstream);
+	bool isPeerUp(const UpstreamPeer& peer, time_t now) const;
+	int selectPeer(ProxyRequest* request);
+	void markFailed(Upstream* upstream, size_t peer);
+	void markSucceeded(Upstream* upstream, size_t peer);
+
+	// connections
+	ProxyConnection* acquireConnection(Upstream* upstream, size_t peer);
+	int connectSocket(const std::string& address) const;
+	bool dispatch(ProxyRequest* request);
+	void closeConnection(ProxyConnection* conn);
+	void releaseConnection(ProxyConnection* conn);
+	void failConnection(ProxyConnection* conn, bool peer_failed, int status_code,
+						const std::string& status_text);
+
+	// request and response
+	std::string encodeRequest(const HttpRequest& request) const;
+	void handleConnect(ProxyConnection* conn);
+	void handleRead(ProxyConnection* conn);
+	bool handleWrite(ProxyConnection* conn);
+	int parseHead(ProxyConnection* conn);
+	void processBody(ProxyConnection* conn, const char* data, size_t len);
+	size_t consumeBody(ProxyRequest* request, const char* data, size_t len, bool& done);
+	void spliceBody(ProxyConnection* conn);
+	void completeRequest(ProxyConnection* conn);
+
+public:
+	HttpProxy(WebServer* web_server);
+	~HttpProxy();
+
+	// returns an error response, or "" once the request is on its way
+	BufferChain handleRequest(const HttpRequest& request, const std::string& target,
+							  const UpstreamConfig* config);
+
+	// event loop hooks
+	bool isProxyFd(int fd) const;
+	bool hasPendingResponse(int client_fd) const;
+	short getPollEvents(int fd) const;
+	void handleEvent(int fd, short revents);
+	void checkTimeouts();
+	void abortClient(int client_fd);
+	void reload();
+	void shutdown();
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include <string>
 #include <map>
 #include <vector>
+#include "ConfigRef.hpp"
+#include "Arena.hpp"
 
 enum HttpMethod {
     GET,
@@ -12,6 +14,18 @@ enum HttpMethod {
     UNKNOWN
 };
 
+struct ServerConfig;
+struct LocationConfig;
+struct CgiInterpreter;
+
+// one request header, both strings live in the request's arena
+struct HeaderField {
+    const char* name;
+    const char* value;
+    size_t name_length;
+    size_t value_length;
+};
+
 struct FormFile {
     std::string name;
     std::string filename;
@@ -24,8 +38,10 @@ private:
     HttpMethod _method;
     std::string _uri;
     std::string _version;
-    std::map<std::string, std::string> _headers;
+    Arena _arena;                           // header slices, reset with the request
+    std::vector<HeaderField> _headers;      // in the order the client sent them
     std::string _body;
+    size_t _length;                         // bytes of the raw buffer this request used, 0 = unknown
     bool _is_complete;
     bool _is_chunked;
     // size_t _bytes_remaining;
@@ -34,12 +50,24 @@ private:
     std::map<std::string, std::string> _form_data;
     std::vector<FormFile> _uploaded_files;
     bool _is_multipart;
+    int _client_fd;
+    ConfigRef _config;                      // snapshot the route below points into
+    const ServerConfig* _server_config;     // resolved once from the listener and Host
+    const LocationConfig* _location_config;
+    const CgiInterpreter* _cgi_interpreter;  // set if the path's extension is a cgi one there
+
+    bool parseHead(const std::string& raw_request, size_t head_end);
+    const HeaderField* findHeader(const char* key) const;
+    void copyHeaders(const HttpRequest& other);
 
 public:
     HttpRequest();
+    HttpRequest(const HttpRequest& other);
+    HttpRequest& operator=(const HttpRequest& other);
     ~HttpRequest();
     
     bool parseRequest(const std::string& raw_request);
+    void reset();	// back to a fresh request, keeps the memory for the next one
 
     // Chunks (xd minecraft chunks)
     bool isChunked() const {return _is_chunked; }
@@ -56,9 +84,24 @@ public:
     HttpMethod getMethod() const { return _method; }
     const std::string& getUri() const { return _uri; }
     const std::string& getVersion() const { return _version; }
-    const std::map<std::string, std::string>& getHeaders() const { return _headers; }
+    const std::vector<HeaderField>& getHeaders() const { return _headers; }
     const std::string& getBody() const { return _body; }
+    size_t getLength() const { return _length; }
+    bool wantsKeepAlive() const;
     bool isComplete() const { return _is_complete; }
+    int getClientFd() const { return _client_fd; }
+    void setClientFd(int client_fd) { _client_fd = client_fd; }
+    const ServerConfig* getServerConfig() const { return _server_config; }
+    const LocationConfig* getLocationConfig() const { return _location_config; }
+    const CgiInterpreter* getCgiInterpreter() const { return _cgi_interpreter; }
+    const ConfigRef& getConfig() const { return _config; }
+    void setRoute(const ConfigRef& config, const ServerConfig* server, const LocationConfig* location,
+                  const CgiInterpreter* cgi_interpreter) {
+        _config = config;
+        _server_config = server;
+        _location_config = location;
+        _cgi_interpreter = cgi_interpreter;
+    }
     
     std::string getHeader(const std::string& key) const;
     std::string methodToString() const;
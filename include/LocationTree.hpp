@@ -0,0 +1,34 @@
+#ifndef LOCATIONTREE_HPP
+#define LOCATIONTREE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+
+struct LocationTreeNode {
+	std::string label;					// edge from the parent
+	std::map<char, size_t> children;	// first byte of the child's label -> node
+	int location;						// index of the location ending here, -1 = none
+
+	LocationTreeNode() : location(-1) {}
+};
+
+// radix tree over a server's location paths, built once at config load.
+// match() walks the uri once and returns the longest location that ends on
+// a path segment boundary, so /up never matches /uploads. nodes live in a
+// vector and refer to each other by index, so the tree copies with its server
+class LocationTree {
+private:
+	std::vector<LocationTreeNode> _nodes;
+
+	static bool endsSegment(const std::string& uri, size_t pos);
+
+public:
+	LocationTree();
+
+	void clear();
+	void insert(const std::string& path, int location);	// the first of two equal paths wins
+	int match(const std::string& uri) const;			// location index, or -1
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <string>
+
+// log lines are copied into a ring owned by the calling thread and written
+// out in batches by a background thread, so the event loop never waits on a
+// terminal or a disk. a full ring drops the line and counts it, the writer
+// reports the count. before start() and after stop() lines are written
+// directly. access logs go through the same rings, unformatted
+class Logger {
+private:
+	Logger();
+	static void push(int level, int target, const std::string& message);
+
+public:
+	static void start();
+	static void stop();		// writes out what is queued and joins the writer
+	static void setFile(const std::string& path);	// empty goes back to stdout/stderr
+	static void requestReopen();	// from the SIGUSR1 handler, for log rotation
+	static void write(int level, const std::string& message);
+	static int openAccessLog(const std::string& path);	// same path, same id
+	static void writeAccess(int log, const std::string& line);
+};
+
+#endif
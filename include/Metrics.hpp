@@ -0,0 +1,50 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <cstddef>
+
+enum MetricCounter {
+	METRIC_CONNECTIONS_ACCEPTED,
+	METRIC_CONNECTIONS_HANDLED,
+	METRIC_REQUESTS,
+	METRIC_RESPONSES_1XX,		// the classes follow in order, see countResponse
+	METRIC_RESPONSES_2XX,
+	METRIC_RESPONSES_3XX,
+	METRIC_RESPONSES_4XX,
+	METRIC_RESPONSES_5XX,
+	METRIC_BYTES_RECEIVED,
+	METRIC_BYTES_SENT,
+	METRIC_CGI_SPAWNS,
+	METRIC_CGI_TIMEOUTS,
+	METRIC_CGI_QUEUE_TIMEOUTS,
+	METRIC_CGI_CACHE_HITS,
+	METRIC_CGI_CACHE_STALE,
+	METRIC_CGI_CACHE_MISSES,
+	METRIC_COUNT
+};
+
+// connection states, counted by WebServer when scraped
+struct MetricsGauges {
+	size_t active;
+	size_t reading;
+	size_t writing;
+	size_t idle;
+};
+
+// counters and latency histograms. every thread bumps its own block with
+// plain increments, a scrape sums the blocks. histograms are per location,
+// the slot is resolved once when the config loads
+class Metrics {
+private:
+	Metrics();
+
+public:
+	static void add(MetricCounter counter, size_t value = 1);
+	static void countResponse(int status);
+	static int locationSlot(const std::string& server, const std::string& location);
+	static void observe(int slot, long microseconds);
+	static void render(std::string& out, const MetricsGauges& gauges);
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef MIMETYPES_HPP
+#define MIMETYPES_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// extension <-> content type, in two open addressing tables built when the
+// config loads. lookups hash the extension in place, case-insensitively, so
+// resolving a path's type neither copies nor allocates. starts with a
+// built-in table; mime.types files and types {} blocks add to it and a later
+// entry for an extension replaces the earlier one
+class MimeTypes {
+private:
+	struct Entry {
+		std::string extension;	// lowercase, without the dot
+		size_t type;			// index into _types
+	};
+
+	std::vector<std::string> _types;
+	std::vector<std::string> _dotted;		// ".ext" of each type's first extension
+	std::vector<Entry> _entries;
+	std::vector<int> _by_extension;		// slots, index into _entries or -1
+	std::vector<int> _by_type;			// slots, index into _types or -1
+	std::string _default_type;
+
+	static size_t hash(const char* data, size_t length);
+	static bool sameNoCase(const std::string& stored, const char* data, size_t length);
+	int findExtension(const char* data, size_t length) const;
+	int findType(const char* data, size_t length) const;
+	size_t internType(const std::string& type);
+	void rehash();
+
+public:
+	MimeTypes();
+
+	void add(const std::string& type, const std::string& extension);
+	bool addLine(const std::string& line);	// "type ext ext;" as in mime.types
+	bool loadFile(const std::string& path, std::string& error);
+	void setDefaultType(const std::string& type) { _default_type = type; }
+
+	// by the extension of the path's last segment, the default type if unknown
+	const std::string& typeFor(const std::string& path) const;
+	// ".ext" for a type, parameters ignored; empty if unknown
+	const std::string& extensionFor(const std::string& type) const;
+	size_t size() const { return _entries.size(); }
+};
+
+#endif
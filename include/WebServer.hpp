@@ -3,10 +3,12 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <poll.h>
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
 #include <iostream>
 #include <fcntl.h>
@@ -21,63 +23,155 @@
 
 #include "WebServer.hpp"
 #include "Config.hpp"
+#include "ConfigRef.hpp"
+#include "BufferChain.hpp"
 #include "utils.hpp"
 #include "Cgi.hpp"
+#include "FastCgi.hpp"
+#include "HttpProxy.hpp"
+#include "HttpRequest.hpp"
+#include "Logger.hpp"
+#include "AccessLog.hpp"
+#include "Metrics.hpp"
+#include "Autoindex.hpp"
 
 class   Config;
 struct  LocationConfig;
+struct  ServerConfig;
+struct  ListenRoutes;
 class   HttpRequest;
 class   CgiHandler;
+class   FastCgiClient;
+class   HttpProxy;
+
+// per connection read state, pooled and reused across connections and
+// across the requests of a keep-alive connection
+struct ClientConnection {
+	std::string read_buffer;	// bytes not yet consumed by a request
+	HttpRequest request;
+	bool busy;					// a response is queued, the next request waits for it
+	bool keep_alive;			// reuse the connection once the response is out
+	size_t requests;
+	bool answering;				// a request is in, its response not yet out
+	int metrics_slot;
+	AccessEntry access;
+	ConfigRef access_config;	// keeps access_server alive until the line is written
+	const ServerConfig* access_server;
+	int upload_fd;				// the body is spliced straight into this file, -1 otherwise
+	size_t upload_remaining;	// body bytes still in the socket
+	std::string upload_path;
+
+	ClientConnection() : busy(false), keep_alive(false), requests(0), answering(false),
+		metrics_slot(-1), access_server(NULL), upload_fd(-1), upload_remaining(0) {}
+};
 
 class WebServer {
 	private:
     // classes
     CgiHandler* _cgi_handler;
-    Config* _config;
+    FastCgiClient* _fastcgi_client;
+    HttpProxy* _http_proxy;
+    ConfigRef _config;             // current snapshot, swapped on SIGHUP
+    Autoindex _autoindex;          // directory listings, dropped on reload
+    std::string _config_file;
 	// std::string config_file_name;
 
     // poll functionality
 	std::vector<struct pollfd> _poll_fds;
-	std::vector<int> _server_sockets;
-	std::map<int, std::string> _client_buffers; // incoming data buffers
-	std::map<int, std::string> _client_write_buffers; // outgoing buffer
+	std::map<int, const ListenRoutes*> _listeners;        // listening socket -> virtual hosts on it
+	std::map<int, const ListenRoutes*> _client_listeners; // client fd -> the listener it came in on
+	const ServerConfig* _current_server;             // request being answered, for its error pages
+	bool _keep_alive_response;                       // response being built may keep the connection
+	std::map<int, ClientConnection*> _connections;   // incoming data and request per client
+	std::vector<ClientConnection*> _connection_pool; // released connections, ready for reuse
+	size_t _connection_serial;                       // $connection in the access log
+	size_t _access_sequence;                         // for access_log sampling
+	std::map<int, BufferChain> _client_write_buffers; // outgoing bytes, written with writev/sendfile
 	std::map<int, bool> _clients_ready_to_write;     // check clients with queued responses
 	std::map<int, time_t> _client_timeouts;
-	std::map<int, HttpRequest*> _client_requests;
+	std::map<int, bool> _client_expect_continue;     // 100 Continue queued, final response still pending
+	std::map<int, bool> _client_streaming;           // response is still being produced by a backend
+	std::set<int> _removed_fds;                      // closed during the current poll round
+	int _signal_pipe[2];                             // SIGCHLD wakes poll through this
+	int _upload_pipe[2];                             // socket -> file splices, drained every time
 	static const int REQUEST_TIMEOUT = 30;
+	static const size_t MAX_POOLED_CONNECTIONS = 256;
+	static const size_t MAX_PIPELINED = 64 * 1024;   // held while a response is still going out
+	static const size_t DIRECT_UPLOAD_MIN = 64 * 1024; // smaller upload bodies are simply buffered
+	static const size_t UPLOAD_SPLICE_BUDGET = 1024 * 1024; // per poll round and upload
+	static const size_t MAX_CLIENT_BACKLOG = 256 * 1024; // queued output that makes a client "behind"
     // sockets
     int createServerSocket(const std::string& host, int port);
 
     // connection handling
     void handleNewConnection(int server_fd);
-	void handleClientData(int client_fd, int poll_index);	// processes incoming data from client (called when POLLIN ready)
-	void handleClientWrite(int client_fd, int poll_index);	// sends queued response data to client (called when POLLOUT ready)
-	void queueResponse(int client_fd, const std::string& response);
-	void cleanupClient(int client_fd, int poll_index);
+	void handleClientData(int client_fd);	// processes incoming data from client (called when POLLIN ready)
+	void handleClientWrite(int client_fd);	// sends queued response data to client (called when POLLOUT ready)
+	void processRequest(int client_fd);
+	void finishResponse(int client_fd);
+	ClientConnection* acquireConnection();
+	void releaseConnection(ClientConnection* conn);
+	ClientConnection* findConnection(int client_fd) const;
+	void beginAccess(ClientConnection* conn, const HttpRequest& request);
+	void noteResponseHead(int client_fd, const char* data, size_t length);
+	void noteUpstreamDone(int client_fd);
+	void writeAccess(ClientConnection* conn);
+	void completeRequest(ClientConnection* conn);
+	BufferChain generateMetricsResponse();
+	void handleSignalPipe();
+	void reloadConfig();
+	void updatePollEvents();
+	bool isServerSocket(int fd) const;
+	bool isAwaitingOutput(int client_fd) const;
+	bool hasPendingResponse(int client_fd) const;
+	bool isBackendRequest(const HttpRequest& request) const;
+	void queueResponse(int client_fd, const BufferChain& response);
+	void queueContinue(int client_fd);
+	bool handleExpectContinue(int client_fd, HttpRequest& request);
+	void routeRequest(int client_fd, HttpRequest& request);
+	bool startUpload(int client_fd, HttpRequest& request, size_t body_start);
+	void spliceUpload(int client_fd);
+	bool drainUploadPipe(int file_fd, size_t length);
+	void finishUpload(int client_fd, bool saved);
+	void abortUpload(ClientConnection* conn);
+	void cleanupClient(int client_fd);
 	void checkClientTimeouts();
 
     // http request/resopnse
-    std::string generateResponse(const HttpRequest& request);
-	std::string handleGetRequest(const HttpRequest& request);
-	std::string handlePostRequest(const HttpRequest& request);
-	std::string handleDeleteRequest(const HttpRequest& request);
-	std::string handleRedirect(const LocationConfig* location);
+    BufferChain generateResponse(const HttpRequest& request);
+	BufferChain handleGetRequest(const HttpRequest& request);
+	BufferChain handlePostRequest(const HttpRequest& request);
+	BufferChain handleDeleteRequest(const HttpRequest& request);
+	BufferChain handleRedirect(const LocationConfig* location);
+	BufferChain checkRequestHeaders(const HttpRequest& request);
+	bool isMethodAllowed(const LocationConfig* location, const std::string& method);
 
     // special requests
-    std::string handleFileUpload(const HttpRequest& request);
-	std::string handleMultipartUpload(const HttpRequest& request);
-	std::string handleSimpleUpload(const HttpRequest& request);
-	std::string handleFileUploadToLocation(const HttpRequest& request, const LocationConfig* location_config);
-	std::string handleFormSubmission(const HttpRequest& request);
-	std::string handlePostEcho(const HttpRequest& request);
+    BufferChain handleFileUpload(const HttpRequest& request);
+	BufferChain handleMultipartUpload(const HttpRequest& request);
+	BufferChain handleSimpleUpload(const HttpRequest& request);
+	BufferChain handleFileUploadToLocation(const HttpRequest& request, const LocationConfig* location_config);
+	std::string uploadDirectory(const HttpRequest& request);
+	int createUploadFile(const std::string& upload_dir, int client_fd, std::string& file_path);
+	bool storeUpload(const std::string& upload_dir, const HttpRequest& request, std::string& file_path);
+	BufferChain uploadResponse(const HttpRequest& request, const std::string& file_path, size_t size);
+	BufferChain handleFormSubmission(const HttpRequest& request);
+	BufferChain handleProxyRequest(const HttpRequest& request, const LocationConfig* location_config);
+	BufferChain handleFastCgiRequest(const HttpRequest& request, const ServerConfig* server_config,
+			const LocationConfig* location_config);
+	BufferChain handlePostEcho(const HttpRequest& request);
 	// std::string generateCgiDirectoryListing(const std::string& dir_path, const std::string& uri);
-	std::string handleDirectoryRequest(const std::string& dir_path, const std::string& uri, const LocationConfig* location_config);
-	std::string generateDirectoryListing(const std::string& dir_path, const std::string& uri);
+	BufferChain handleDirectoryRequest(const std::string& dir_path, const std::string& uri, const LocationConfig* location_config);
+	BufferChain generateDirectoryListing(const std::string& dir_path, const std::string& uri);
 
     // server utilities
-    std::string generateSuccessResponse(const std::string& content, const std::string& content_type);
-	std::string getStatusMessage(int code);
-	std::string getContentType(const std::string& file_path);
+    BufferChain generateSuccessResponse(std::string content, const std::string& content_type);
+	BufferChain generateFileResponse(const std::string& file_path);
+	std::string formatSuccessHead(const std::string& content_type, size_t content_length) const;
+	std::string formatErrorHead(int status_code, size_t content_length) const;
+	std::string connectionHeader() const;
+	static std::string getStatusMessage(int code);
+	const std::string& getContentType(const std::string& file_path);
 	// std::string getFilePath(const std::string& uri);
 	std::string getFilePathWithRoot(const std::string& uri, const std::string& root);
 	std::string getFileExtension(const std::string& filename);
@@ -91,9 +185,26 @@ public:
     ~WebServer();
     
     bool initialize(const std::string& config_file);
-	std::string generateErrorResponse(int status_code, const std::string& status_text);
+	BufferChain generateErrorResponse(int status_code, const std::string& status_text);
+
+	// used by CgiHandler to hook its pipes into the main loop
+	void addPollFd(int fd);
+	void removePollFd(int fd);
+	void queueCgiResponse(int client_fd, const BufferChain& response);
+	void queueResponseData(int client_fd, const std::string& data);
+	void queueResponseData(int client_fd, const char* data, size_t length);
+	void finishStreamedResponse(int client_fd);
+	bool isClientConnected(int client_fd) const;
+	size_t getPendingOutput(int client_fd) const;
+	bool isClientBehind(int client_fd) const;
+	void touchClient(int client_fd, size_t sent);
+	void notifyChildExited();
+	void notifyReload();
+
     void run();
     void cleanup();
+
+	friend class MicroBench;	// tools/microbench.cpp times the private helpers
 };
 
 #endif
\ No newline at end of file
@@ -17,7 +17,6 @@ enum LogLevel
 #define LOG_LEVEL INFO_LEVEL
 #endif
 
-std::string get_timestamp();
 void log_debug(const std::string &message);
 void log_info(const std::string &message);
 void log_error(const std::string &message);
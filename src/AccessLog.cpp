@@ -0,0 +1,184 @@
+#include "AccessLog.hpp"
+#include "utils.hpp"
+#include <cctype>
+#include <cstdio>
+#include <ctime>
+
+const char* AccessLogFormat::COMBINED =
+	"$remote_addr - - [$time_local] \"$request\" $status $body_bytes_sent "
+	"\"$http_referer\" \"$http_user_agent\"";
+
+namespace {
+	struct VariableName {
+		const char* name;
+		AccessLogVariable variable;
+	};
+
+	const VariableName VARIABLES[] = {
+		{ "remote_addr", LOG_REMOTE_ADDR },
+		{ "time_local", LOG_TIME_LOCAL },
+		{ "time_iso8601", LOG_TIME_ISO8601 },
+		{ "msec", LOG_MSEC },
+		{ "request_method", LOG_REQUEST_METHOD },
+		{ "request_uri", LOG_REQUEST_URI },
+		{ "request_length", LOG_REQUEST_LENGTH },
+		{ "request_time", LOG_REQUEST_TIME },
+		{ "request", LOG_REQUEST },
+		{ "server_protocol", LOG_SERVER_PROTOCOL },
+		{ "server_name", LOG_SERVER_NAME },
+		{ "status", LOG_STATUS },
+		{ "bytes_sent", LOG_BYTES_SENT },
+		{ "body_bytes_sent", LOG_BODY_BYTES_SENT },
+		{ "upstream_response_time", LOG_UPSTREAM_RESPONSE_TIME },
+		{ "host", LOG_HOST },
+		{ "connection_requests", LOG_CONNECTION_REQUESTS },
+		{ "connection", LOG_CONNECTION },
+		{ "http_referer", LOG_HTTP_REFERER },
+		{ "http_user_agent", LOG_HTTP_USER_AGENT }
+	};
+
+	// strftime once a second for each time format
+	struct TimeCache {
+		time_t second;
+		char text[40];
+	};
+
+	const char* cachedTime(TimeCache& cache, time_t now, const char* format) {
+		if (cache.second != now) {
+			struct tm local;
+			localtime_r(&now, &local);
+			strftime(cache.text, sizeof(cache.text), format, &local);
+			cache.second = now;
+		}
+		return cache.text;
+	}
+
+	TimeCache g_time_local = { -1, "" };
+	TimeCache g_time_iso = { -1, "" };
+
+	// seconds with millisecond resolution, as nginx prints them
+	void appendSeconds(std::string& out, const struct timeval& from, const struct timeval& to) {
+		long ms = (to.tv_sec - from.tv_sec) * 1000 + (to.tv_usec - from.tv_usec) / 1000;
+		if (ms < 0)
+			ms = 0;
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%ld.%03ld", ms / 1000, ms % 1000);
+		out += buffer;
+	}
+
+	void appendValue(std::string& out, const std::string& value) {
+		out += value.empty() ? "-" : value;
+	}
+}
+
+AccessEntry::AccessEntry() : connection(0), connection_requests(0) {
+	reset();
+}
+
+void AccessEntry::reset() {
+	active = false;
+	start.tv_sec = 0;
+	start.tv_usec = 0;
+	upstream_start = start;
+	upstream_end = start;
+	method.clear();
+	uri.clear();
+	protocol.clear();
+	host.clear();
+	server_name.clear();
+	referer.clear();
+	user_agent.clear();
+	status = 0;
+	head_length = 0;
+	bytes_sent = 0;
+	bytes_received = 0;
+}
+
+AccessLogFormat::AccessLogFormat() : _needs_headers(false) {
+}
+
+bool AccessLogFormat::compile(const std::string& format, std::string& error) {
+	_fields.clear();
+	_needs_headers = false;
+	std::string literal;
+	size_t i = 0;
+	while (i < format.length()) {
+		if (format[i] != '$') {
+			literal += format[i++];
+			continue;
+		}
+		size_t end = i + 1;
+		while (end < format.length() && (isalnum(static_cast<unsigned char>(format[end])) || format[end] == '_'))
+			++end;
+		std::string name = format.substr(i + 1, end - i - 1);
+		size_t count = sizeof(VARIABLES) / sizeof(VARIABLES[0]);
+		size_t found = 0;
+		while (found < count && name != VARIABLES[found].name)
+			++found;
+		if (found == count) {
+			error = "unknown log variable $" + name;
+			return false;
+		}
+		if (!literal.empty()) {
+			AccessLogField text;
+			text.variable = LOG_LITERAL;
+			text.literal = literal;
+			_fields.push_back(text);
+			literal.clear();
+		}
+		AccessLogField field;
+		field.variable = VARIABLES[found].variable;
+		_fields.push_back(field);
+		if (field.variable == LOG_HTTP_REFERER || field.variable == LOG_HTTP_USER_AGENT)
+			_needs_headers = true;
+		i = end;
+	}
+	if (!literal.empty()) {
+		AccessLogField text;
+		text.variable = LOG_LITERAL;
+		text.literal = literal;
+		_fields.push_back(text);
+	}
+	return true;
+}
+
+void AccessLogFormat::render(std::string& out, const AccessEntry& entry, const struct timeval& now) const {
+	for (std::vector<AccessLogField>::const_iterator it = _fields.begin(); it != _fields.end(); ++it) {
+		switch (it->variable) {
+			case LOG_LITERAL: out += it->literal; break;
+			case LOG_REMOTE_ADDR: appendValue(out, entry.remote_addr); break;
+			case LOG_TIME_LOCAL: out += cachedTime(g_time_local, now.tv_sec, "%d/%b/%Y:%H:%M:%S %z"); break;
+			case LOG_TIME_ISO8601: out += cachedTime(g_time_iso, now.tv_sec, "%Y-%m-%dT%H:%M:%S%z"); break;
+			case LOG_MSEC: {
+				struct timeval epoch = { 0, 0 };
+				appendSeconds(out, epoch, now);
+				break;
+			}
+			case LOG_REQUEST:
+				out += entry.method + " " + entry.uri + " " + entry.protocol;
+				break;
+			case LOG_REQUEST_METHOD: appendValue(out, entry.method); break;
+			case LOG_REQUEST_URI: appendValue(out, entry.uri); break;
+			case LOG_SERVER_PROTOCOL: appendValue(out, entry.protocol); break;
+			case LOG_STATUS: out += int_to_string(entry.status ? entry.status : 499); break;
+			case LOG_BYTES_SENT: out += size_t_to_string(entry.bytes_sent); break;
+			case LOG_BODY_BYTES_SENT:
+				out += size_t_to_string(entry.bytes_sent > entry.head_length ? entry.bytes_sent - entry.head_length : 0);
+				break;
+			case LOG_REQUEST_LENGTH: out += size_t_to_string(entry.bytes_received); break;
+			case LOG_REQUEST_TIME: appendSeconds(out, entry.start, now); break;
+			case LOG_UPSTREAM_RESPONSE_TIME:
+				if (entry.upstream_start.tv_sec == 0)
+					out += "-";
+				else
+					appendSeconds(out, entry.upstream_start, entry.upstream_end.tv_sec ? entry.upstream_end : now);
+				break;
+			case LOG_HOST: appendValue(out, entry.host); break;
+			case LOG_SERVER_NAME: appendValue(out, entry.server_name); break;
+			case LOG_CONNECTION: out += size_t_to_string(entry.connection); break;
+			case LOG_CONNECTION_REQUESTS: out += size_t_to_string(entry.connection_requests); break;
+			case LOG_HTTP_REFERER: appendValue(out, entry.referer); break;
+			case LOG_HTTP_USER_AGENT: appendValue(out, entry.user_agent); break;
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#include "Arena.hpp"
+#include <cstring>
+
+Arena::Arena() : _current(0), _used(0), _allocations(0) {
+}
+
+Arena::~Arena() {
+	for (size_t i = 0; i < _chunks.size(); ++i)
+		delete[] _chunks[i];
+}
+
+// 8 byte aligned; a request too big for a chunk gets one of its own size
+void* Arena::allocate(size_t size) {
+	size = (size + 7) & ~static_cast<size_t>(7);
+	while (_current < _chunks.size()) {
+		if (_used + size <= _sizes[_current]) {
+			void* out = _chunks[_current] + _used;
+			_used += size;
+			return out;
+		}
+		++_current;
+		_used = 0;
+	}
+	size_t chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+	_chunks.push_back(new char[chunk_size]);
+	_sizes.push_back(chunk_size);
+	_allocations++;
+	_current = _chunks.size() - 1;
+	_used = size;
+	return _chunks[_current];
+}
+
+const char* Arena::copy(const char* data, size_t length) {
+	char* out = static_cast<char*>(allocate(length + 1));
+	std::memcpy(out, data, length);
+	out[length] = '\0';
+	return out;
+}
+
+void Arena::reset() {
+	_current = 0;
+	_used = 0;
+}
+
+size_t Arena::capacity() const {
+	size_t total = 0;
+	for (size_t i = 0; i < _sizes.size(); ++i)
+		total += _sizes[i];
+	return total;
+}
@@ -0,0 +1,265 @@
+#include "Autoindex.hpp"
+#include "MimeTypes.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+	const size_t MAX_LISTINGS = 64;
+	const size_t MAX_BYTES = 32 * 1024 * 1024;
+	const size_t FLUSH_BYTES = 64 * 1024;	// rows are handed to the body in chunks this big
+
+	const char* HEAD_STYLE = "<style>body{font-family:Arial,sans-serif;margin:40px;} "
+		"table{border-collapse:collapse;width:100%;} "
+		"th,td{text-align:left;padding:8px;border-bottom:1px solid #ddd;} "
+		"a{text-decoration:none;color:#3498db;} a:hover{text-decoration:underline;}</style>";
+
+	void appendEscaped(std::string& out, const std::string& text) {
+		for (size_t i = 0; i < text.length(); ++i) {
+			switch (text[i]) {
+				case '&': out += "&amp;"; break;
+				case '<': out += "&lt;"; break;
+				case '>': out += "&gt;"; break;
+				case '"': out += "&quot;"; break;
+				default: out += text[i];
+			}
+		}
+	}
+
+	// a name as a relative link, so "a#b" or "50%.txt" stay one path segment
+	void appendLink(std::string& out, const std::string& name) {
+		static const char* hex = "0123456789ABCDEF";
+		for (size_t i = 0; i < name.length(); ++i) {
+			unsigned char c = name[i];
+			if (std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~')
+				out += c;
+			else {
+				out += '%';
+				out += hex[c >> 4];
+				out += hex[c & 15];
+			}
+		}
+	}
+
+	bool sameTime(const struct timespec& a, const struct timespec& b) {
+		return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+	}
+
+	// offset and limit from the query, anything else in it is ignored
+	void parsePaging(const std::string& query, size_t& offset, size_t& limit, bool& has_limit) {
+		size_t start = 0;
+		while (start < query.length()) {
+			size_t end = query.find('&', start);
+			if (end == std::string::npos)
+				end = query.length();
+			std::string pair = query.substr(start, end - start);
+			size_t equals = pair.find('=');
+			if (equals != std::string::npos) {
+				std::string key = pair.substr(0, equals);
+				unsigned long value = std::strtoul(pair.c_str() + equals + 1, NULL, 10);
+				if (key == "offset")
+					offset = value;
+				else if (key == "limit" && value > 0) {
+					limit = value;
+					has_limit = true;
+				}
+			}
+			start = end + 1;
+		}
+	}
+
+	void appendPageLink(std::string& out, size_t offset, size_t limit, const char* label) {
+		out += "<a href=\"?offset=" + size_t_to_string(offset) + "&amp;limit=" + size_t_to_string(limit)
+			+ "\">" + label + "</a> ";
+	}
+}
+
+Autoindex::Autoindex() : _bytes(0), _clock(0) {}
+
+bool Autoindex::before(const Entry& a, const Entry& b) {
+	if (a.directory != b.directory)
+		return a.directory;
+	return std::strcmp(a.name.c_str(), b.name.c_str()) < 0;
+}
+
+// only d_type is used to tell directories apart; links and file systems
+// without d_type fall back to fstatat on the directory fd
+bool Autoindex::scan(const std::string& dir_path, const MimeTypes& mime_types, Listing& listing,
+					 std::string& error) {
+	DIR* dir = opendir(dir_path.c_str());
+	if (!dir) {
+		error = "cannot open directory " + dir_path + ": " + std::strerror(errno);
+		return false;
+	}
+	int dir_fd = dirfd(dir);
+	listing.entries.clear();
+	listing.bytes = 0;
+	struct dirent* found;
+	while ((found = readdir(dir)) != NULL) {
+		if (found->d_name[0] == '.')	// ".", ".." and hidden files
+			continue;
+		Entry entry;
+		entry.name = found->d_name;
+		entry.directory = found->d_type == DT_DIR;
+		entry.size_pos = std::string::npos;
+		if (found->d_type == DT_LNK || found->d_type == DT_UNKNOWN) {
+			struct stat st;
+			entry.directory = fstatat(dir_fd, found->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		}
+		listing.entries.push_back(entry);
+	}
+	closedir(dir);
+	std::sort(listing.entries.begin(), listing.entries.end(), before);
+
+	for (size_t i = 0; i < listing.entries.size(); ++i) {
+		Entry& entry = listing.entries[i];
+		std::string& row = entry.row;
+		row = "<tr><td><a href=\"";
+		appendLink(row, entry.name);
+		if (entry.directory) {
+			row += "/\">";
+			appendEscaped(row, entry.name);
+			row += "/</a></td><td>-</td><td>Directory</td></tr>";
+		} else {
+			row += "\">";
+			appendEscaped(row, entry.name);
+			row += "</a></td><td>";
+			entry.size_pos = row.length();
+			row += "</td><td>";
+			appendEscaped(row, mime_types.typeFor(entry.name));
+			row += "</td></tr>";
+		}
+		listing.bytes += sizeof(Entry) + entry.name.length() + row.length();
+	}
+	return true;
+}
+
+// rows go into a string that is handed to the body as a shared segment every
+// FLUSH_BYTES, so a large page is never copied into one contiguous buffer
+void Autoindex::renderPage(const std::string& dir_path, const Listing& listing, const std::string& uri,
+						   size_t offset, size_t limit, BufferChain& body) const {
+	const std::vector<Entry>& entries = listing.entries;
+	size_t end = offset + limit < entries.size() ? offset + limit : entries.size();
+	bool paged = offset > 0 || end < entries.size();
+
+	std::string chunk;
+	chunk.reserve(FLUSH_BYTES + 1024);
+	chunk += "<!DOCTYPE html><html><head><title>Index of ";
+	appendEscaped(chunk, uri);
+	chunk += "</title>";
+	chunk += HEAD_STYLE;
+	chunk += "</head><body><h1>Index of ";
+	appendEscaped(chunk, uri);
+	chunk += "</h1><hr>";
+
+	std::string pager;
+	if (paged) {
+		pager = "<p>" + size_t_to_string(offset < end ? offset + 1 : offset) + "-" + size_t_to_string(end)
+			+ " of " + size_t_to_string(entries.size()) + " ";
+		if (offset > 0)
+			appendPageLink(pager, offset > limit ? offset - limit : 0, limit, "previous");
+		if (end < entries.size())
+			appendPageLink(pager, end, limit, "next");
+		pager += "</p>";
+	}
+	chunk += pager;
+	chunk += "<table><tr><th>Name</th><th>Size</th><th>Type</th></tr>";
+	if (uri != "/")
+		chunk += "<tr><td><a href=\"../\">../</a></td><td>-</td><td>Directory</td></tr>";
+
+	int dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY);
+	for (size_t i = offset; i < end; ++i) {
+		const Entry& entry = entries[i];
+		if (entry.size_pos == std::string::npos)
+			chunk += entry.row;
+		else {
+			struct stat st;
+			chunk.append(entry.row, 0, entry.size_pos);
+			if (dir_fd != -1 && fstatat(dir_fd, entry.name.c_str(), &st, 0) == 0)
+				chunk += size_t_to_string(st.st_size) + " bytes";
+			else
+				chunk += "-";
+			chunk.append(entry.row, entry.size_pos, std::string::npos);
+		}
+		if (chunk.length() >= FLUSH_BYTES) {
+			body.appendShared(chunk);
+			chunk.reserve(FLUSH_BYTES + 1024);
+		}
+	}
+	if (dir_fd != -1)
+		close(dir_fd);
+	chunk += "</table>";
+	chunk += pager;
+	chunk += "<hr><p>Generated by Webserv/1.0</p></body></html>";
+	body.appendShared(chunk);
+}
+
+bool Autoindex::render(const std::string& dir_path, const std::string& uri, const std::string& query,
+					   const MimeTypes& mime_types, BufferChain& body, std::string& error) {
+	struct stat st;
+	if (stat(dir_path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+		error = "cannot open directory " + dir_path;
+		return false;
+	}
+
+	std::map<std::string, Listing>::iterator it = _listings.find(dir_path);
+	// a directory changed within the last second may change again without
+	// its mtime moving, so it is read again until it has settled
+	bool fresh = it != _listings.end() && it->second.dev == st.st_dev && it->second.ino == st.st_ino
+		&& sameTime(it->second.mtime, st.st_mtim) && st.st_mtim.tv_sec < time(NULL) - 1;
+	if (!fresh) {
+		if (it == _listings.end())
+			it = _listings.insert(std::make_pair(dir_path, Listing())).first;
+		Listing& listing = it->second;
+		_bytes -= listing.bytes;
+		if (!scan(dir_path, mime_types, listing, error)) {
+			_listings.erase(it);
+			return false;
+		}
+		listing.dev = st.st_dev;
+		listing.ino = st.st_ino;
+		listing.mtime = st.st_mtim;
+		_bytes += listing.bytes;
+	}
+	Listing& listing = it->second;
+	listing.used = ++_clock;
+
+	size_t offset = 0;
+	size_t limit = listing.entries.size();
+	bool has_limit = false;
+	parsePaging(query, offset, limit, has_limit);
+	if (!has_limit && listing.entries.size() > MAX_UNPAGED)
+		limit = DEFAULT_LIMIT;
+	else if (has_limit && limit > MAX_LIMIT)
+		limit = MAX_LIMIT;
+	if (offset > listing.entries.size())
+		offset = listing.entries.size();
+
+	renderPage(dir_path, listing, uri, offset, limit, body);
+	evict(dir_path);
+	return true;
+}
+
+// least recently used listings go first, the one just served stays
+void Autoindex::evict(const std::string& keep) {
+	while (_listings.size() > 1 && (_listings.size() > MAX_LISTINGS || _bytes > MAX_BYTES)) {
+		std::map<std::string, Listing>::iterator oldest = _listings.end();
+		for (std::map<std::string, Listing>::iterator it = _listings.begin(); it != _listings.end(); ++it)
+			if (it->first != keep && (oldest == _listings.end() || it->second.used < oldest->second.used))
+				oldest = it;
+		_bytes -= oldest->second.bytes;
+		_listings.erase(oldest);
+	}
+}
+
+void Autoindex::clear() {
+	_listings.clear();
+	_bytes = 0;
+}
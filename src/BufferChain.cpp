@@ -0,0 +1,214 @@
+#include "BufferChain.hpp"
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+namespace {
+	// released blocks are kept for reuse, a few MB at most
+	struct BlockPool {
+		std::vector<BufferBlock*> blocks;
+
+		~BlockPool() {
+			for (size_t i = 0; i < blocks.size(); ++i)
+				delete blocks[i];
+		}
+	};
+
+	BlockPool g_pool;
+	const size_t MAX_FREE_BLOCKS = 256;
+	const int MAX_IOV = 64;
+}
+
+void BufferBlock::recycle() {
+	if (g_pool.blocks.size() >= MAX_FREE_BLOCKS) {
+		delete this;
+		return;
+	}
+	used = 0;
+	g_pool.blocks.push_back(this);
+}
+
+SharedFile::~SharedFile() {
+	if (fd != -1)
+		close(fd);
+}
+
+BufferChain::BufferChain() : _size(0), _tail(NULL) {
+}
+
+// the copy never appends into a block it shares
+BufferChain::BufferChain(const BufferChain& other) : _size(0), _tail(NULL) {
+	append(other);
+}
+
+BufferChain& BufferChain::operator=(const BufferChain& other) {
+	if (this != &other) {
+		clear();
+		append(other);
+	}
+	return *this;
+}
+
+BufferChain::~BufferChain() {
+	clear();
+}
+
+BufferBlock* BufferChain::allocateBlock() {
+	if (g_pool.blocks.empty())
+		return new BufferBlock();
+	BufferBlock* block = g_pool.blocks.back();
+	g_pool.blocks.pop_back();
+	return block;
+}
+
+void BufferChain::release(BufferStorage* storage) {
+	if (--storage->refs == 0)
+		storage->recycle();
+}
+
+void BufferChain::push(BufferStorage* storage, const char* data, off_t offset, size_t length) {
+	BufferSegment segment;
+	segment.storage = storage;
+	segment.data = data;
+	segment.offset = offset;
+	segment.length = length;
+	storage->refs++;
+	_segments.push_back(segment);
+	_size += length;
+}
+
+void BufferChain::append(const char* data, size_t length) {
+	while (length > 0) {
+		if (!_tail || _tail->used == BufferBlock::SIZE) {
+			_tail = allocateBlock();
+			push(_tail, _tail->data, 0, 0);
+		}
+		size_t chunk = std::min(length, BufferBlock::SIZE - _tail->used);
+		std::memcpy(_tail->data + _tail->used, data, chunk);
+		_tail->used += chunk;
+		_segments.back().length += chunk;
+		_size += chunk;
+		data += chunk;
+		length -= chunk;
+	}
+}
+
+void BufferChain::append(const std::string& data) {
+	append(data.data(), data.length());
+}
+
+void BufferChain::append(const BufferChain& other) {
+	for (std::deque<BufferSegment>::const_iterator it = other._segments.begin();
+		 it != other._segments.end(); ++it) {
+		if (it->length > 0)
+			push(it->storage, it->data, it->offset, it->length);
+	}
+	_tail = NULL;
+}
+
+void BufferChain::appendShared(std::string& data) {
+	if (data.empty())
+		return;
+	SharedBuffer* shared = new SharedBuffer();
+	shared->data.swap(data);
+	push(shared, shared->data.data(), 0, shared->data.length());
+	_tail = NULL;
+}
+
+void BufferChain::appendFile(int fd, off_t offset, size_t length) {
+	if (length == 0) {
+		close(fd);
+		return;
+	}
+	SharedFile* file = new SharedFile(fd);
+	push(file, NULL, offset, length);
+	_tail = NULL;
+}
+
+void BufferChain::clear() {
+	while (!_segments.empty()) {
+		release(_segments.front().storage);
+		_segments.pop_front();
+	}
+	_size = 0;
+	_tail = NULL;
+}
+
+void BufferChain::consume(size_t length) {
+	while (length > 0 && !_segments.empty()) {
+		BufferSegment& front = _segments.front();
+		size_t chunk = std::min(length, front.length);
+		if (front.data)
+			front.data += chunk;
+		else
+			front.offset += chunk;
+		front.length -= chunk;
+		_size -= chunk;
+		length -= chunk;
+		if (front.length == 0) {
+			if (front.storage == _tail)
+				_tail = NULL;
+			release(front.storage);
+			_segments.pop_front();
+		}
+	}
+}
+
+// memory segments go out together with writev, a file on its own with
+// sendfile. a file that shrank since it was queued ends the connection
+ssize_t BufferChain::writeTo(int fd) {
+	if (_segments.empty())
+		return 0;
+
+	ssize_t sent;
+	BufferSegment& front = _segments.front();
+	if (!front.data) {
+		off_t offset = front.offset;
+		sent = sendfile(fd, static_cast<SharedFile*>(front.storage)->fd, &offset, front.length);
+		if (sent == 0)
+			return -1;
+	} else {
+		struct iovec iov[MAX_IOV];
+		int count = 0;
+		for (std::deque<BufferSegment>::const_iterator it = _segments.begin();
+			 it != _segments.end() && it->data && count < MAX_IOV; ++it) {
+			iov[count].iov_base = const_cast<char*>(it->data);
+			iov[count].iov_len = it->length;
+			++count;
+		}
+		sent = writev(fd, iov, count);
+	}
+	if (sent > 0)
+		consume(sent);
+	return sent;
+}
+
+size_t BufferChain::peek(char* out, size_t length) const {
+	size_t copied = 0;
+	for (std::deque<BufferSegment>::const_iterator it = _segments.begin();
+		 it != _segments.end() && it->data && copied < length; ++it) {
+		size_t chunk = std::min(length - copied, it->length);
+		std::memcpy(out + copied, it->data, chunk);
+		copied += chunk;
+	}
+	return copied;
+}
+
+std::string BufferChain::str() const {
+	std::string out;
+	out.reserve(_size);
+	for (std::deque<BufferSegment>::const_iterator it = _segments.begin(); it != _segments.end(); ++it) {
+		if (it->data) {
+			out.append(it->data, it->length);
+			continue;
+		}
+		std::vector<char> buffer(it->length);
+		ssize_t got = pread(static_cast<SharedFile*>(it->storage)->fd, &buffer[0], it->length, it->offset);
+		if (got > 0)
+			out.append(&buffer[0], got);
+	}
+	return out;
+}
@@ -1,17 +1,16 @@
 #include "Cgi.hpp"
 #include "utils.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
 
 CgiHandler::CgiHandler() : _cgi_bin_path("./www/cgi-bin"), _web_server(NULL) {
-    initializeInterpreters();
 }
 
 CgiHandler::CgiHandler(const std::string& cgi_bin_path) : _cgi_bin_path(cgi_bin_path), _web_server(NULL) {
-    initializeInterpreters();
 }
 
 CgiHandler::CgiHandler(const std::string& cgi_bin_path, WebServer* web_server) 
     : _cgi_bin_path(cgi_bin_path), _web_server(web_server) {
-    initializeInterpreters();
 }
 
 void CgiHandler::setWebServer(WebServer* web_server) {
@@ -19,38 +18,20 @@ void CgiHandler::setWebServer(WebServer* web_server) {
 }
 
 CgiHandler::~CgiHandler() {
-	
-}
-
-void CgiHandler::initializeInterpreters() {
-	_interpreters[".py"] = "/usr/bin/python3";
-	_interpreters[".pl"] = "/usr/bin/perl";
-	_interpreters[".sh"] = "/bin/bash";
-	_interpreters[".rb"] = "/usr/bin/ruby";
-	_interpreters[".php"] = "/usr/bin/php";
-	_interpreters[".cgi"] = "";
+	shutdown();
 }
 
-bool CgiHandler::isCgiRequest(const std::string& uri) const {
-	if (uri.find("/cgi-bin/") == 0) {
-		LOG_DEBUG(uri + " found in cgi-bin");
-		return true;
-	}
-		
-	// checking file extensions
-	for (std::map<std::string, std::string>::const_iterator it = _interpreters.begin();
-		 it != _interpreters.end(); ++it) {
-		if (uri.find(it->first) != std::string::npos)
-			return true;
-	}
-	return false;
+// the extension was matched against the location's cgi table while routing,
+// locations without one never run scripts
+bool CgiHandler::isCgiRequest(const HttpRequest& request) const {
+	return request.getCgiInterpreter() != NULL;
 }
 
 void CgiHandler::setCgiBinPath(const std::string& path) {
 	_cgi_bin_path = path;
 }
 
-std::string CgiHandler::handleCgiRequest(const HttpRequest& request) const {
+BufferChain CgiHandler::handleCgiRequest(const HttpRequest& request, const LocationConfig* location) {
 	std::string uri = request.getUri();
 	std::string script_path = getScriptPath(uri);
 	
@@ -60,18 +41,198 @@ std::string CgiHandler::handleCgiRequest(const HttpRequest& request) const {
 		LOG_ERROR("cgi script not found: " + script_path);
 		return generateErrorResponse(404, "CGI Script Not Found");
 	}
-	if (!isExecutable(script_path)) {
+	const CgiInterpreter* interpreter = request.getCgiInterpreter();
+	if (interpreter && !interpreter->usable) {
+		LOG_ERROR("cgi interpreter not executable: " + interpreter->path);
+		return generateErrorResponse(500, "Internal Server Error - CGI Interpreter Unavailable");
+	}
+	// interpreted scripts only need to be readable, the interpreter was checked at load
+	if ((!interpreter || interpreter->path.empty()) && !isExecutable(script_path)) {
 		LOG_ERROR("cgi script not executable: " + script_path);
 		return generateErrorResponse(403, "CGI Script Not Executable");
 	}
 
+	if (location && location->cgi_cache_valid > 0 && request.getMethod() == GET)
+		return handleCachedRequest(request, location, script_path);
+	return runScript(request, location, script_path, "");
+}
+
+BufferChain CgiHandler::runScript(const HttpRequest& request, const LocationConfig* location,
+								  const std::string& script_path, const std::string& cache_key) {
+	if (location && location->cgi_max_concurrent > 0
+		&& _running[location->key] >= location->cgi_max_concurrent)
+		return enqueue(request, location, script_path, cache_key);
+
+	if (location && !location->cgi_worker.empty()) {
+		CgiWorker* worker = acquireWorker(getWorkerPool(location));
+		if (worker)
+			return executeOnWorker(worker, script_path, request, cache_key, location);
+		LOG_DEBUG("cgi worker pool exhausted, forking instead");
+	}
+
 	LOG_DEBUG("cgi script is executable, going to execution");
-	return execute(script_path, request, _interpreters);
+	const CgiInterpreter* interpreter = request.getCgiInterpreter();
+	return execute(script_path, request, interpreter ? interpreter->path : "", cache_key, location);
+}
+
+// the location is at cgi_max_concurrent: wait in line, or get a 503 right
+// away once cgi_queue_size are already waiting
+BufferChain CgiHandler::enqueue(const HttpRequest& request, const LocationConfig* location,
+								const std::string& script_path, const std::string& cache_key) {
+	std::deque<CgiQueuedRequest>& queue = _queues[location->key];
+	if (queue.size() >= location->cgi_queue_size) {
+		LOG_ERROR("cgi limit reached for " + location->key + ", rejecting " + request.getUri());
+		return overloadedResponse();
+	}
+
+	CgiQueuedRequest queued;
+	queued.request = request;
+	queued.location = location;
+	queued.script_path = script_path;
+	queued.cache_key = cache_key;
+	queued.queued_at = time(NULL);
+	queue.push_back(queued);
+	if (request.getClientFd() != -1)
+		_queued_clients[request.getClientFd()] = location->key;
+	LOG_DEBUG("cgi limit reached for " + location->key + ", queued " + request.getUri()
+			+ " (" + size_t_to_string(queue.size()) + " waiting)");
+	return BufferChain();
+}
+
+// called whenever a process leaves _processes
+void CgiHandler::releaseSlot(CgiProcess* process) {
+	if (!process->location)
+		return;
+	std::string key = process->location->key;
+	process->location = NULL;
+	if (_running[key] > 0)
+		_running[key]--;
+	startQueued(key);
+}
+
+void CgiHandler::startQueued(const std::string& key) {
+	std::map<std::string, std::deque<CgiQueuedRequest> >::iterator it = _queues.find(key);
+	if (it == _queues.end())
+		return;
+	std::deque<CgiQueuedRequest>& queue = it->second;
+	while (!queue.empty() && _running[key] < queue.front().location->cgi_max_concurrent) {
+		CgiQueuedRequest queued = queue.front();
+		queue.pop_front();
+		_queued_clients.erase(queued.request.getClientFd());
+		BufferChain error = runScript(queued.request, queued.location, queued.script_path, queued.cache_key);
+		if (!error.empty())
+			failQueued(queued, error);
+	}
+}
+
+// answers a request that never got to run, and everybody waiting on its cache fill
+void CgiHandler::failQueued(const CgiQueuedRequest& queued, const BufferChain& error) {
+	if (!queued.cache_key.empty()) {
+		CgiProcess fill;
+		fill.cache_key = queued.cache_key;
+		completeCacheFill(&fill, error.str(), false);
+	}
+	if (queued.request.getClientFd() != -1 && _web_server)
+		_web_server->queueCgiResponse(queued.request.getClientFd(), error);
+}
+
+// nobody waits longer for a slot than a script may run silently
+void CgiHandler::expireQueued() {
+	time_t now = time(NULL);
+
+	for (std::map<std::string, std::deque<CgiQueuedRequest> >::iterator it = _queues.begin();
+		 it != _queues.end(); ++it) {
+		std::deque<CgiQueuedRequest>& queue = it->second;
+		while (!queue.empty() && now - queue.front().queued_at > queue.front().location->cgi_timeout) {
+			CgiQueuedRequest queued = queue.front();
+			queue.pop_front();
+			_queued_clients.erase(queued.request.getClientFd());
+			LOG_ERROR("cgi queue timeout for " + queued.request.getUri());
+			Metrics::add(METRIC_CGI_QUEUE_TIMEOUTS);
+			failQueued(queued, overloadedResponse());
+		}
+	}
+}
+
+BufferChain CgiHandler::overloadedResponse() const {
+	std::string text = generateErrorResponse(503, "Service Unavailable").str();
+	size_t status_end = text.find("\r\n");
+	if (status_end != std::string::npos)
+		text.insert(status_end + 2, "Retry-After: " + int_to_string(CGI_RETRY_AFTER) + "\r\n");
+	BufferChain response;
+	response.appendShared(text);
+	return response;
+}
+
+// hits are answered right away. a miss runs the script once for everybody
+// asking meanwhile, a stale hit is served while one refresh runs in the background
+BufferChain CgiHandler::handleCachedRequest(const HttpRequest& request, const LocationConfig* location,
+											const std::string& script_path) {
+	std::string key = CgiCache::makeKey(request, location->cgi_cache_key);
+	BufferChain cached;
+	CgiCache::Lookup result = _cache.lookup(key, cached);
+	std::map<std::string, CgiCacheFill>::iterator fill = _cache_fills.find(key);
+
+	Metrics::add(result == CgiCache::HIT ? METRIC_CGI_CACHE_HITS
+			: result == CgiCache::STALE ? METRIC_CGI_CACHE_STALE : METRIC_CGI_CACHE_MISSES);
+	if (result == CgiCache::HIT || (result == CgiCache::STALE && fill != _cache_fills.end())) {
+		LOG_DEBUG("cgi cache hit for " + request.getUri());
+		return cached;
+	}
+	if (fill != _cache_fills.end()) {
+		LOG_DEBUG("cgi cache miss for " + request.getUri() + ", waiting for the running fill");
+		fill->second.waiters.push_back(request.getClientFd());
+		_cache_waiters[request.getClientFd()] = key;
+		return BufferChain();
+	}
+
+	HttpRequest run = request;
+	if (result == CgiCache::STALE)
+		run.setClientFd(-1); // this client gets the stale copy
+	BufferChain response = runScript(run, location, script_path, key);
+	if (response.empty()) {
+		CgiCacheFill& started = _cache_fills[key];
+		started.request = run;
+		started.location = location;
+		started.script_path = script_path;
+	}
+	return result == CgiCache::STALE ? cached : response;
 }
 
-std::string CgiHandler::execute(const std::string& script_path, 
+// stores the result of a fill and hands it to the requests that waited for it
+void CgiHandler::completeCacheFill(CgiProcess* process, const std::string& tail, bool complete) {
+	std::map<std::string, CgiCacheFill>::iterator it = _cache_fills.find(process->cache_key);
+	if (it == _cache_fills.end())
+		return;
+	CgiCacheFill fill = it->second;
+	_cache_fills.erase(it);
+
+	std::string bytes = process->recorded + tail;
+	BufferChain response; // one copy for the cache and every waiter
+	response.appendShared(bytes);
+	if (complete && !process->record_overflow && _cache.store(process->cache_key, response,
+			fill.location->cgi_cache_valid, fill.location->cgi_cache_stale))
+		LOG_DEBUG("cgi cache stored " + fill.request.getUri());
+
+	for (size_t i = 0; i < fill.waiters.size(); ++i) {
+		int client_fd = fill.waiters[i];
+		_cache_waiters.erase(client_fd);
+		if (process->record_overflow) { // too big to share, everybody runs it on their own
+			HttpRequest replay = fill.request;
+			replay.setClientFd(client_fd);
+			BufferChain error = runScript(replay, fill.location, fill.script_path, "");
+			if (!error.empty() && _web_server)
+				_web_server->queueCgiResponse(client_fd, error);
+		} else if (_web_server)
+			_web_server->queueCgiResponse(client_fd, response);
+	}
+}
+
+BufferChain CgiHandler::execute(const std::string& script_path, 
 								const HttpRequest& request,
-								const std::map<std::string, std::string>& interpreters) const {
+								const std::string& interpreter,
+								const std::string& cache_key,
+								const LocationConfig* location) {
 
 	int pipe_stdout[2];
 	int pipe_stdin[2];
@@ -79,21 +240,41 @@ std::string CgiHandler::execute(const std::string& script_path,
 	if (!createPipes(pipe_stdout, pipe_stdin))
 		return generateErrorResponse(500, "Internal Server Error - Pipe Creation Failed");
 
-	pid_t pid = fork();
+	std::vector<std::string> argv;
+	if (!interpreter.empty())
+		argv.push_back(interpreter);
+	argv.push_back(script_path);
+	std::vector<std::string> env_vars = setupEnvironment(request, script_path);
+
+	pid_t pid = spawnChild(argv, &env_vars, pipe_stdin[0], pipe_stdout[1]);
 	if (pid == -1) {
 		close(pipe_stdout[0]);
 		close(pipe_stdout[1]);
 		close(pipe_stdin[0]);
 		close(pipe_stdin[1]);
-	return generateErrorResponse(500, "Internal Server Error - Fork Failed");
+		return generateErrorResponse(500, "Internal Server Error - Spawn Failed");
 	}
 
-	if (pid == 0) {
-	setupChildProcess(pipe_stdout, pipe_stdin, request, script_path, interpreters);
-	LOG_ERROR("error in child");
-	exit(1);
-	}
-	return handleParentProcess(pipe_stdout, pipe_stdin, request, pid);
+	close(pipe_stdout[1]);
+	close(pipe_stdin[0]);
+
+	CgiProcess* process = new CgiProcess();
+	process->pid = pid;
+	process->client_fd = request.getClientFd();
+	process->output.setClientVersion(request.getVersion());
+	process->stdout_fd = pipe_stdout[0];
+	process->stdin_fd = pipe_stdin[1];
+	process->cache_key = cache_key;
+	process->location = location;
+	process->config = request.getConfig();
+	if (request.getMethod() == POST)
+		process->body = request.getBody();
+	process->last_activity = time(NULL);
+	registerProcess(process);
+
+	LOG_DEBUG("cgi pid " + size_t_to_string(pid) + " started for client " + size_t_to_string(process->client_fd));
+	Metrics::add(METRIC_CGI_SPAWNS);
+	return BufferChain();
 }
 
 bool CgiHandler::createPipes(int pipe_stdout[2], int pipe_stdin[2]) const {
@@ -105,241 +286,416 @@ bool CgiHandler::createPipes(int pipe_stdout[2], int pipe_stdin[2]) const {
 	close(pipe_stdout[1]);
 	return false;
 	}
-		
+
+	// parent ends must not leak into later children, or a script would
+	// never see EOF on its stdin while another one is running
+	fcntl(pipe_stdout[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipe_stdin[1], F_SETFD, FD_CLOEXEC);
 	return true;
 }
 
-void CgiHandler::setupChildProcess(int pipe_stdout[2], int pipe_stdin[2], 
-				  const HttpRequest& request, const std::string& script_path,
-				  const std::map<std::string, std::string>& interpreters) const {
-	// (void) interpreters;
-	// (void)	request;
-	close(pipe_stdout[0]);
-	close(pipe_stdin[1]);
-		
-	dup2(pipe_stdout[1], STDOUT_FILENO);
-	close(pipe_stdout[1]);
-		
-	dup2(pipe_stdin[0], STDIN_FILENO);
-	close(pipe_stdin[0]);
+void CgiHandler::registerProcess(CgiProcess* process) {
+	fcntl(process->stdout_fd, F_SETFL, O_NONBLOCK);
+	fcntl(process->stdin_fd, F_SETFL, O_NONBLOCK);
+
+	_processes[process->pid] = process;
+	if (process->location)
+		_running[process->location->key]++;
+	if (process->client_fd != -1) // -1: background cache refresh
+		_client_processes[process->client_fd] = process->pid;
+	_pipe_owners[process->stdout_fd] = process->pid;
+	if (_web_server)
+		_web_server->addPollFd(process->stdout_fd);
+
+	if (process->body.empty()) { // nothing to feed, let the script see EOF right away
+		close(process->stdin_fd);
+		process->stdin_fd = -1;
+		return;
+	}
+	_pipe_owners[process->stdin_fd] = process->pid;
+	if (_web_server)
+		_web_server->addPollFd(process->stdin_fd);
+}
 
-	std::vector<std::string> env_vars = setupEnvironment(request, script_path);
-	
-	std::vector<char*> env_ptrs;	// extracting array from env
-	for (size_t i = 0; i < env_vars.size(); ++i)
-		env_ptrs.push_back(const_cast<char*>(env_vars[i].c_str()));
-	env_ptrs.push_back(NULL);
+// posix_spawn instead of fork: glibc runs it as a vfork-style clone, so the
+// cost no longer grows with the server's page tables. the child only gets
+// the pipe ends as stdin/stdout, our ends are close-on-exec
+pid_t CgiHandler::spawnChild(const std::vector<std::string>& argv, const std::vector<std::string>* env,
+							 int stdin_fd, int stdout_fd) const {
+	std::vector<char*> argv_ptrs;
+	for (size_t i = 0; i < argv.size(); ++i)
+		argv_ptrs.push_back(const_cast<char*>(argv[i].c_str()));
+	argv_ptrs.push_back(NULL);
+
+	std::vector<char*> env_ptrs;
+	if (env) {
+		for (size_t i = 0; i < env->size(); ++i)
+			env_ptrs.push_back(const_cast<char*>((*env)[i].c_str()));
+		env_ptrs.push_back(NULL);
+	}
 
-	std::vector<char*> argv_ptrs;	// extract from av for setup
-	std::string interpreter = getInterpreter(script_path, interpreters);
-	
-	if (!interpreter.empty()) {
-		argv_ptrs.push_back(const_cast<char*>(interpreter.c_str()));
-		argv_ptrs.push_back(const_cast<char*>(script_path.c_str()));
-		argv_ptrs.push_back(NULL);
-		execve(interpreter.c_str(), &argv_ptrs[0], &env_ptrs[0]);
-	} 
-	else {// executes script directly
-		argv_ptrs.push_back(const_cast<char*>(script_path.c_str()));
-		argv_ptrs.push_back(NULL);
-		execve(script_path.c_str(), &argv_ptrs[0], &env_ptrs[0]);
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+	posix_spawn_file_actions_addclose(&actions, stdout_fd);
+	posix_spawn_file_actions_addclose(&actions, stdin_fd);
+
+	// the server ignores SIGPIPE, scripts should get the default back
+	sigset_t defaults;
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGPIPE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	pid_t pid;
+	int error = posix_spawn(&pid, argv_ptrs[0], &actions, &attr, &argv_ptrs[0],
+							env ? &env_ptrs[0] : environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (error != 0) {
+		LOG_ERROR("cgi spawn of " + argv[0] + " failed: " + strerror(error));
+		return -1;
 	}
-		
-	exit(1);
+	return pid;
 }
 
-bool CgiHandler::waitForCgiCompletion(pid_t child_pid) const {
-	int status;
-	waitpid(child_pid, &status, 0);
-	
-	if (WEXITSTATUS(status) != 0) {
-		LOG_ERROR("CGI script exited with non-zero status");
-		return false;
-	}
-	
-	return true;
+bool CgiHandler::isCgiFd(int fd) const {
+	return _pipe_owners.find(fd) != _pipe_owners.end();
 }
 
-bool CgiHandler::checkCgiProcessFinished(pid_t child_pid, int pipe_stdout, std::string& output) const {
-	int status;
-	pid_t result = waitpid(child_pid, &status, WNOHANG);
-	
-	if (result == child_pid) {
-		char buffer[1024];
-		ssize_t bytes_read;
-		while ((bytes_read = read(pipe_stdout, buffer, sizeof(buffer) - 1)) > 0) {
-			buffer[bytes_read] = '\0';
-			output += buffer;
-		}
-		return true;
-	}
-	
-	return false;
+bool CgiHandler::hasPendingResponse(int client_fd) const {
+	return _client_processes.find(client_fd) != _client_processes.end()
+		|| _cache_waiters.find(client_fd) != _cache_waiters.end()
+		|| _queued_clients.find(client_fd) != _queued_clients.end();
+}
+
+short CgiHandler::getPollEvents(int fd) const {
+	std::map<int, pid_t>::const_iterator it = _pipe_owners.find(fd);
+	if (it == _pipe_owners.end())
+		return 0;
+	const CgiProcess* process = _processes.find(it->second)->second;
+	if (fd == process->stdin_fd)
+		return POLLOUT;
+	// let the client drain what it already has before reading more
+	if (_web_server && _web_server->isClientBehind(process->client_fd))
+		return 0;
+	return POLLIN;
+}
+
+void CgiHandler::handleCgiEvent(int fd, short revents) {
+	std::map<int, pid_t>::iterator it = _pipe_owners.find(fd);
+	if (it == _pipe_owners.end())
+		return;
+	CgiProcess* process = _processes[it->second];
+
+	if (fd == process->stdin_fd) {
+		if (revents & (POLLERR | POLLHUP))	// script stopped reading
+			closeStdin(process);
+		else if (revents & POLLOUT)
+			handleCgiStdinWrite(process);
+	} else if (fd == process->stdout_fd && (revents & (POLLIN | POLLHUP | POLLERR)))
+		handleCgiStdoutRead(process);
+
+	if (process->output_done && process->exited)
+		finishProcess(process);
 }
 
-bool CgiHandler::handleCgiStdinWrite(int pipe_stdin, const std::string& body, 
-									size_t& bytes_written, bool& stdin_closed, 
-									std::vector<struct pollfd>& cgi_fds) const {
-	if (bytes_written < body.length()) {
-		ssize_t written = write(pipe_stdin, 
-			body.c_str() + bytes_written, 
-			body.length() - bytes_written);
+void CgiHandler::handleCgiStdinWrite(CgiProcess* process) {
+	const std::string& body = process->body;
+	if (process->bytes_written < body.length()) {
+		ssize_t written = write(process->stdin_fd, 
+			body.c_str() + process->bytes_written, 
+			body.length() - process->bytes_written);
 		
 		if (written > 0) // negative = EAGAIN/EWOULDBLOCK - continue polling
-			bytes_written += written;
-		
+			process->bytes_written += written;
 	}
 
-	if (bytes_written >= body.length()) {	// check if finished
-		close(pipe_stdin);
-		stdin_closed = true;
-		cgi_fds.pop_back();  // remove stdin from polling
-		return false;  // finished writing
-	}
-	return true;
+	if (process->bytes_written >= body.length())	// check if finished
+		closeStdin(process);
 }
 
-bool CgiHandler::handleCgiStdoutRead(int pipe_stdout, std::string& output) const {
-	char buffer[1024];
-	ssize_t bytes_read = read(pipe_stdout, buffer, sizeof(buffer) - 1);
+void CgiHandler::handleCgiStdoutRead(CgiProcess* process) {
+	char buffer[CGI_READ_SIZE];
+	ssize_t bytes_read = read(process->stdout_fd, buffer, sizeof(buffer));
 	
 	if (bytes_read > 0) {
-		buffer[bytes_read] = '\0';
-		output += buffer;
-		return true;
-	} else if (bytes_read == 0) // means EOF
-		return false;
-	return true;
+		process->last_activity = time(NULL);
+		if (!process->worker)
+			relayOutput(process, buffer, bytes_read);
+		else if (readWorkerFrame(process, buffer, bytes_read)) { // worker stays alive, the frame ends the response
+			closeStdin(process);
+			closeStdout(process);
+			process->exited = true;
+		}
+	} else if (bytes_read == 0) { // means EOF
+		closeStdout(process);
+		if (process->worker) { // worker died mid request
+			process->exited = true;
+			process->exit_status = -1;
+		}
+	}
 }
 
-void CgiHandler::setupCgiPipes(std::vector<struct pollfd>& cgi_fds, int pipe_stdout[2], 
-							   int pipe_stdin[2], const HttpRequest& request) const {
-	
-	struct pollfd stdout_fd = {pipe_stdout[0], POLLIN, 0}; // monitors stdout for reading
-	cgi_fds.push_back(stdout_fd);
-
-	if (request.getMethod() == POST && !request.getBody().empty()) { // stdin if data
-		struct pollfd stdin_fd = {pipe_stdin[1], POLLOUT, 0};
-		cgi_fds.push_back(stdin_fd);
+// the header block is held back until complete, the body goes out as it comes
+void CgiHandler::relayOutput(CgiProcess* process, const char* data, size_t len) {
+	std::string ready = process->output.feed(data, len);
+	if (!process->cache_key.empty() && !process->record_overflow) {
+		if (process->recorded.length() + ready.length() > CgiCache::MAX_ENTRY_SIZE) {
+			process->record_overflow = true;
+			std::string().swap(process->recorded);
+		} else
+			process->recorded += ready;
 	}
+	if (_web_server)
+		_web_server->queueResponseData(process->client_fd, ready);
 }
 
-void CgiHandler::closeCgiPipes(int pipe_stdout[2], int pipe_stdin[2], bool stdin_closed) const {
-	if (!stdin_closed)
-		close(pipe_stdin[1]);
-	close(pipe_stdout[0]);
+// pooled workers keep their pipes between requests, only plain children get them closed
+void CgiHandler::releasePipe(CgiProcess* process, int fd) {
+	if (_web_server)
+		_web_server->removePollFd(fd);
+	_pipe_owners.erase(fd);
+	if (!process->worker)
+		close(fd);
 }
 
-std::string CgiHandler::handleParentProcess(int pipe_stdout[2], int pipe_stdin[2], 
-				const HttpRequest& request, pid_t child_pid) const {
-	close(pipe_stdout[1]);
-	close(pipe_stdin[0]);
-	
-	fcntl(pipe_stdout[0], F_SETFL, O_NONBLOCK);
-	fcntl(pipe_stdin[1], F_SETFL, O_NONBLOCK);
+void CgiHandler::closeStdin(CgiProcess* process) {
+	if (process->stdin_fd == -1)
+		return;
+	releasePipe(process, process->stdin_fd);
+	process->stdin_fd = -1;
+}
 
-	std::vector<struct pollfd> cgi_fds;
-	setupCgiPipes(cgi_fds, pipe_stdout, pipe_stdin, request);
-	
-	// cgi communication state
-	std::string output;
-	size_t bytes_written = 0;
-	bool stdin_closed = false;
-	
-	while (true) {
-		int poll_result = poll(&cgi_fds[0], cgi_fds.size(), 30000);  // 5s timeout
-		if (poll_result == -1) {
-			kill(child_pid, SIGKILL);
-			waitpid(child_pid, NULL, 0);
-			LOG_ERROR("CGI poll failed");
-			break;
-		}
-		if (poll_result == 0) {
-			kill(child_pid, SIGKILL);
-			waitpid(child_pid, NULL, 0);
-			LOG_ERROR("CGI timeout");
-			break;
-		}
-		if (cgi_fds[0].revents & POLLIN) {// reading from cgi stdout
-			if (!handleCgiStdoutRead(pipe_stdout[0], output))
-				break;
+void CgiHandler::closeStdout(CgiProcess* process) {
+	if (process->stdout_fd == -1)
+		return;
+	releasePipe(process, process->stdout_fd);
+	process->stdout_fd = -1;
+	process->output_done = true;
+}
+
+// called from the main loop after SIGCHLD woke it up
+void CgiHandler::reapChildren() {
+	std::vector<CgiProcess*> finished;
+
+	for (std::map<pid_t, CgiProcess*>::iterator it = _processes.begin();
+		 it != _processes.end(); ++it) {
+		CgiProcess* process = it->second;
+		if (process->exited)
+			continue;
+		int status;
+		if (waitpid(process->pid, &status, WNOHANG) == process->pid) {
+			process->exited = true;
+			process->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+			LOG_DEBUG("cgi pid " + size_t_to_string(process->pid) + " exited");
+			finished.push_back(process);
 		}
-		if (cgi_fds.size() > 1 && (cgi_fds[1].revents & POLLOUT) && !stdin_closed) { //writing to cgi stdin
-			const std::string& body = request.getBody();
-			handleCgiStdinWrite(pipe_stdin[1], body, bytes_written, stdin_closed, cgi_fds);
+	}
+	for (size_t i = 0; i < _retired_workers.size(); ) {
+		if (waitpid(_retired_workers[i], NULL, WNOHANG) != 0)
+			_retired_workers.erase(_retired_workers.begin() + i);
+		else
+			++i;
+	}
+	for (std::map<std::string, CgiWorkerPool*>::iterator it = _worker_pools.begin();
+		 it != _worker_pools.end(); ++it) {
+		std::vector<CgiWorker*>& workers = it->second->workers;
+		for (size_t i = 0; i < workers.size(); ) {
+			if (!workers[i]->busy && waitpid(workers[i]->pid, NULL, WNOHANG) == workers[i]->pid) {
+				LOG_ERROR("idle cgi worker " + size_t_to_string(workers[i]->pid) + " died");
+				close(workers[i]->stdin_fd);
+				close(workers[i]->stdout_fd);
+				delete workers[i];
+				workers.erase(workers.begin() + i);
+			} else
+				++i;
 		}
-		if (checkCgiProcessFinished(child_pid, pipe_stdout[0], output))
-			break;
 	}
+	for (size_t i = 0; i < finished.size(); ++i) {
+		if (finished[i]->detached) {
+			_processes.erase(finished[i]->pid);
+			releaseSlot(finished[i]);
+			delete finished[i];
+		} else if (finished[i]->output_done)
+			finishProcess(finished[i]);
+	}
+}
 
-	closeCgiPipes(pipe_stdout, pipe_stdin, stdin_closed);
-	
-	// if (!waitForCgiCompletion(child_pid))
-	// 	return generateErrorResponse(500, "CGI Script Execution Error");
+void CgiHandler::checkTimeouts() {
+	time_t now = time(NULL);
+	std::vector<CgiProcess*> timed_out;
+
+	for (std::map<pid_t, CgiProcess*>::iterator it = _processes.begin();
+		 it != _processes.end(); ++it) {
+		CgiProcess* process = it->second;
+		// a script held back for a slow client is not quiet; a client that
+		// stops reading altogether runs into its own timeout instead
+		if (_web_server && _web_server->isClientBehind(process->client_fd))
+			process->last_activity = now;
+		int timeout = process->location ? process->location->cgi_timeout : CGI_TIMEOUT;
+		if (!process->detached && now - process->last_activity > timeout)
+			timed_out.push_back(process);
+	}
+	shrinkWorkerPools();
+	expireQueued();
+	for (size_t i = 0; i < timed_out.size(); ++i) {
+		LOG_ERROR("CGI timeout");
+		Metrics::add(METRIC_CGI_TIMEOUTS);
+		int client_fd = timed_out[i]->client_fd;
+		bool headers_sent = timed_out[i]->output.headersDone();
+		BufferChain error;
+		if (!headers_sent)
+			error = generateErrorResponse(504, "Gateway Timeout");
+		if (!timed_out[i]->cache_key.empty())
+			completeCacheFill(timed_out[i], error.str(), false);
+		detachProcess(timed_out[i]);
+		if (!_web_server)
+			continue;
+		if (headers_sent) // too late for a status, cut the response short
+			_web_server->finishStreamedResponse(client_fd);
+		else
+			_web_server->queueCgiResponse(client_fd, error);
+	}
+}
+
+// exit_status -1 means killed by a signal or a worker that died mid request
+void CgiHandler::finishProcess(CgiProcess* process) {
+	int client_fd = process->client_fd;
+	bool crashed = process->exit_status == -1;
+	bool headers_sent = process->output.headersDone();
+	std::string response;
 
-	return parseCgiOutput(output);
+	if (!headers_sent && (crashed || (!process->output.hasOutput() && process->exit_status != 0))) {
+		LOG_ERROR("CGI script exited with non-zero status");
+		response = generateErrorResponse(500, "CGI Script Execution Error").str();
+	} else if (crashed)
+		LOG_ERROR("CGI script died mid response, closing the connection");
+	else
+		response = process->output.finish();
+
+	if (process->worker)
+		releaseWorker(process->worker, process->exit_status == 0);
+	_client_processes.erase(client_fd);
+	_processes.erase(process->pid);
+	if (!process->cache_key.empty())
+		completeCacheFill(process, response, !crashed && process->exit_status == 0);
+	releaseSlot(process);
+	delete process;
+
+	if (_web_server) {
+		_web_server->queueResponseData(client_fd, response);
+		_web_server->finishStreamedResponse(client_fd);
+	}
 }
 
-std::string CgiHandler::readFromPipe(int pipe_fd) const {
-	std::string output;
-	char buffer[1024];
-	ssize_t bytes_read;
-	
-	while ((bytes_read = read(pipe_fd, buffer, sizeof(buffer) - 1)) > 0) {
-		buffer[bytes_read] = '\0';
-		output += buffer;
+// drops the client side of a script; a still running child is killed and
+// stays in _processes until reapChildren collects it
+void CgiHandler::detachProcess(CgiProcess* process) {
+	closeStdin(process);
+	closeStdout(process);
+	_client_processes.erase(process->client_fd);
+	process->client_fd = -1;
+	process->detached = true;
+
+	if (process->worker) { // a half answered worker can't be reused
+		std::map<std::string, CgiWorkerPool*>::iterator it = _worker_pools.begin();
+		for (; it != _worker_pools.end(); ++it) {
+			std::vector<CgiWorker*>& workers = it->second->workers;
+			for (size_t i = 0; i < workers.size(); ++i) {
+				if (workers[i] == process->worker) {
+					workers.erase(workers.begin() + i);
+					break;
+				}
+			}
+		}
+		close(process->worker->stdin_fd);
+		close(process->worker->stdout_fd);
+		delete process->worker;
+		process->worker = NULL;
 	}
-	
-	return output;
+	if (process->exited) {
+		_processes.erase(process->pid);
+		releaseSlot(process);
+		delete process;
+	} else
+		kill(process->pid, SIGKILL);
 }
 
-std::string CgiHandler::parseCgiOutput(const std::string& raw_output) const {
-	size_t header_end = raw_output.find("\r\n\r\n");
-	if (header_end == std::string::npos) {
-		header_end = raw_output.find("\n\n");
-		if (header_end == std::string::npos) {
-			return generateCgiResponse("", raw_output);
+void CgiHandler::abortClient(int client_fd) {
+	std::map<int, std::string>::iterator queued = _queued_clients.find(client_fd);
+	if (queued != _queued_clients.end()) {
+		std::deque<CgiQueuedRequest>& queue = _queues[queued->second];
+		for (size_t i = 0; i < queue.size(); ++i) {
+			if (queue[i].request.getClientFd() != client_fd)
+				continue;
+			if (queue[i].cache_key.empty())
+				queue.erase(queue.begin() + i);
+			else // the cache still wants the result
+				queue[i].request.setClientFd(-1);
+			break;
 		}
-		header_end += 2;
-	} else 
-		header_end += 4;
-	
-	std::string headers = raw_output.substr(0, header_end - (header_end > 2 ? (raw_output[header_end - 3] == '\r' ? 4 : 2) : 0));
-	std::string body = raw_output.substr(header_end);
-	
-	return generateCgiResponse(headers, body);
+		_queued_clients.erase(queued);
+		return;
+	}
+	std::map<int, pid_t>::iterator it = _client_processes.find(client_fd);
+	std::map<int, std::string>::iterator waiter = _cache_waiters.find(client_fd);
+	if (waiter != _cache_waiters.end()) {
+		std::vector<int>& waiters = _cache_fills[waiter->second].waiters;
+		waiters.erase(std::remove(waiters.begin(), waiters.end(), client_fd), waiters.end());
+		_cache_waiters.erase(waiter);
+		return;
+	}
+	if (it == _client_processes.end())
+		return;
+	CgiProcess* process = _processes[it->second];
+	if (!process->cache_key.empty()) { // the cache still wants the result, let it run on
+		_client_processes.erase(it);
+		process->client_fd = -1;
+		return;
+	}
+	LOG_DEBUG("client " + size_t_to_string(client_fd) + " gone, aborting its cgi");
+	detachProcess(process);
 }
 
-std::string CgiHandler::generateCgiResponse(const std::string& cgi_headers, const std::string& body) const {
-	std::ostringstream response;
-	
-	// HTTP status line (CRITICAL!)
-	response << "HTTP/1.1 200 OK\r\n";
-	
-	// Add CGI headers if present
-	if (!cgi_headers.empty()) {
-		std::string headers = cgi_headers;
-		// Ensure proper line endings
-		if (headers[headers.length() - 1] != '\n')
-			headers += "\r\n";
-		response << headers;
+void CgiHandler::shutdown() {
+	for (std::map<pid_t, CgiProcess*>::iterator it = _processes.begin();
+		 it != _processes.end(); ++it) {
+		CgiProcess* process = it->second;
+		closeStdin(process);
+		closeStdout(process);
+		if (!process->exited) {
+			kill(process->pid, SIGKILL);
+			waitpid(process->pid, NULL, 0);
+		}
+		delete process;
 	}
-	
-	// Add default headers if not present in CGI output
-	if (cgi_headers.find("Content-Type:") == std::string::npos && 
-		cgi_headers.find("content-type:") == std::string::npos)
-		response << "Content-Type: text/html\r\n";
-	
-	// Essential headers
-	response << "Content-Length: " << body.length() << "\r\n";
-	response << "Connection: close\r\n";
-	response << "Server: Webserv/1.0\r\n";
-	
-	// Empty line to separate headers from body (CRITICAL!)
-	response << "\r\n";
-	
-	// Body content
-	response << body;
-	
-	return response.str();
+	_processes.clear();
+	_pipe_owners.clear();
+	_client_processes.clear();
+	_cache_fills.clear();
+	_cache_waiters.clear();
+	_running.clear();
+	_queues.clear();
+	_queued_clients.clear();
+
+	for (std::map<std::string, CgiWorkerPool*>::iterator it = _worker_pools.begin();
+		 it != _worker_pools.end(); ++it) {
+		std::vector<CgiWorker*>& workers = it->second->workers;
+		for (size_t i = 0; i < workers.size(); ++i) {
+			close(workers[i]->stdin_fd);
+			close(workers[i]->stdout_fd);
+			kill(workers[i]->pid, SIGKILL);
+			waitpid(workers[i]->pid, NULL, 0);
+			delete workers[i];
+		}
+		delete it->second;
+	}
+	_worker_pools.clear();
+	for (size_t i = 0; i < _retired_workers.size(); ++i)
+		waitpid(_retired_workers[i], NULL, 0);
+	_retired_workers.clear();
 }
@@ -0,0 +1,125 @@
+#include "CgiCache.hpp"
+#include "utils.hpp"
+#include <cstdlib>
+#include <algorithm>
+
+CgiCache::CgiCache() : _size(0) {
+}
+
+// host is always part of the key, the location picks extra request headers
+std::string CgiCache::makeKey(const HttpRequest& request, const std::vector<std::string>& headers) {
+	std::string key = request.methodToString() + " " + request.getHeader("Host") + request.getUri();
+	for (size_t i = 0; i < headers.size(); ++i)
+		key += "\n" + headers[i] + ": " + request.getHeader(headers[i]);
+	if (request.getVersion() == "HTTP/1.0")	// unchunked bodies, not for 1.1 clients
+		key += "\nHTTP/1.0";
+	return key;
+}
+
+CgiCache::Lookup CgiCache::lookup(const std::string& key, BufferChain& response) {
+	std::map<std::string, CgiCacheEntry>::iterator it = _entries.find(key);
+	if (it == _entries.end())
+		return MISS;
+
+	time_t now = time(NULL);
+	if (now < it->second.expires) {
+		response = it->second.response;
+		return HIT;
+	}
+	if (now < it->second.stale_until) {
+		response = it->second.response;
+		return STALE;
+	}
+	erase(it);
+	return MISS;
+}
+
+// only complete 200s without cookies are kept; no-store, no-cache and
+// private opt out, max-age/s-maxage and stale-while-revalidate override
+// the location defaults
+bool CgiCache::store(const std::string& key, const BufferChain& response, int valid, int stale) {
+	int status;
+	std::map<std::string, std::string> headers;
+
+	if (response.size() > MAX_ENTRY_SIZE || !parseHead(response.str(), status, headers))
+		return false;
+	if (status != 200 || headers.count("set-cookie"))
+		return false;
+
+	const std::string& cache_control = headers["cache-control"];
+	int value;
+	if (cache_control.find("no-store") != std::string::npos
+		|| cache_control.find("no-cache") != std::string::npos
+		|| cache_control.find("private") != std::string::npos)
+		return false;
+	if (cacheControlValue(cache_control, "s-maxage", value)
+		|| cacheControlValue(cache_control, "max-age", value))
+		valid = value;
+	if (cacheControlValue(cache_control, "stale-while-revalidate", value))
+		stale = value;
+	if (valid <= 0)
+		return false;
+
+	time_t now = time(NULL);
+	purgeExpired(now);
+	std::map<std::string, CgiCacheEntry>::iterator it = _entries.find(key);
+	if (it != _entries.end())
+		erase(it);
+	if (_size + response.size() > MAX_SIZE)
+		return false;
+
+	CgiCacheEntry& entry = _entries[key];
+	entry.response = response;
+	entry.expires = now + valid;
+	entry.stale_until = entry.expires + std::max(stale, 0);
+	_size += response.size();
+	return true;
+}
+
+bool CgiCache::parseHead(const std::string& response, int& status,
+						 std::map<std::string, std::string>& headers) {
+	size_t head_end = response.find("\r\n\r\n");
+	size_t line_end = response.find("\r\n");
+	if (head_end == std::string::npos || response.compare(0, 9, "HTTP/1.1 ") != 0)
+		return false;
+	status = std::atoi(response.c_str() + 9);
+
+	while (line_end < head_end) {
+		size_t start = line_end + 2;
+		line_end = response.find("\r\n", start);
+		size_t colon = response.find(':', start);
+		if (colon == std::string::npos || colon > line_end)
+			continue;
+		std::string name = response.substr(start, colon - start);
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+		size_t value_start = response.find_first_not_of(" \t", colon + 1);
+		if (value_start > line_end)
+			value_start = line_end;
+		std::string value = response.substr(value_start, line_end - value_start);
+		std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+		headers[name] = value;
+	}
+	return true;
+}
+
+bool CgiCache::cacheControlValue(const std::string& cache_control, const std::string& name, int& value) {
+	size_t pos = cache_control.find(name + "=");
+	if (pos == std::string::npos || (pos > 0 && cache_control[pos - 1] != ' ' && cache_control[pos - 1] != ','))
+		return false;
+	value = std::atoi(cache_control.c_str() + pos + name.length() + 1);
+	return true;
+}
+
+void CgiCache::erase(std::map<std::string, CgiCacheEntry>::iterator it) {
+	_size -= it->second.response.size();
+	_entries.erase(it);
+}
+
+void CgiCache::purgeExpired(time_t now) {
+	std::map<std::string, CgiCacheEntry>::iterator it = _entries.begin();
+	while (it != _entries.end()) {
+		std::map<std::string, CgiCacheEntry>::iterator current = it++;
+		if (now >= current->second.stale_until)
+			erase(current);
+	}
+}
@@ -0,0 +1,154 @@
+#include "CgiOutput.hpp"
+#include "utils.hpp"
+#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+
+CgiOutputStream::CgiOutputStream() : _headers_done(false), _chunked(false), _http10(false),
+	_finished(false), _status_code(200), _body_bytes(0) {
+}
+
+static std::string defaultStatusText(int code) {
+	switch (code) {
+		case 200: return "OK";
+		case 201: return "Created";
+		case 204: return "No Content";
+		case 301: return "Moved Permanently";
+		case 302: return "Found";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 500: return "Internal Server Error";
+		default: return "Unknown Status";
+	}
+}
+
+bool CgiOutputStream::findHeaderEnd(size_t& headers_len, size_t& body_start) const {
+	size_t crlf = _pending.find("\r\n\r\n");
+	size_t lf = _pending.find("\n\n");
+	if (crlf == std::string::npos && lf == std::string::npos)
+		return false;
+	if (lf == std::string::npos || (crlf != std::string::npos && crlf < lf)) {
+		headers_len = crlf;
+		body_start = crlf + 4;
+	} else {
+		headers_len = lf;
+		body_start = lf + 2;
+	}
+	return true;
+}
+
+std::string CgiOutputStream::feed(const char* data, size_t len) {
+	if (_finished || len == 0)
+		return "";
+	if (_headers_done)
+		return encodeBody(data, len);
+
+	_pending.append(data, len);
+	size_t headers_len;
+	size_t body_start;
+	if (!findHeaderEnd(headers_len, body_start))
+		return "";
+
+	std::string head = buildHead(_pending.substr(0, headers_len), false);
+	std::string body = _pending.substr(body_start);
+	_pending.clear();
+	return head + encodeBody(body.c_str(), body.length());
+}
+
+std::string CgiOutputStream::finish() {
+	if (_finished)
+		return "";
+	_finished = true;
+
+	if (!_headers_done) { // no header block at all, everything is body
+		std::string body;
+		body.swap(_pending);
+		_body_bytes = body.length();
+		std::string head = buildHead("Content-Length: " + size_t_to_string(body.length()), true);
+		return head + body;
+	}
+	if (_chunked)
+		return "0\r\n\r\n";
+	return "";
+}
+
+// cgi headers become http headers; Status: turns into the status line
+std::string CgiOutputStream::buildHead(const std::string& cgi_headers, bool has_length) {
+	std::istringstream stream(cgi_headers);
+	std::string line;
+	std::string status_text;
+	std::string headers;
+	bool has_type = false;
+	bool has_location = false;
+	bool has_status = false;
+
+	while (std::getline(stream, line)) {
+		if (!line.empty() && line[line.length() - 1] == '\r')
+			line.erase(line.length() - 1);
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+			continue;
+		std::string name = line.substr(0, colon);
+		std::string value = line.substr(colon + 1);
+		while (!value.empty() && (value[0] == ' ' || value[0] == '\t'))
+			value.erase(0, 1);
+		std::string lower = name;
+		std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+
+		if (lower == "status") {
+			_status_code = std::atoi(value.c_str());
+			size_t space = value.find(' ');
+			if (space != std::string::npos)
+				status_text = value.substr(space + 1);
+			has_status = true;
+			continue;
+		}
+		if (lower == "connection" || lower == "transfer-encoding")
+			continue;
+		if (lower == "content-type")
+			has_type = true;
+		else if (lower == "location")
+			has_location = true;
+		else if (lower == "content-length")
+			has_length = true;
+		headers += name + ": " + value + "\r\n";
+	}
+	if (has_location && !has_status)
+		_status_code = 302;
+	if (_status_code < 100 || _status_code > 999)
+		_status_code = 500;
+	if (status_text.empty())
+		status_text = defaultStatusText(_status_code);
+
+	std::ostringstream head;
+	head << "HTTP/1.1 " << _status_code << " " << status_text << "\r\n";
+	head << headers;
+	if (!has_type)
+		head << "Content-Type: text/html\r\n";
+	_chunked = !has_length && !_http10;	// the head always says Connection: close
+	if (_chunked)
+		head << "Transfer-Encoding: chunked\r\n";
+	head << "Connection: close\r\n";
+	head << "Server: Webserv/1.0\r\n";
+	head << "\r\n";
+
+	_headers_done = true;
+	return head.str();
+}
+
+std::string CgiOutputStream::encodeBody(const char* data, size_t len) {
+	if (len == 0)
+		return "";
+	_body_bytes += len;
+	if (!_chunked)
+		return std::string(data, len);
+
+	std::ostringstream chunk;
+	chunk << std::hex << len << "\r\n";
+	std::string out = chunk.str();
+	out.append(data, len);
+	out += "\r\n";
+	return out;
+}
@@ -60,12 +60,12 @@ std::vector<std::string> CgiHandler::setupEnvironment(const HttpRequest& request
     }
     
     // adds http headers
-    const std::map<std::string, std::string>& headers = request.getHeaders();
-    for (std::map<std::string, std::string>::const_iterator it = headers.begin();
+    const std::vector<HeaderField>& headers = request.getHeaders();
+    for (std::vector<HeaderField>::const_iterator it = headers.begin();
          it != headers.end(); ++it) {
         
-        std::string header_name = it->first;
-        std::string header_value = it->second;
+        std::string header_name(it->name, it->name_length);
+        std::string header_value(it->value, it->value_length);
         
         // change to cgi format: HTTP_HEADER_NAME
         std::string cgi_name = "HTTP_";
@@ -91,44 +91,33 @@ std::vector<std::string> CgiHandler::setupEnvironment(const HttpRequest& request
     return env_vars;
 }
 
-std::string CgiHandler::getInterpreter(const std::string& script_path, const std::map<std::string, std::string>& interpreters) const {
-	for (std::map<std::string, std::string>::const_iterator it = interpreters.begin();
-		 it != interpreters.end(); ++it) {
-		if (script_path.find(it->first) != std::string::npos)
-			return it->second;
-	}
-	return "";
-}
-
 bool CgiHandler::isExecutable(const std::string& path) const {
 	return access(path.c_str(), X_OK) == 0;
 }
 
 std::string CgiHandler::getScriptPath(const std::string& uri) const {
-	if (uri.find("/cgi-bin/") == 0)
-		return _cgi_bin_path + uri.substr(8); // remove "/cgi-bin" prefix
-	return "./www" + uri; // default web root
+	std::string path = uri.substr(0, uri.find('?'));
+	if (path.find("/cgi-bin/") == 0)
+		return _cgi_bin_path + path.substr(8); // remove "/cgi-bin" prefix
+	return "./www" + path; // default web root
 }
 
-std::string CgiHandler::generateErrorResponse(int status_code,
+BufferChain CgiHandler::generateErrorResponse(int status_code,
 		const std::string& status_text) const {
 
      if (_web_server) {
         return _web_server->generateErrorResponse(status_code, status_text);
     }
-	std::ostringstream response;
-	std::ostringstream body;
-	
-	body << "<html><body><h1>" << status_code << " " << status_text << "</h1></body></html>";
-	std::string body_str = body.str();
-	
-	response << "HTTP/1.1 " << status_code << " " << status_text << "\r\n";
-	response << "Content-Type: text/html\r\n";
-	response << "Content-Length: " << body_str.length() << "\r\n";
-	response << "Connection: close\r\n";
-	response << "Server: Webserv/1.0\r\n";
-	response << "\r\n";
-	response << body_str;
-	
-	return response.str();
+	std::string body = "<html><body><h1>" + int_to_string(status_code) + " " + status_text + "</h1></body></html>";
+	std::string text = "HTTP/1.1 " + int_to_string(status_code) + " " + status_text + "\r\n";
+	text += "Content-Type: text/html\r\n";
+	text += "Content-Length: " + size_t_to_string(body.length()) + "\r\n";
+	text += "Connection: close\r\n";
+	text += "Server: Webserv/1.0\r\n";
+	text += "\r\n";
+	text += body;
+
+	BufferChain response;
+	response.appendShared(text);
+	return response;
 }
\ No newline at end of file
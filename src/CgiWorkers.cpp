@@ -0,0 +1,200 @@
+#include "Cgi.hpp"
+#include "Config.hpp"
+#include "utils.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
+
+// also called after a reload: pools take the new settings, pools of removed
+// locations drop to zero and shrink away as their workers go idle. busy
+// workers finish on the old shim and are replaced with the new one once recycled
+void CgiHandler::startWorkerPools(const std::vector<ServerConfig>& servers) {
+	for (std::map<std::string, CgiWorkerPool*>::iterator it = _worker_pools.begin();
+		 it != _worker_pools.end(); ++it)
+		it->second->min_workers = 0;
+
+	for (size_t i = 0; i < servers.size(); ++i) {
+		for (size_t j = 0; j < servers[i].locations.size(); ++j) {
+			const LocationConfig& location = servers[i].locations[j];
+			if (location.cgi_worker.empty())
+				continue;
+			CgiWorkerPool* pool = getWorkerPool(&location);
+			configureWorkerPool(pool, &location);
+			while (pool->workers.size() < pool->min_workers && spawnWorker(pool))
+				;
+			LOG_INFO("cgi worker pool for " + location.key + ": "
+					+ size_t_to_string(pool->workers.size()) + " workers ready");
+		}
+	}
+}
+
+CgiWorkerPool* CgiHandler::getWorkerPool(const LocationConfig* location) {
+	std::map<std::string, CgiWorkerPool*>::iterator it = _worker_pools.find(location->key);
+	if (it != _worker_pools.end())
+		return it->second;
+
+	CgiWorkerPool* pool = new CgiWorkerPool();
+	configureWorkerPool(pool, location);
+	_worker_pools[location->key] = pool;
+	return pool;
+}
+
+void CgiHandler::configureWorkerPool(CgiWorkerPool* pool, const LocationConfig* location) {
+	pool->shim = location->cgi_worker;
+	pool->interpreter = location->cgi_worker_interpreter;
+	pool->min_workers = location->cgi_workers_min;
+	pool->max_workers = location->cgi_workers_max;
+	pool->max_requests = location->cgi_worker_max_requests;
+	pool->idle_timeout = location->cgi_worker_idle_timeout;
+}
+
+CgiWorker* CgiHandler::spawnWorker(CgiWorkerPool* pool) {
+	int pipe_stdout[2];
+	int pipe_stdin[2];
+
+	if (!createPipes(pipe_stdout, pipe_stdin))
+		return NULL;
+
+	std::vector<std::string> argv;
+	if (!pool->interpreter.empty())
+		argv.push_back(pool->interpreter);
+	argv.push_back(pool->shim);
+
+	pid_t pid = spawnChild(argv, NULL, pipe_stdin[0], pipe_stdout[1]);
+	if (pid == -1) {
+		close(pipe_stdout[0]);
+		close(pipe_stdout[1]);
+		close(pipe_stdin[0]);
+		close(pipe_stdin[1]);
+		return NULL;
+	}
+	close(pipe_stdout[1]);
+	close(pipe_stdin[0]);
+	fcntl(pipe_stdout[0], F_SETFL, O_NONBLOCK);
+	fcntl(pipe_stdin[1], F_SETFL, O_NONBLOCK);
+
+	CgiWorker* worker = new CgiWorker();
+	worker->pid = pid;
+	worker->stdout_fd = pipe_stdout[0];
+	worker->stdin_fd = pipe_stdin[1];
+	worker->idle_since = time(NULL);
+	pool->workers.push_back(worker);
+	LOG_DEBUG("cgi worker " + size_t_to_string(pid) + " spawned for " + pool->shim);
+	Metrics::add(METRIC_CGI_SPAWNS);
+	return worker;
+}
+
+CgiWorker* CgiHandler::acquireWorker(CgiWorkerPool* pool) {
+	for (size_t i = 0; i < pool->workers.size(); ++i) {
+		if (!pool->workers[i]->busy) {
+			pool->workers[i]->busy = true;
+			return pool->workers[i];
+		}
+	}
+	if (pool->workers.size() >= pool->max_workers)
+		return NULL;
+	CgiWorker* worker = spawnWorker(pool);
+	if (worker)
+		worker->busy = true;
+	return worker;
+}
+
+BufferChain CgiHandler::executeOnWorker(CgiWorker* worker, const std::string& script_path,
+										const HttpRequest& request, const std::string& cache_key,
+										const LocationConfig* location) {
+	std::vector<std::string> env_vars = setupEnvironment(request, script_path);
+	std::string env_block;
+	for (size_t i = 0; i < env_vars.size(); ++i) {
+		env_block += env_vars[i];
+		env_block += '\0';
+	}
+	std::string body;
+	if (request.getMethod() == POST)
+		body = request.getBody();
+
+	CgiProcess* process = new CgiProcess();
+	process->pid = worker->pid;
+	process->client_fd = request.getClientFd();
+	process->output.setClientVersion(request.getVersion());
+	process->stdout_fd = worker->stdout_fd;
+	process->stdin_fd = worker->stdin_fd;
+	process->worker = worker;
+	process->cache_key = cache_key;
+	process->location = location;
+	process->config = request.getConfig();
+	process->body = size_t_to_string(env_block.length()) + " " + size_t_to_string(body.length())
+		+ "\n" + env_block + body;
+	process->last_activity = time(NULL);
+	registerProcess(process);
+
+	LOG_DEBUG("cgi worker " + size_t_to_string(worker->pid) + " serving client "
+			+ size_t_to_string(process->client_fd));
+	return BufferChain();
+}
+
+// strips the "<length>\n" prefix and relays the payload; true once the whole frame is in
+bool CgiHandler::readWorkerFrame(CgiProcess* process, const char* data, size_t len) {
+	if (!process->frame_started) {
+		process->frame_header.append(data, len);
+		size_t newline = process->frame_header.find('\n');
+		if (newline == std::string::npos)
+			return false;
+		process->frame_remaining = std::strtoul(process->frame_header.c_str(), NULL, 10);
+		process->frame_started = true;
+		std::string payload = process->frame_header.substr(newline + 1);
+		process->frame_header.clear();
+		return readWorkerFrame(process, payload.c_str(), payload.length());
+	}
+	size_t used = std::min(len, process->frame_remaining);
+	relayOutput(process, data, used);
+	process->frame_remaining -= used;
+	return process->frame_remaining == 0;
+}
+
+void CgiHandler::releaseWorker(CgiWorker* worker, bool healthy) {
+	for (std::map<std::string, CgiWorkerPool*>::iterator it = _worker_pools.begin();
+		 it != _worker_pools.end(); ++it) {
+		std::vector<CgiWorker*>& workers = it->second->workers;
+		for (size_t i = 0; i < workers.size(); ++i) {
+			if (workers[i] != worker)
+				continue;
+			worker->busy = false;
+			worker->requests_served++;
+			worker->idle_since = time(NULL);
+			if (!healthy || worker->requests_served >= it->second->max_requests)
+				retireWorker(it->second, worker);
+			return;
+		}
+	}
+}
+
+// closing stdin makes the shim leave its loop; the pid is reaped later
+void CgiHandler::retireWorker(CgiWorkerPool* pool, CgiWorker* worker) {
+	for (size_t i = 0; i < pool->workers.size(); ++i) {
+		if (pool->workers[i] == worker) {
+			pool->workers.erase(pool->workers.begin() + i);
+			break;
+		}
+	}
+	LOG_DEBUG("cgi worker " + size_t_to_string(worker->pid) + " retired after "
+			+ size_t_to_string(worker->requests_served) + " requests");
+	close(worker->stdin_fd);
+	close(worker->stdout_fd);
+	_retired_workers.push_back(worker->pid);
+	delete worker;
+}
+
+void CgiHandler::shrinkWorkerPools() {
+	time_t now = time(NULL);
+
+	for (std::map<std::string, CgiWorkerPool*>::iterator it = _worker_pools.begin();
+		 it != _worker_pools.end(); ++it) {
+		CgiWorkerPool* pool = it->second;
+		for (size_t i = 0; i < pool->workers.size() && pool->workers.size() > pool->min_workers; ) {
+			CgiWorker* worker = pool->workers[i];
+			if (!worker->busy && now - worker->idle_since > pool->idle_timeout)
+				retireWorker(pool, worker);
+			else
+				++i;
+		}
+	}
+}
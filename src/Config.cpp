@@ -2,8 +2,10 @@
 #include "utils.hpp"
 #include <fstream>
 #include <iostream>
+#include <cerrno>
+#include <set>
 
-Config::Config() {
+Config::Config() : _refs(0) {
 }
 
 Config::~Config() {
@@ -13,7 +15,7 @@ ServerConfig Config::getDefaultServerConfig() {
 	ServerConfig default_server;
 	default_server.host = "127.0.0.1";
 	default_server.port = 8080;
-	default_server.server_name = "localhost";
+	default_server.server_names.push_back("localhost");
 	default_server.root = "./www";
 	default_server.index = "index.html";
 	default_server.client_max_body_size = 1024 * 1024;
@@ -54,9 +56,20 @@ void Config::parseSimpleDirective(const std::string& line, ServerConfig& server)
 		} else {
 			server.port = atoi(value.c_str());
 		}
+		std::string flag;
+		iss >> flag;
+		server.default_server = flag.find("default_server") == 0;
 		LOG_DEBUG("parsed listen: " + server.host + ":" + int_to_string(server.port));
 	} else if (key == "server_name") {
-		server.server_name = value;
+		server.server_names.clear();
+		std::string name = value;
+		do {
+			if (!name.empty() && name[name.length() - 1] == ';')
+				name.erase(name.length() - 1);
+			std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+			if (!name.empty())
+				server.server_names.push_back(name);
+		} while (iss >> name);
 		LOG_DEBUG("parsed server_name: " + value);
 	} else if (key == "root") {
 		server.root = value;
@@ -70,6 +83,18 @@ void Config::parseSimpleDirective(const std::string& line, ServerConfig& server)
 	} else if (key == "error_page") {  // add this
 		parseErrorPage(line, server.error_pages);
 		LOG_DEBUG("parsed error_page");
+	} else if (key == "access_log") {
+		server.access_log = value == "off" ? "" : value;
+		std::string option;
+		while (iss >> option) {
+			if (!option.empty() && option[option.length() - 1] == ';')
+				option.erase(option.length() - 1);
+			if (option.compare(0, 7, "sample=") == 0)
+				server.access_log_sample = std::max(1, atoi(option.c_str() + 7));
+			else if (!option.empty())
+				server.access_log_format = option;
+		}
+		LOG_DEBUG("parsed access_log: " + value);
 	} else {
 		LOG_DEBUG("unknown dir: " + key);
 	}
@@ -116,16 +141,53 @@ void Config::parseSimpleDirective(const std::string& line, LocationConfig& locat
 		location.autoindex = (tokens[1] == "on");
 	else if (directive == "allow_methods" || directive == "methods")
 		parseAllowedMethods(line, location.allowed_methods);
-	else if (directive == "cgi_extension" && tokens.size() >= 2)
-		location.cgi_extension = tokens[1];
-	else if (directive == "cgi_path" && tokens.size() >= 2)
-		location.cgi_path = tokens[1];
+	else if (directive == "cgi_extension")
+		location.cgi_extensions.insert(location.cgi_extensions.end(), tokens.begin() + 1, tokens.end());
+	else if (directive == "cgi_path")
+		location.cgi_paths.insert(location.cgi_paths.end(), tokens.begin() + 1, tokens.end());
 	else if (directive == "upload_path" && tokens.size() >= 2)
 		location.upload_path = tokens[1];
 	else if (directive == "error_page")
 		parseErrorPage(line, location.error_pages);
 	else if (directive == "return" && tokens.size() >= 2)
 		location.redirect = tokens[1];
+	else if (directive == "proxy_pass" && tokens.size() >= 2)
+		location.proxy_pass = tokens[1];
+	else if (directive == "fastcgi_pass" && tokens.size() >= 2)
+		location.fastcgi_pass = tokens[1];
+	else if (directive == "cgi_worker" && tokens.size() >= 2)
+		location.cgi_worker = tokens[1];
+	else if (directive == "cgi_workers" && tokens.size() >= 2) {
+		location.cgi_workers_max = std::atoi(tokens[1].c_str());
+		if (tokens.size() >= 3)
+			location.cgi_workers_min = std::atoi(tokens[2].c_str());
+		if (location.cgi_workers_max == 0)
+			location.cgi_workers_max = 1;
+		if (location.cgi_workers_min > location.cgi_workers_max)
+			location.cgi_workers_min = location.cgi_workers_max;
+	}
+	else if (directive == "cgi_worker_max_requests" && tokens.size() >= 2)
+		location.cgi_worker_max_requests = std::atoi(tokens[1].c_str());
+	else if (directive == "cgi_worker_idle_timeout" && tokens.size() >= 2)
+		location.cgi_worker_idle_timeout = std::atoi(tokens[1].c_str());
+	else if (directive == "cgi_cache" && tokens.size() >= 2) {
+		location.cgi_cache_valid = std::atoi(tokens[1].c_str());
+		if (tokens.size() >= 3)
+			location.cgi_cache_stale = std::atoi(tokens[2].c_str());
+	}
+	else if (directive == "cgi_cache_key")
+		location.cgi_cache_key.assign(tokens.begin() + 1, tokens.end());
+	else if (directive == "stub_status")
+		location.stub_status = tokens.size() < 2 || tokens[1] == "on";
+	else if (directive == "cgi_max_concurrent" && tokens.size() >= 2)
+		location.cgi_max_concurrent = std::atoi(tokens[1].c_str());
+	else if (directive == "cgi_queue_size" && tokens.size() >= 2)
+		location.cgi_queue_size = std::atoi(tokens[1].c_str());
+	else if (directive == "cgi_timeout" && tokens.size() >= 2) {
+		location.cgi_timeout = std::atoi(tokens[1].c_str());
+		if (location.cgi_timeout <= 0)
+			location.cgi_timeout = 30;
+	}
 }
 
 void Config::parseAllowedMethods(const std::string& line, std::vector<std::string>& methods) {
@@ -153,35 +215,294 @@ void Config::parseErrorPage(const std::string& line, std::map<int, std::string>&
 }
 
 const ServerConfig* Config::findServerConfig(const std::string& host, int port, const std::string& server_name) const {
-	for (std::vector<ServerConfig>::const_iterator it = _servers.begin(); it != _servers.end(); ++it) {
-		if (it->host == host && it->port == port) {
-			if (server_name.empty() || it->server_name == server_name)
-				return &(*it);
+	std::map<std::string, ListenRoutes>::const_iterator it = _routes.find(host + ":" + int_to_string(port));
+	if (it != _routes.end())
+		return it->second.resolve(server_name);
+	return _servers.empty() ? NULL : &_servers[0];
+}
+
+// compiles each server's locations, then one entry per listen address. the
+// first block on an address is its default unless another one says
+// default_server; a name claimed twice stays with the first block
+void Config::buildRoutes() {
+	std::map<std::string, bool> checked;	// interpreter -> executable
+	std::set<std::string> keys;
+
+	_routes.clear();
+	for (std::vector<ServerConfig>::iterator it = _servers.begin(); it != _servers.end(); ++it) {
+		it->location_tree.clear();
+		loadErrorPages(*it);
+		std::string address = it->host + ":" + int_to_string(it->port);
+		std::string name = it->server_names.empty() ? address : it->server_names[0];
+		for (size_t i = 0; i < it->locations.size(); ++i) {
+			LocationConfig& location = it->locations[i];
+			it->location_tree.insert(location.path, i);
+			buildCgiHandlers(location, checked);
+			location.metrics_slot = Metrics::locationSlot(name, location.path);
+			// stays the same across reloads unless two blocks share address and name
+			location.key = address + " " + name + " " + location.path;
+			for (size_t n = 2; !keys.insert(location.key).second; ++n)
+				location.key = address + " " + name + " " + location.path + " #" + size_t_to_string(n);
 		}
 	}
-	
 	for (std::vector<ServerConfig>::const_iterator it = _servers.begin(); it != _servers.end(); ++it) {
-		if (it->port == port)
-			return &(*it);
+		ListenRoutes& routes = _routes[it->host + ":" + int_to_string(it->port)];
+		routes.host = it->host;
+		routes.port = it->port;
+		if (!routes.default_server || (it->default_server && !routes.default_server->default_server))
+			routes.default_server = &(*it);
+
+		for (size_t i = 0; i < it->server_names.size(); ++i) {
+			const std::string& name = it->server_names[i];
+			std::map<std::string, const ServerConfig*>* table = &routes.exact_names;
+			std::string key = name;
+			if (name.compare(0, 2, "*.") == 0) {
+				table = &routes.leading_wildcards;
+				key = name.substr(1);
+			} else if (name.length() > 2 && name.compare(name.length() - 2, 2, ".*") == 0) {
+				table = &routes.trailing_wildcards;
+				key = name.substr(0, name.length() - 1);
+			}
+			if (table->find(key) != table->end())
+				LOG_ERROR("conflicting server name \"" + name + "\" on " + it->host + ":" + int_to_string(it->port) + ", ignored");
+			else
+				(*table)[key] = &(*it);
+		}
 	}
-	
-	return _servers.empty() ? NULL : &_servers[0];
 }
 
-const LocationConfig* Config::findLocationConfig(const ServerConfig& server, const std::string& uri) const {
-	const LocationConfig* best_match = NULL;
-	size_t best_match_length = 0;
-	
-	for (std::vector<LocationConfig>::const_iterator it = server.locations.begin(); it != server.locations.end(); ++it) {
-		if (uri.find(it->path) == 0) {
-			if (it->path.length() > best_match_length) {
-				best_match = &(*it);
-				best_match_length = it->path.length();
+// formats are compiled and files checked once here, a bad one fails the load
+bool Config::buildAccessLogs() {
+	for (std::vector<ServerConfig>::iterator it = _servers.begin(); it != _servers.end(); ++it) {
+		it->access_log_id = -1;
+		if (it->access_log.empty())
+			continue;
+		std::string format;
+		std::map<std::string, std::string>::const_iterator named = _log_formats.find(it->access_log_format);
+		if (named != _log_formats.end())
+			format = named->second;
+		else if (it->access_log_format == "combined")
+			format = AccessLogFormat::COMBINED;
+		else {
+			LOG_ERROR("unknown log_format " + it->access_log_format);
+			return false;
+		}
+		std::string error;
+		if (!it->access_format.compile(format, error)) {
+			LOG_ERROR(error + " in log_format " + it->access_log_format);
+			return false;
+		}
+		int fd = open(it->access_log.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			LOG_ERROR("cannot open access_log " + it->access_log + ": " + strerror(errno));
+			return false;
+		}
+		close(fd);
+		it->access_log_id = Logger::openAccessLog(it->access_log);
+	}
+	return true;
+}
+
+// error pages are read once here, a reload reads them again. a page that
+// cannot be read falls back to the built-in one
+void Config::loadErrorPages(ServerConfig& server) {
+	server.error_bodies.clear();
+	for (std::map<int, std::string>::const_iterator it = server.error_pages.begin();
+			it != server.error_pages.end(); ++it) {
+		std::string path = server.root + it->second;
+		std::ifstream file(path.c_str(), std::ios::binary);
+		std::ostringstream body;
+		if (file.is_open())
+			body << file.rdbuf();
+		if (body.str().empty()) {
+			LOG_ERROR("cannot read error page " + path);
+			continue;
+		}
+		std::string page = body.str();
+		server.error_bodies[it->first].appendShared(page);
+	}
+}
+
+// cgi_extension and cgi_path pair up by position; a single cgi_path serves
+// every extension, extensions without one run the script itself
+void Config::buildCgiHandlers(LocationConfig& location, std::map<std::string, bool>& checked) {
+	location.cgi_handlers.clear();
+	for (size_t i = 0; i < location.cgi_extensions.size(); ++i) {
+		std::string extension = location.cgi_extensions[i];
+		if (extension[0] != '.')
+			extension = "." + extension;
+		std::string path;
+		if (i < location.cgi_paths.size())
+			path = location.cgi_paths[i];
+		else if (location.cgi_paths.size() == 1)
+			path = location.cgi_paths[0];
+		location.cgi_handlers[extension] = makeInterpreter(path, checked);
+	}
+
+	location.cgi_worker_interpreter.clear();
+	if (!location.cgi_worker.empty()) {
+		const CgiInterpreter* interpreter = findCgiHandler(&location, location.cgi_worker);
+		if (interpreter)
+			location.cgi_worker_interpreter = interpreter->path;
+	}
+}
+
+CgiInterpreter Config::makeInterpreter(const std::string& path, std::map<std::string, bool>& checked) {
+	CgiInterpreter interpreter;
+	interpreter.path = path;
+	if (path.empty())
+		return interpreter;
+	std::map<std::string, bool>::iterator it = checked.find(path);
+	if (it == checked.end()) {
+		it = checked.insert(std::make_pair(path, access(path.c_str(), X_OK) == 0)).first;
+		if (!it->second)
+			LOG_INFO("cgi interpreter " + path + " is not executable, its scripts will fail");
+	}
+	interpreter.usable = it->second;
+	return interpreter;
+}
+
+// extension of the last path segment, "" if it has none
+std::string Config::getExtension(const std::string& uri) {
+	size_t end = uri.find('?');
+	if (end == std::string::npos)
+		end = uri.length();
+	size_t slash = uri.rfind('/', end == 0 ? 0 : end - 1);
+	size_t dot = uri.rfind('.', end == 0 ? 0 : end - 1);
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return "";
+	return uri.substr(dot, end - dot);
+}
+
+// only the location's own table; scripts never run where the config does not
+// enable cgi_extension for them
+const CgiInterpreter* Config::findCgiHandler(const LocationConfig* location, const std::string& uri) const {
+	if (!location || location->cgi_handlers.empty())
+		return NULL;
+	std::string extension = getExtension(uri);
+	if (extension.empty())
+		return NULL;
+	std::map<std::string, CgiInterpreter>::const_iterator it = location->cgi_handlers.find(extension);
+	return it == location->cgi_handlers.end() ? NULL : &it->second;
+}
+
+// exact name, then the longest "*.suffix", then the longest "prefix.*",
+// then the address's default server
+const ServerConfig* ListenRoutes::resolve(const std::string& host_header) const {
+	std::string name = host_header.substr(0, host_header.find(':'));
+	std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+	if (!name.empty() && name[name.length() - 1] == '.')
+		name.erase(name.length() - 1);
+	if (name.empty())
+		return default_server;
+
+	std::map<std::string, const ServerConfig*>::const_iterator found = exact_names.find(name);
+	if (found != exact_names.end())
+		return found->second;
+	if (!leading_wildcards.empty()) {
+		for (size_t dot = name.find('.'); dot != std::string::npos; dot = name.find('.', dot + 1)) {
+			found = leading_wildcards.find(name.substr(dot));
+			if (found != leading_wildcards.end())
+				return found->second;
+		}
+	}
+	if (!trailing_wildcards.empty()) {
+		for (size_t dot = name.rfind('.'); dot != std::string::npos && dot > 0; dot = name.rfind('.', dot - 1)) {
+			found = trailing_wildcards.find(name.substr(0, dot + 1));
+			if (found != trailing_wildcards.end())
+				return found->second;
+		}
+	}
+	return default_server;
+}
+
+// types { text/html html htm; ... } as in mime.types, added to the table
+bool Config::parseTypesBlock(std::ifstream& file, int& line_number) {
+	std::string block_line;
+	while (std::getline(file, block_line)) {
+		line_number++;
+		if (shouldSkipLine(block_line))
+			continue;
+		if (trim(block_line) == "}")
+			return true;
+		if (!_mime_types.addLine(block_line)) {
+			LOG_ERROR("bad mime type (line " + int_to_string(line_number) + ")");
+			return false;
+		}
+	}
+	LOG_ERROR("unclosed types block");
+	return false;
+}
+
+// upstream <name> { server host:port [weight=N] [max_fails=N] [fail_timeout=S];
+//                   least_conn; | hash $request_uri; keepalive N; }
+bool Config::parseUpstreamBlock(std::ifstream& file, const std::string& line, int& line_number) {
+	std::vector<std::string> header = splitLine(line);
+	if (header.size() < 3 || header[2] != "{") {
+		LOG_ERROR("bad upstream block (line " + int_to_string(line_number) + ")");
+		return false;
+	}
+	UpstreamConfig upstream;
+	upstream.name = header[1];
+
+	std::string block_line;
+	while (std::getline(file, block_line)) {
+		line_number++;
+		if (shouldSkipLine(block_line))
+			continue;
+		if (trim(block_line) == "}") {
+			if (upstream.servers.empty()) {
+				LOG_ERROR("upstream " + upstream.name + " has no servers");
+				return false;
 			}
+			_upstreams[upstream.name] = upstream;
+			LOG_INFO("parsed upstream: " + upstream.name);
+			return true;
 		}
+		std::vector<std::string> tokens = splitLine(block_line);
+		if (tokens[0] == "server" && tokens.size() >= 2)
+			parseUpstreamServer(tokens, upstream);
+		else if (tokens[0] == "least_conn")
+			upstream.balance = "least_conn";
+		else if (tokens[0] == "hash" && tokens.size() >= 2) {
+			upstream.balance = "hash";
+			upstream.hash_key = tokens[1];
+		} else if (tokens[0] == "keepalive" && tokens.size() >= 2)
+			upstream.keepalive = std::atoi(tokens[1].c_str());
+		else
+			LOG_DEBUG("unknown upstream dir: " + tokens[0]);
 	}
-	
-	return best_match;
+	LOG_ERROR("unclosed upstream block");
+	return false;
+}
+
+void Config::parseUpstreamServer(const std::vector<std::string>& tokens, UpstreamConfig& upstream) {
+	UpstreamServerConfig server;
+	server.address = tokens[1];
+	for (size_t i = 2; i < tokens.size(); ++i) {
+		size_t eq = tokens[i].find('=');
+		if (eq == std::string::npos)
+			continue;
+		std::string name = tokens[i].substr(0, eq);
+		int value = std::atoi(tokens[i].c_str() + eq + 1);
+		if (name == "weight" && value > 0)
+			server.weight = value;
+		else if (name == "max_fails")
+			server.max_fails = value;
+		else if (name == "fail_timeout")
+			server.fail_timeout = value;
+	}
+	upstream.servers.push_back(server);
+}
+
+const UpstreamConfig* Config::findUpstream(const std::string& name) const {
+	std::map<std::string, UpstreamConfig>::const_iterator it = _upstreams.find(name);
+	return it == _upstreams.end() ? NULL : &it->second;
+}
+
+const LocationConfig* Config::findLocationConfig(const ServerConfig& server, const std::string& uri) const {
+	int index = server.location_tree.match(uri);
+	return index == -1 ? NULL : &server.locations[index];
 }
 
 bool Config::validateConfig() const {
@@ -221,6 +542,16 @@ bool Config::parseConfigFile(const std::string& filename) {
 		line_number++;
 		if (shouldSkipLine(line))
 			continue;
+		if (!in_server_block && isUpstreamStart(line)) {
+			if (!parseUpstreamBlock(file, line, line_number))
+				return false;
+			continue;
+		}
+		if (!in_server_block && isTypesStart(line)) {
+			if (!parseTypesBlock(file, line_number))
+				return false;
+			continue;
+		}
 		if (isServerStart(line)) {
 			if (!handleServerStart(in_server_block, current_server, line_number, file))
 				return false;
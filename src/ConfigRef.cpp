@@ -0,0 +1,37 @@
+#include "ConfigRef.hpp"
+#include "Config.hpp"
+
+ConfigRef::ConfigRef() : _config(NULL) {
+}
+
+ConfigRef::ConfigRef(Config* config) : _config(config) {
+	if (_config)
+		_config->_refs++;
+}
+
+ConfigRef::ConfigRef(const ConfigRef& other) : _config(other._config) {
+	if (_config)
+		_config->_refs++;
+}
+
+ConfigRef& ConfigRef::operator=(const ConfigRef& other) {
+	if (other._config)
+		other._config->_refs++;
+	release();
+	_config = other._config;
+	return *this;
+}
+
+ConfigRef::~ConfigRef() {
+	release();
+}
+
+void ConfigRef::reset() {
+	release();
+	_config = NULL;
+}
+
+void ConfigRef::release() {
+	if (_config && --_config->_refs == 0)
+		delete _config;
+}
@@ -22,6 +22,15 @@ bool Config::isServerEnd(const std::string& line) {
 	return trim(line) == "}";
 }
 
+bool Config::isUpstreamStart(const std::string& line) {
+	std::string trimmed = trim(line);
+	return trimmed.find("upstream ") == 0 && trimmed[trimmed.length() - 1] == '{';
+}
+
+bool Config::isTypesStart(const std::string& line) {
+	return trim(line) == "types {";
+}
+
 bool Config::isLocationStart(const std::string& line) {
 	std::string trimmed = trim(line);
 	return trimmed.find("location") == 0 && trimmed.find("{") != std::string::npos;
@@ -71,6 +80,8 @@ bool Config::handleDirective(bool in_server_block, const std::string& line, Serv
 	}
 	
 	if (!in_server_block) {
+		if (parseTopLevelDirective(line))
+			return true;
 		LOG_ERROR("directive outside server block (line " + int_to_string(line_number) + ")");
 		return false;
 	}
@@ -78,6 +89,39 @@ bool Config::handleDirective(bool in_server_block, const std::string& line, Serv
 	return true;
 }
 
+// error_log <path>; mime_types <path>; default_type <type>; and
+// log_format <name> <format>; the format runs to the end of the line and
+// may be quoted
+bool Config::parseTopLevelDirective(const std::string& line) {
+	std::vector<std::string> tokens = splitLine(line);
+	if (tokens.size() == 2 && tokens[0] == "error_log") {
+		_error_log = tokens[1];
+		return true;
+	}
+	if (tokens.size() == 2 && tokens[0] == "mime_types") {
+		std::string error;
+		if (!_mime_types.loadFile(tokens[1], error)) {
+			LOG_ERROR(error);
+			return false;
+		}
+		return true;
+	}
+	if (tokens.size() == 2 && tokens[0] == "default_type") {
+		_mime_types.setDefaultType(tokens[1]);
+		return true;
+	}
+	if (tokens.size() < 3 || tokens[0] != "log_format")
+		return false;
+	std::string format = trim(line);
+	format = trim(format.substr(format.find(tokens[1], tokens[0].length()) + tokens[1].length()));
+	if (!format.empty() && format[format.length() - 1] == ';')
+		format = trim(format.substr(0, format.length() - 1));
+	if (format.length() >= 2 && (format[0] == '\'' || format[0] == '"') && format[format.length() - 1] == format[0])
+		format = format.substr(1, format.length() - 2);
+	_log_formats[tokens[1]] = format;
+	return true;
+}
+
 bool Config::finalizeConfig(bool in_server_block) {
 	if (in_server_block) {
 		LOG_ERROR("unclosed server block");
@@ -89,7 +133,12 @@ bool Config::finalizeConfig(bool in_server_block) {
 		setDefaultConfig();
 	}
 		
-	return validateConfig(); // validation better now than just returning true
+	if (!validateConfig()) // validation better now than just returning true
+		return false;
+	if (!buildAccessLogs())
+		return false;
+	buildRoutes();
+	return true;
 }
 
 bool Config::handleServerStart(bool& in_server_block, ServerConfig& current_server,
@@ -0,0 +1,534 @@
+#include "FastCgi.hpp"
+#include "WebServer.hpp"
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+
+static const unsigned char FCGI_VERSION_1 = 1;
+static const unsigned char FCGI_RESPONDER = 1;
+static const unsigned char FCGI_KEEP_CONN = 1;
+static const size_t FCGI_HEADER_LEN = 8;
+static const size_t FCGI_MAX_CONTENT = 65535;
+
+FastCgiClient::FastCgiClient(WebServer* web_server) : _web_server(web_server) {
+}
+
+FastCgiClient::~FastCgiClient() {
+	shutdown();
+}
+
+BufferChain FastCgiClient::handleRequest(const std::string& address, int client_fd, const std::string& version,
+										 const std::vector<std::string>& env, const std::string& body) {
+	FastCgiConnection* conn = acquireConnection(address);
+	if (!conn) {
+		LOG_ERROR("fastcgi: cannot connect to " + address);
+		return _web_server->generateErrorResponse(502, "Bad Gateway");
+	}
+
+	FastCgiRequest* request = new FastCgiRequest();
+	request->client_fd = client_fd;
+	request->output.setClientVersion(version);
+	request->last_activity = time(NULL);
+	request->id = conn->next_id++;
+	if (conn->next_id == 0)
+		conn->next_id = 1;
+	request->records = encodeRequest(request->id, env, body);
+	startRequest(conn, request);
+
+	LOG_DEBUG("fastcgi request " + size_t_to_string(request->id) + " for client "
+			+ size_t_to_string(client_fd) + " sent to " + address);
+	return BufferChain();
+}
+
+void FastCgiClient::startRequest(FastCgiConnection* conn, FastCgiRequest* request) {
+	conn->requests[request->id] = request;
+	conn->write_buffer += request->records;
+	if (request->client_fd != -1)
+		_client_connections[request->client_fd] = conn;
+}
+
+// an idle pooled connection first, then a multiplexing one with room, then a new one
+FastCgiConnection* FastCgiClient::acquireConnection(const std::string& address) {
+	std::vector<FastCgiConnection*>& pool = _pools[address];
+
+	for (size_t i = 0; i < pool.size(); ++i) {
+		if (pool[i]->requests.empty()) {
+			pool[i]->reused = true;
+			return pool[i];
+		}
+	}
+	for (size_t i = 0; i < pool.size(); ++i) {
+		if (pool[i]->mpxs && pool[i]->requests.size() < MAX_REQUESTS_PER_CONNECTION)
+			return pool[i];
+	}
+	return openConnection(address);
+}
+
+FastCgiConnection* FastCgiClient::openConnection(const std::string& address) {
+	int fd = connectSocket(address);
+	if (fd == -1)
+		return NULL;
+
+	FastCgiConnection* conn = new FastCgiConnection();
+	conn->fd = fd;
+	conn->address = address;
+	conn->connected = false;
+
+	// ask whether the backend multiplexes, the answer arrives before any response
+	std::string values;
+	appendNameValue(values, "FCGI_MPXS_CONNS", "");
+	appendRecord(conn->write_buffer, FCGI_GET_VALUES, 0, values.c_str(), values.length());
+
+	_pools[address].push_back(conn);
+	_connections[fd] = conn;
+	_web_server->addPollFd(fd);
+	LOG_DEBUG("fastcgi: new connection " + size_t_to_string(fd) + " to " + address);
+	return conn;
+}
+
+// "unix:/path/to.sock" or "host:port"
+int FastCgiClient::connectSocket(const std::string& address) const {
+	int fd;
+	int result;
+
+	if (address.find("unix:") == 0) {
+		struct sockaddr_un addr;
+		std::string path = address.substr(5);
+		if (path.length() >= sizeof(addr.sun_path))
+			return -1;
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1)
+			return -1;
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strcpy(addr.sun_path, path.c_str());
+		result = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+	} else {
+		size_t colon = address.rfind(':');
+		if (colon == std::string::npos)
+			return -1;
+		std::string host = address.substr(0, colon);
+		if (host == "localhost")
+			host = "127.0.0.1";
+		int port = std::atoi(address.substr(colon + 1).c_str());
+		if (port <= 0 || port > 65535)
+			return -1;
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1)
+			return -1;
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		struct sockaddr_in addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = inet_addr(host.c_str());
+		result = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+	}
+	if (result == -1 && errno != EINPROGRESS && errno != EAGAIN) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void FastCgiClient::appendRecord(std::string& out, unsigned char type, unsigned short id,
+								 const char* data, size_t len) {
+	unsigned char padding = (8 - (len % 8)) % 8;
+	char header[FCGI_HEADER_LEN];
+	header[0] = FCGI_VERSION_1;
+	header[1] = type;
+	header[2] = (id >> 8) & 0xff;
+	header[3] = id & 0xff;
+	header[4] = (len >> 8) & 0xff;
+	header[5] = len & 0xff;
+	header[6] = padding;
+	header[7] = 0;
+	out.append(header, FCGI_HEADER_LEN);
+	out.append(data, len);
+	out.append(padding, '\0');
+}
+
+static void appendLength(std::string& out, size_t len) {
+	if (len < 128) {
+		out += static_cast<char>(len);
+		return;
+	}
+	out += static_cast<char>(((len >> 24) & 0x7f) | 0x80);
+	out += static_cast<char>((len >> 16) & 0xff);
+	out += static_cast<char>((len >> 8) & 0xff);
+	out += static_cast<char>(len & 0xff);
+}
+
+void FastCgiClient::appendNameValue(std::string& out, const std::string& name, const std::string& value) {
+	appendLength(out, name.length());
+	appendLength(out, value.length());
+	out += name;
+	out += value;
+}
+
+// BEGIN_REQUEST, PARAMS built from the cgi environment, STDIN with the body;
+// each stream ends with an empty record
+std::string FastCgiClient::encodeRequest(unsigned short id, const std::vector<std::string>& env,
+										 const std::string& body) const {
+	std::string out;
+	char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+	appendRecord(out, FCGI_BEGIN_REQUEST, id, begin, sizeof(begin));
+
+	std::string params;
+	for (size_t i = 0; i < env.size(); ++i) {
+		size_t eq = env[i].find('=');
+		if (eq == std::string::npos)
+			continue;
+		appendNameValue(params, env[i].substr(0, eq), env[i].substr(eq + 1));
+	}
+	for (size_t pos = 0; pos < params.length(); pos += FCGI_MAX_CONTENT)
+		appendRecord(out, FCGI_PARAMS, id, params.c_str() + pos,
+					 std::min(FCGI_MAX_CONTENT, params.length() - pos));
+	appendRecord(out, FCGI_PARAMS, id, "", 0);
+
+	for (size_t pos = 0; pos < body.length(); pos += FCGI_MAX_CONTENT)
+		appendRecord(out, FCGI_STDIN, id, body.c_str() + pos,
+					 std::min(FCGI_MAX_CONTENT, body.length() - pos));
+	appendRecord(out, FCGI_STDIN, id, "", 0);
+	return out;
+}
+
+bool FastCgiClient::isFastCgiFd(int fd) const {
+	return _connections.find(fd) != _connections.end();
+}
+
+bool FastCgiClient::hasPendingResponse(int client_fd) const {
+	return _client_connections.find(client_fd) != _client_connections.end();
+}
+
+short FastCgiClient::getPollEvents(int fd) const {
+	std::map<int, FastCgiConnection*>::const_iterator it = _connections.find(fd);
+	if (it == _connections.end())
+		return 0;
+	const FastCgiConnection* conn = it->second;
+	if (!conn->connected)
+		return POLLIN | POLLOUT;
+
+	short events = conn->write_buffer.empty() ? 0 : POLLOUT;
+	// let the clients drain what they already have before reading more; on a
+	// multiplexed connection the slowest one holds the others back
+	if (!clientsBehind(conn))
+		events |= POLLIN;
+	return events;
+}
+
+bool FastCgiClient::clientsBehind(const FastCgiConnection* conn) const {
+	for (std::map<unsigned short, FastCgiRequest*>::const_iterator r = conn->requests.begin();
+		 r != conn->requests.end(); ++r) {
+		if (r->second->client_fd != -1 && _web_server->isClientBehind(r->second->client_fd))
+			return true;
+	}
+	return false;
+}
+
+void FastCgiClient::handleEvent(int fd, short revents) {
+	std::map<int, FastCgiConnection*>::iterator it = _connections.find(fd);
+	if (it == _connections.end())
+		return;
+	FastCgiConnection* conn = it->second;
+
+	if (!conn->connected) {
+		handleConnect(conn);
+		if (!isFastCgiFd(fd))
+			return;
+	}
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		handleRead(conn);
+		if (!isFastCgiFd(fd))
+			return;
+	}
+	if ((revents & POLLOUT) && conn->connected)
+		handleWrite(conn);
+}
+
+void FastCgiClient::handleConnect(FastCgiConnection* conn) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+		LOG_ERROR("fastcgi: connect to " + conn->address + " failed");
+		closeConnection(conn, false);
+		return;
+	}
+	conn->connected = true;
+}
+
+void FastCgiClient::handleRead(FastCgiConnection* conn) {
+	char buffer[65536];
+	ssize_t bytes_read = recv(conn->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+	if (bytes_read <= 0) {
+		LOG_DEBUG("fastcgi: backend closed connection " + size_t_to_string(conn->fd));
+		closeConnection(conn, true);
+		return;
+	}
+	conn->read_buffer.append(buffer, bytes_read);
+	processRecords(conn);
+}
+
+void FastCgiClient::handleWrite(FastCgiConnection* conn) {
+	if (conn->write_buffer.empty())
+		return;
+	ssize_t sent = send(conn->fd, conn->write_buffer.c_str(), conn->write_buffer.length(),
+						MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent <= 0) {
+		closeConnection(conn, true);
+		return;
+	}
+	conn->write_buffer.erase(0, sent);
+}
+
+void FastCgiClient::processRecords(FastCgiConnection* conn) {
+	const std::string& buffer = conn->read_buffer;
+	size_t pos = 0;
+
+	while (buffer.length() - pos >= FCGI_HEADER_LEN) {
+		const unsigned char* header = reinterpret_cast<const unsigned char*>(buffer.c_str() + pos);
+		unsigned char type = header[1];
+		unsigned short id = (header[2] << 8) | header[3];
+		size_t content_len = (header[4] << 8) | header[5];
+		size_t total = FCGI_HEADER_LEN + content_len + header[6];
+		if (buffer.length() - pos < total)
+			break;
+		std::string content = buffer.substr(pos + FCGI_HEADER_LEN, content_len);
+		pos += total;
+		if (!handleRecord(conn, type, id, content))
+			return;	// closed as a surplus idle connection, conn is gone
+	}
+	conn->read_buffer.erase(0, pos);
+}
+
+// false once the connection has been closed and freed
+bool FastCgiClient::handleRecord(FastCgiConnection* conn, unsigned char type, unsigned short id,
+								 const std::string& content) {
+	if (id == 0) {
+		if (type == FCGI_GET_VALUES_RESULT)
+			handleValuesResult(conn, content);
+		return true;
+	}
+	std::map<unsigned short, FastCgiRequest*>::iterator it = conn->requests.find(id);
+	if (it == conn->requests.end())
+		return true;
+	FastCgiRequest* request = it->second;
+	request->received = true;
+	if (request->client_fd != -1)	// an aborted request waits for its END_REQUEST
+		request->last_activity = time(NULL);
+
+	if (type == FCGI_STDOUT) {
+		if (request->client_fd != -1)
+			_web_server->queueResponseData(request->client_fd,
+					request->output.feed(content.c_str(), content.length()));
+	} else if (type == FCGI_STDERR) {
+		if (!content.empty())
+			LOG_ERROR("fastcgi stderr: " + content);
+	} else if (type == FCGI_END_REQUEST)
+		return completeRequest(conn, request);
+	return true;
+}
+
+void FastCgiClient::handleValuesResult(FastCgiConnection* conn, const std::string& content) {
+	size_t pos = 0;
+	while (pos < content.length()) {
+		size_t lengths[2];
+		for (int i = 0; i < 2; ++i) {
+			if (pos >= content.length())
+				return;
+			unsigned char b = content[pos];
+			if (b & 0x80) {
+				if (pos + 4 > content.length())
+					return;
+				lengths[i] = ((b & 0x7f) << 24) | ((unsigned char)content[pos + 1] << 16)
+					| ((unsigned char)content[pos + 2] << 8) | (unsigned char)content[pos + 3];
+				pos += 4;
+			} else {
+				lengths[i] = b;
+				pos += 1;
+			}
+		}
+		if (pos + lengths[0] + lengths[1] > content.length())
+			return;
+		std::string name = content.substr(pos, lengths[0]);
+		std::string value = content.substr(pos + lengths[0], lengths[1]);
+		pos += lengths[0] + lengths[1];
+		if (name == "FCGI_MPXS_CONNS" && value == "1") {
+			conn->mpxs = true;
+			LOG_DEBUG("fastcgi: " + conn->address + " multiplexes connections");
+		}
+	}
+}
+
+bool FastCgiClient::completeRequest(FastCgiConnection* conn, FastCgiRequest* request) {
+	if (request->client_fd != -1) {
+		if (!request->output.hasOutput())
+			failRequest(request, 502, "Bad Gateway");
+		else {
+			_web_server->queueResponseData(request->client_fd, request->output.finish());
+			_web_server->finishStreamedResponse(request->client_fd);
+		}
+		_client_connections.erase(request->client_fd);
+	}
+	conn->requests.erase(request->id);
+	delete request;
+	return releaseIfIdle(conn);
+}
+
+// headers not sent yet: a proper error page. otherwise the response is cut
+// off, which the client sees as a missing final chunk
+void FastCgiClient::failRequest(FastCgiRequest* request, int status_code, const std::string& status_text) {
+	if (request->client_fd == -1)
+		return;
+	if (!request->output.headersDone())
+		_web_server->queueCgiResponse(request->client_fd,
+				_web_server->generateErrorResponse(status_code, status_text));
+	_web_server->finishStreamedResponse(request->client_fd);
+}
+
+// false when conn was one idle connection too many and is closed
+bool FastCgiClient::releaseIfIdle(FastCgiConnection* conn) {
+	if (!conn->requests.empty())
+		return true;
+	conn->idle_since = time(NULL);
+
+	std::vector<FastCgiConnection*>& pool = _pools[conn->address];
+	size_t idle = 0;
+	for (size_t i = 0; i < pool.size(); ++i) {
+		if (pool[i]->requests.empty())
+			++idle;
+	}
+	if (idle <= MAX_IDLE_CONNECTIONS)
+		return true;
+	closeConnection(conn, false);
+	return false;
+}
+
+static void setRecordIds(std::string& records, unsigned short id) {
+	size_t pos = 0;
+	while (pos + FCGI_HEADER_LEN <= records.length()) {
+		records[pos + 2] = (id >> 8) & 0xff;
+		records[pos + 3] = id & 0xff;
+		size_t content_len = ((unsigned char)records[pos + 4] << 8) | (unsigned char)records[pos + 5];
+		pos += FCGI_HEADER_LEN + content_len + (unsigned char)records[pos + 6];
+	}
+}
+
+// a pooled connection the backend already closed fails before anything comes
+// back; those requests are sent once more on a fresh connection
+void FastCgiClient::closeConnection(FastCgiConnection* conn, bool retry) {
+	std::vector<FastCgiConnection*>& pool = _pools[conn->address];
+	for (size_t i = 0; i < pool.size(); ++i) {
+		if (pool[i] == conn) {
+			pool.erase(pool.begin() + i);
+			break;
+		}
+	}
+	_connections.erase(conn->fd);
+	_web_server->removePollFd(conn->fd);
+	close(conn->fd);
+
+	for (std::map<unsigned short, FastCgiRequest*>::iterator it = conn->requests.begin();
+		 it != conn->requests.end(); ++it) {
+		FastCgiRequest* request = it->second;
+		if (request->client_fd != -1)
+			_client_connections.erase(request->client_fd);
+
+		if (retry && conn->reused && !request->received && request->client_fd != -1) {
+			FastCgiConnection* fresh = openConnection(conn->address);
+			if (fresh) {
+				request->id = fresh->next_id++;
+				setRecordIds(request->records, request->id);
+				startRequest(fresh, request);
+				continue;
+			}
+		}
+		failRequest(request, 502, "Bad Gateway");
+		delete request;
+	}
+	delete conn;
+}
+
+// a request without records for REQUEST_TIMEOUT gets a 504 and is aborted
+// on its own, other requests multiplexed on the connection carry on. one
+// held back for a slow client is not quiet, the client's own timeout covers it
+void FastCgiClient::checkTimeouts() {
+	time_t now = time(NULL);
+	std::vector<FastCgiConnection*> expired;
+
+	for (std::map<int, FastCgiConnection*>::iterator it = _connections.begin();
+		 it != _connections.end(); ++it) {
+		FastCgiConnection* conn = it->second;
+		if (conn->requests.empty()) {
+			if (now - conn->idle_since > IDLE_TIMEOUT)
+				expired.push_back(conn);
+			continue;
+		}
+		bool abandoned = true;
+		for (std::map<unsigned short, FastCgiRequest*>::iterator r = conn->requests.begin();
+			 r != conn->requests.end(); ++r) {
+			FastCgiRequest* request = r->second;
+			if (request->client_fd != -1 && _web_server->isClientBehind(request->client_fd))
+				request->last_activity = now;
+			if (now - request->last_activity <= REQUEST_TIMEOUT)
+				abandoned = false;
+			else if (request->client_fd != -1) {
+				LOG_ERROR("fastcgi: request timed out on " + conn->address);
+				failRequest(request, 504, "Gateway Timeout");
+				abortRequest(conn, request);
+				abandoned = false;
+			}
+		}
+		// nothing but aborts the backend never confirmed, nobody waits on it
+		if (abandoned)
+			expired.push_back(conn);
+	}
+	for (size_t i = 0; i < expired.size(); ++i)
+		closeConnection(expired[i], false);
+}
+
+// the backend is told to stop; the connection stays busy until it confirms
+// with END_REQUEST, output for the request is dropped meanwhile
+void FastCgiClient::abortRequest(FastCgiConnection* conn, FastCgiRequest* request) {
+	if (request->client_fd != -1)
+		_client_connections.erase(request->client_fd);
+	request->client_fd = -1;
+	request->last_activity = time(NULL);
+	appendRecord(conn->write_buffer, FCGI_ABORT_REQUEST, request->id, "", 0);
+}
+
+void FastCgiClient::abortClient(int client_fd) {
+	std::map<int, FastCgiConnection*>::iterator it = _client_connections.find(client_fd);
+	if (it == _client_connections.end())
+		return;
+	FastCgiConnection* conn = it->second;
+
+	for (std::map<unsigned short, FastCgiRequest*>::iterator r = conn->requests.begin();
+		 r != conn->requests.end(); ++r) {
+		if (r->second->client_fd == client_fd) {
+			abortRequest(conn, r->second);
+			return;
+		}
+	}
+	_client_connections.erase(it);
+}
+
+void FastCgiClient::shutdown() {
+	for (std::map<int, FastCgiConnection*>::iterator it = _connections.begin();
+		 it != _connections.end(); ++it) {
+		FastCgiConnection* conn = it->second;
+		_web_server->removePollFd(conn->fd);
+		close(conn->fd);
+		for (std::map<unsigned short, FastCgiRequest*>::iterator r = conn->requests.begin();
+			 r != conn->requests.end(); ++r)
+			delete r->second;
+		delete conn;
+	}
+	_connections.clear();
+	_pools.clear();
+	_client_connections.clear();
+}
@@ -0,0 +1,786 @@
+#include "HttpProxy.hpp"
+#include "WebServer.hpp"
+#include "Config.hpp"
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+enum ChunkState {
+	CHUNK_SIZE,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER
+};
+
+static const size_t MAX_HEAD_SIZE = 65536;
+static const int RING_POINTS = 160;		// per unit of weight
+
+HttpProxy::HttpProxy(WebServer* web_server) : _web_server(web_server) {
+	_splice_pipe[0] = -1;
+	_splice_pipe[1] = -1;
+#ifdef __linux__
+	if (pipe(_splice_pipe) == 0) {
+		for (int i = 0; i < 2; ++i) {
+			fcntl(_splice_pipe[i], F_SETFL, O_NONBLOCK);
+			fcntl(_splice_pipe[i], F_SETFD, FD_CLOEXEC);
+		}
+	}
+#endif
+}
+
+HttpProxy::~HttpProxy() {
+	shutdown();
+	for (std::map<std::string, Upstream*>::iterator it = _upstreams.begin(); it != _upstreams.end(); ++it)
+		delete it->second;
+	for (size_t i = 0; i < _retired_upstreams.size(); ++i)
+		delete _retired_upstreams[i];
+	if (_splice_pipe[0] != -1) {
+		close(_splice_pipe[0]);
+		close(_splice_pipe[1]);
+	}
+}
+
+static std::string toLower(const std::string& str) {
+	std::string lower = str;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	return lower;
+}
+
+// fnv-1a, only has to spread keys over the ring
+static unsigned int hashString(const std::string& str) {
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < str.length(); ++i) {
+		hash ^= static_cast<unsigned char>(str[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// $request_uri, or $http_<name> for a request header (dashes written as underscores)
+static std::string hashKeyFor(const HttpRequest& request, const std::string& key) {
+	if (key == "$request_uri")
+		return request.getUri();
+	if (key.find("$http_") != 0)
+		return key;
+	std::string wanted = key.substr(6);
+	const std::vector<HeaderField>& headers = request.getHeaders();
+	for (std::vector<HeaderField>::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+		std::string name = toLower(it->name);
+		std::replace(name.begin(), name.end(), '-', '_');
+		if (name == wanted)
+			return std::string(it->value, it->value_length);
+	}
+	return "";
+}
+
+BufferChain HttpProxy::handleRequest(const HttpRequest& request, const std::string& target,
+									 const UpstreamConfig* config) {
+	Upstream* upstream = getUpstream(target, config);
+
+	ProxyRequest* proxied = new ProxyRequest();
+	proxied->client_fd = request.getClientFd();
+	proxied->upstream = upstream;
+	proxied->data = encodeRequest(request);
+	proxied->retryable = request.getMethod() != POST;
+	if (upstream->balance == "hash")
+		proxied->hash_key = hashKeyFor(request, upstream->hash_key);
+	proxied->last_activity = time(NULL);
+
+	if (!dispatch(proxied)) {
+		LOG_ERROR("proxy: no live upstream for " + target);
+		delete proxied;
+		return _web_server->generateErrorResponse(502, "Bad Gateway");
+	}
+	return BufferChain();
+}
+
+Upstream* HttpProxy::getUpstream(const std::string& target, const UpstreamConfig* config) {
+	std::map<std::string, Upstream*>::iterator it = _upstreams.find(target);
+	if (it != _upstreams.end())
+		return it->second;
+
+	Upstream* upstream = new Upstream();
+	upstream->name = target;
+	if (config) {
+		upstream->balance = config->balance;
+		upstream->hash_key = config->hash_key;
+		upstream->keepalive = config->keepalive;
+		for (size_t i = 0; i < config->servers.size(); ++i) {
+			UpstreamPeer peer;
+			peer.address = config->servers[i].address;
+			peer.weight = config->servers[i].weight;
+			peer.max_fails = config->servers[i].max_fails;
+			peer.fail_timeout = config->servers[i].fail_timeout;
+			upstream->peers.push_back(peer);
+		}
+	} else { // proxy_pass straight to host:port
+		UpstreamPeer peer;
+		peer.address = target;
+		upstream->balance = "round_robin";
+		upstream->peers.push_back(peer);
+	}
+	if (upstream->balance == "hash")
+		buildRing(upstream);
+	_upstreams[target] = upstream;
+	return upstream;
+}
+
+// consistent hashing: a peer owns the arcs before its points, so adding or
+// losing one only moves the keys on its own arcs
+void HttpProxy::buildRing(Upstream* upstream) {
+	for (size_t i = 0; i < upstream->peers.size(); ++i) {
+		int points = RING_POINTS * upstream->peers[i].weight;
+		for (int p = 0; p < points; ++p)
+			upstream->ring.push_back(std::make_pair(
+				hashString(upstream->peers[i].address + "#" + size_t_to_string(p)), i));
+	}
+	std::sort(upstream->ring.begin(), upstream->ring.end());
+}
+
+bool HttpProxy::isPeerUp(const UpstreamPeer& peer, time_t now) const {
+	return peer.max_fails == 0 || now >= peer.down_until;
+}
+
+int HttpProxy::selectPeer(ProxyRequest* request) {
+	Upstream* upstream = request->upstream;
+	std::vector<UpstreamPeer>& peers = upstream->peers;
+	time_t now = time(NULL);
+
+	if (upstream->balance == "hash") {
+		std::vector<std::pair<unsigned int, size_t> >& ring = upstream->ring;
+		size_t start = std::lower_bound(ring.begin(), ring.end(),
+				std::make_pair(hashString(request->hash_key), static_cast<size_t>(0))) - ring.begin();
+		for (size_t n = 0; n < ring.size(); ++n) {
+			size_t peer = ring[(start + n) % ring.size()].second;
+			if (!request->tried.count(peer) && isPeerUp(peers[peer], now))
+				return peer;
+		}
+		return -1;
+	}
+
+	std::vector<size_t> candidates;
+	for (size_t i = 0; i < peers.size(); ++i) {
+		if (!request->tried.count(i) && isPeerUp(peers[i], now))
+			candidates.push_back(i);
+	}
+	if (candidates.empty())
+		return -1;
+	if (upstream->balance == "least_conn") { // keep the least loaded ones, weighted
+		std::vector<size_t> least;
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			const UpstreamPeer& peer = peers[candidates[i]];
+			if (!least.empty()) {
+				const UpstreamPeer& best = peers[least[0]];
+				if (peer.active * best.weight > best.active * peer.weight)
+					continue;
+				if (peer.active * best.weight < best.active * peer.weight)
+					least.clear();
+			}
+			least.push_back(candidates[i]);
+		}
+		candidates.swap(least);
+	}
+
+	// smooth weighted round robin among what is left
+	int total = 0;
+	int best = -1;
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		UpstreamPeer& peer = peers[candidates[i]];
+		peer.current_weight += peer.weight;
+		total += peer.weight;
+		if (best == -1 || peer.current_weight > peers[best].current_weight)
+			best = candidates[i];
+	}
+	peers[best].current_weight -= total;
+	return best;
+}
+
+// a lone peer is never taken out, there would be nothing left to try
+void HttpProxy::markFailed(Upstream* upstream, size_t peer_index) {
+	UpstreamPeer& peer = upstream->peers[peer_index];
+	if (peer.max_fails == 0 || upstream->peers.size() == 1)
+		return;
+	time_t now = time(NULL);
+	if (now - peer.first_fail >= peer.fail_timeout) {
+		peer.fails = 0;
+		peer.first_fail = now;
+	}
+	if (++peer.fails >= peer.max_fails) {
+		peer.down_until = now + peer.fail_timeout;
+		peer.fails = 0;
+		LOG_ERROR("proxy: " + peer.address + " marked down for "
+				+ size_t_to_string(peer.fail_timeout) + "s");
+	}
+}
+
+void HttpProxy::markSucceeded(Upstream* upstream, size_t peer_index) {
+	upstream->peers[peer_index].fails = 0;
+}
+
+// a kept alive connection to the peer first, a new one otherwise
+ProxyConnection* HttpProxy::acquireConnection(Upstream* upstream, size_t peer_index) {
+	UpstreamPeer& peer = upstream->peers[peer_index];
+	if (!peer.idle.empty()) {
+		ProxyConnection* conn = peer.idle.back();
+		peer.idle.pop_back();
+		conn->reused = true;
+		return conn;
+	}
+
+	int fd = connectSocket(peer.address);
+	if (fd == -1)
+		return NULL;
+	ProxyConnection* conn = new ProxyConnection();
+	conn->fd = fd;
+	conn->upstream = upstream;
+	conn->peer = peer_index;
+	_connections[fd] = conn;
+	_web_server->addPollFd(fd);
+	LOG_DEBUG("proxy: new connection " + size_t_to_string(fd) + " to " + peer.address);
+	return conn;
+}
+
+int HttpProxy::connectSocket(const std::string& address) const {
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		return -1;
+	std::string host = address.substr(0, colon);
+	if (host == "localhost")
+		host = "127.0.0.1";
+	int port = std::atoi(address.substr(colon + 1).c_str());
+	if (port <= 0 || port > 65535)
+		return -1;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(host.c_str());
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// tries peers until one takes the request; false when none is left
+bool HttpProxy::dispatch(ProxyRequest* request) {
+	int peer;
+	while ((peer = selectPeer(request)) != -1) {
+		request->tried.insert(peer);
+		ProxyConnection* conn = acquireConnection(request->upstream, peer);
+		if (!conn) {
+			LOG_ERROR("proxy: cannot connect to " + request->upstream->peers[peer].address);
+			markFailed(request->upstream, peer);
+			continue;
+		}
+		request->bytes_sent = 0;
+		request->last_activity = time(NULL);
+		conn->request = request;
+		request->upstream->peers[peer].active++;
+		if (request->client_fd != -1)
+			_client_connections[request->client_fd] = conn;
+		return true;
+	}
+	return false;
+}
+
+// hop-by-hop headers end here; the connection to the peer is kept alive
+std::string HttpProxy::encodeRequest(const HttpRequest& request) const {
+	std::string out = request.methodToString() + " " + request.getUri() + " HTTP/1.1\r\n";
+	const std::vector<HeaderField>& headers = request.getHeaders();
+	for (std::vector<HeaderField>::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+		std::string name = toLower(it->name);
+		if (name == "connection" || name == "keep-alive" || name == "proxy-connection"
+			|| name == "te" || name == "upgrade" || name == "transfer-encoding"
+			|| name == "content-length" || name == "expect" || name == "x-forwarded-for")
+			continue;
+		out.append(it->name, it->name_length);
+		out += ": ";
+		out.append(it->value, it->value_length);
+		out += "\r\n";
+	}
+	if (request.getHeader("Host").empty())
+		out += "Host: localhost\r\n";
+
+	std::string client = "unknown";
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getpeername(request.getClientFd(), (struct sockaddr*)&addr, &len) == 0)
+		client = inet_ntoa(addr.sin_addr);
+	std::string forwarded = request.getHeader("X-Forwarded-For");
+	out += "X-Forwarded-For: " + (forwarded.empty() ? client : forwarded + ", " + client) + "\r\n";
+
+	// only forward a body the client actually framed
+	bool has_body = request.getMethod() == POST || !request.getHeader("Content-Length").empty()
+		|| !request.getHeader("Transfer-Encoding").empty();
+	if (has_body)
+		out += "Content-Length: " + size_t_to_string(request.getBody().length()) + "\r\n";
+	out += "Connection: keep-alive\r\n\r\n";
+	if (has_body)
+		out += request.getBody();
+	return out;
+}
+
+bool HttpProxy::isProxyFd(int fd) const {
+	return _connections.find(fd) != _connections.end();
+}
+
+bool HttpProxy::hasPendingResponse(int client_fd) const {
+	return _client_connections.find(client_fd) != _client_connections.end();
+}
+
+short HttpProxy::getPollEvents(int fd) const {
+	std::map<int, ProxyConnection*>::const_iterator it = _connections.find(fd);
+	if (it == _connections.end())
+		return 0;
+	const ProxyConnection* conn = it->second;
+	if (!conn->request)
+		return POLLIN; // idle, only to notice the peer closing it
+	if (!conn->connected)
+		return POLLOUT;
+
+	short events = 0;
+	if (conn->request->bytes_sent < conn->request->data.length())
+		events |= POLLOUT;
+	// let the client drain what it already has before reading more
+	if (!_web_server->isClientBehind(conn->request->client_fd))
+		events |= POLLIN;
+	return events;
+}
+
+void HttpProxy::handleEvent(int fd, short revents) {
+	std::map<int, ProxyConnection*>::iterator it = _connections.find(fd);
+	if (it == _connections.end())
+		return;
+	ProxyConnection* conn = it->second;
+
+	if (!conn->request) {
+		LOG_DEBUG("proxy: idle connection " + size_t_to_string(fd) + " closed by peer");
+		closeConnection(conn);
+		return;
+	}
+	if (!conn->connected) {
+		if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+			return;
+		handleConnect(conn);
+		return;
+	}
+	if ((revents & POLLOUT) && !handleWrite(conn))
+		return;
+	if (revents & (POLLIN | POLLHUP | POLLERR))
+		handleRead(conn);
+}
+
+void HttpProxy::handleConnect(ProxyConnection* conn) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+		LOG_ERROR("proxy: connect to " + conn->upstream->peers[conn->peer].address + " failed");
+		failConnection(conn, true, 502, "Bad Gateway");
+		return;
+	}
+	conn->connected = true;
+}
+
+// false once the connection is gone
+bool HttpProxy::handleWrite(ProxyConnection* conn) {
+	ProxyRequest* request = conn->request;
+	if (request->bytes_sent >= request->data.length())
+		return true;
+	ssize_t sent = send(conn->fd, request->data.c_str() + request->bytes_sent,
+						request->data.length() - request->bytes_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent <= 0) {
+		failConnection(conn, true, 502, "Bad Gateway");
+		return false;
+	}
+	request->bytes_sent += sent;
+	request->last_activity = time(NULL);
+	return true;
+}
+
+void HttpProxy::handleRead(ProxyConnection* conn) {
+	ProxyRequest* request = conn->request;
+	if (request->head_done && request->body_mode == PROXY_BODY_LENGTH && _splice_pipe[0] != -1
+		&& _web_server->getPendingOutput(request->client_fd) == 0) {
+		spliceBody(conn);
+		return;
+	}
+
+	char buffer[65536];
+	ssize_t bytes_read = recv(conn->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if (bytes_read <= 0) {
+		if (request->head_done && request->body_mode == PROXY_BODY_UNTIL_CLOSE) {
+			request->keep_alive = false;
+			completeRequest(conn);
+		} else {
+			LOG_DEBUG("proxy: upstream closed connection " + size_t_to_string(conn->fd));
+			failConnection(conn, true, 502, "Bad Gateway");
+		}
+		return;
+	}
+	request->received = true;
+	request->last_activity = time(NULL);
+	if (request->head_done) {
+		processBody(conn, buffer, bytes_read);
+		return;
+	}
+
+	request->head.append(buffer, bytes_read);
+	int result = parseHead(conn);
+	if (result < 0) {
+		LOG_ERROR("proxy: bad response head from " + conn->upstream->peers[conn->peer].address);
+		failConnection(conn, true, 502, "Bad Gateway");
+		return;
+	}
+	if (result == 0)
+		return;
+	std::string rest;
+	rest.swap(request->head);
+	if (request->body_mode == PROXY_BODY_NONE) {
+		if (!rest.empty())
+			request->keep_alive = false;
+		completeRequest(conn);
+	} else
+		processBody(conn, rest.c_str(), rest.length());
+}
+
+// -1 bad head, 0 incomplete, 1 the client got the rewritten head and what
+// followed it is left in request->head
+int HttpProxy::parseHead(ProxyConnection* conn) {
+	ProxyRequest* request = conn->request;
+	size_t head_end = request->head.find("\r\n\r\n");
+	if (head_end == std::string::npos)
+		return request->head.length() > MAX_HEAD_SIZE ? -1 : 0;
+	if (request->head.compare(0, 7, "HTTP/1.") != 0 || head_end < 12)
+		return -1;
+
+	int status = std::atoi(request->head.c_str() + 9);
+	if (status >= 100 && status < 200) { // interim response, the real one follows
+		request->head.erase(0, head_end + 4);
+		return parseHead(conn);
+	}
+	request->keep_alive = request->head.compare(0, 8, "HTTP/1.1") == 0;
+
+	size_t line_end = request->head.find("\r\n");
+	std::string out = "HTTP/1.1" + request->head.substr(8, line_end - 8) + "\r\n";
+	bool chunked = false;
+	bool has_length = false;
+	size_t length = 0;
+	while (line_end < head_end) {
+		size_t start = line_end + 2;
+		line_end = request->head.find("\r\n", start);
+		std::string line = request->head.substr(start, line_end - start);
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+			continue;
+		std::string name = toLower(line.substr(0, colon));
+		std::string value = toLower(line.substr(colon + 1));
+		if (name == "connection") {
+			if (value.find("close") != std::string::npos)
+				request->keep_alive = false;
+			else if (value.find("keep-alive") != std::string::npos)
+				request->keep_alive = true;
+			continue;
+		}
+		if (name == "keep-alive" || name == "proxy-connection")
+			continue;
+		if (name == "transfer-encoding" && value.find("chunked") != std::string::npos)
+			chunked = true;
+		else if (name == "content-length") {
+			has_length = true;
+			length = std::strtoul(value.c_str(), NULL, 10);
+		}
+		out += line + "\r\n";
+	}
+	out += "Connection: close\r\n\r\n";
+
+	if (status == 204 || status == 304)
+		request->body_mode = PROXY_BODY_NONE;
+	else if (chunked) {
+		request->body_mode = PROXY_BODY_CHUNKED;
+		request->chunk_state = CHUNK_SIZE;
+	} else if (has_length) {
+		request->body_mode = length ? PROXY_BODY_LENGTH : PROXY_BODY_NONE;
+		request->remaining = length;
+	} else {
+		request->body_mode = PROXY_BODY_UNTIL_CLOSE;
+		request->keep_alive = false;
+	}
+	request->head_done = true;
+	request->head.erase(0, head_end + 4);
+	_web_server->queueResponseData(request->client_fd, out);
+	return 1;
+}
+
+// passes body bytes on to the client; the request completes with the last one
+void HttpProxy::processBody(ProxyConnection* conn, const char* data, size_t len) {
+	ProxyRequest* request = conn->request;
+	bool done = false;
+	size_t used = consumeBody(request, data, len, done);
+
+	_web_server->queueResponseData(request->client_fd, data, used);
+	if (used < len) // the peer sent more than it announced, don't trust the connection
+		request->keep_alive = false;
+	if (done)
+		completeRequest(conn);
+}
+
+// returns how much of data belongs to the response, done is set at its end
+size_t HttpProxy::consumeBody(ProxyRequest* request, const char* data, size_t len, bool& done) {
+	if (request->body_mode == PROXY_BODY_UNTIL_CLOSE)
+		return len;
+	if (request->body_mode == PROXY_BODY_LENGTH) {
+		size_t used = std::min(len, request->remaining);
+		request->remaining -= used;
+		done = request->remaining == 0;
+		return used;
+	}
+
+	size_t pos = 0;
+	while (pos < len && !done) {
+		if (request->chunk_state == CHUNK_DATA) {
+			size_t used = std::min(len - pos, request->remaining);
+			pos += used;
+			request->remaining -= used;
+			if (request->remaining == 0)
+				request->chunk_state = CHUNK_DATA_END;
+			continue;
+		}
+		// the other states read a line
+		const char* newline = static_cast<const char*>(std::memchr(data + pos, '\n', len - pos));
+		size_t end = newline ? newline - data : len;
+		if (request->chunk_line.length() < MAX_HEAD_SIZE)
+			request->chunk_line.append(data + pos, end - pos);
+		pos = newline ? end + 1 : len;
+		if (!newline)
+			break;
+
+		std::string line;
+		line.swap(request->chunk_line);
+		if (!line.empty() && line[line.length() - 1] == '\r')
+			line.erase(line.length() - 1);
+		if (request->chunk_state == CHUNK_SIZE) {
+			request->remaining = std::strtoul(line.c_str(), NULL, 16);
+			request->chunk_state = request->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+		} else if (request->chunk_state == CHUNK_DATA_END)
+			request->chunk_state = CHUNK_SIZE;
+		else if (line.empty()) // end of the trailer
+			done = true;
+	}
+	return pos;
+}
+
+// identity bodies go socket to socket through a pipe, without a copy through
+// userspace. whatever the client does not take right away is read back and
+// queued like any other response data
+void HttpProxy::spliceBody(ProxyConnection* conn) {
+#ifdef __linux__
+	ProxyRequest* request = conn->request;
+	ssize_t moved = splice(conn->fd, NULL, _splice_pipe[1], NULL,
+			std::min(request->remaining, static_cast<size_t>(65536)), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (moved <= 0) {
+		if (moved == -1 && errno == EINVAL) { // socket type without splice support
+			close(_splice_pipe[0]);
+			close(_splice_pipe[1]);
+			_splice_pipe[0] = -1;
+			_splice_pipe[1] = -1;
+			return;
+		}
+		LOG_DEBUG("proxy: upstream closed connection " + size_t_to_string(conn->fd));
+		failConnection(conn, true, 502, "Bad Gateway");
+		return;
+	}
+	request->received = true;
+	request->last_activity = time(NULL);
+	request->remaining -= moved;
+
+	ssize_t out = splice(_splice_pipe[0], NULL, request->client_fd, NULL, moved,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (out > 0)
+		_web_server->touchClient(request->client_fd, out);
+	size_t left = moved - std::max(out, static_cast<ssize_t>(0));
+	std::string rest;
+	char buffer[65536];
+	while (left > 0) {
+		ssize_t bytes_read = read(_splice_pipe[0], buffer, std::min(left, sizeof(buffer)));
+		if (bytes_read <= 0)
+			break;
+		rest.append(buffer, bytes_read);
+		left -= bytes_read;
+	}
+	_web_server->queueResponseData(request->client_fd, rest);
+	if (request->remaining == 0)
+		completeRequest(conn);
+#else
+	(void)conn;
+#endif
+}
+
+void HttpProxy::completeRequest(ProxyConnection* conn) {
+	ProxyRequest* request = conn->request;
+	markSucceeded(conn->upstream, conn->peer);
+	conn->upstream->peers[conn->peer].active--;
+	conn->request = NULL;
+	if (request->client_fd != -1) {
+		_client_connections.erase(request->client_fd);
+		_web_server->finishStreamedResponse(request->client_fd);
+	}
+	bool reuse = request->keep_alive;
+	delete request;
+	if (reuse)
+		releaseConnection(conn);
+	else
+		closeConnection(conn);
+}
+
+void HttpProxy::releaseConnection(ProxyConnection* conn) {
+	UpstreamPeer& peer = conn->upstream->peers[conn->peer];
+	if (peer.idle.size() >= conn->upstream->keepalive || conn->upstream->retired) {
+		closeConnection(conn);
+		return;
+	}
+	conn->idle_since = time(NULL);
+	peer.idle.push_back(conn);
+}
+
+// the request, if any, is detached but not freed
+void HttpProxy::closeConnection(ProxyConnection* conn) {
+	UpstreamPeer& peer = conn->upstream->peers[conn->peer];
+	std::vector<ProxyConnection*>::iterator idle = std::find(peer.idle.begin(), peer.idle.end(), conn);
+	if (idle != peer.idle.end())
+		peer.idle.erase(idle);
+	if (conn->request) {
+		peer.active--;
+		if (conn->request->client_fd != -1)
+			_client_connections.erase(conn->request->client_fd);
+	}
+	_connections.erase(conn->fd);
+	_web_server->removePollFd(conn->fd);
+	close(conn->fd);
+	delete conn;
+}
+
+// a kept alive connection the peer already closed fails before any answer;
+// that is not the peer's fault and the request goes out again. otherwise the
+// peer gets a strike and the request moves on to the next one, as long as
+// nothing reached the client and sending it twice is harmless
+void HttpProxy::failConnection(ProxyConnection* conn, bool peer_failed, int status_code,
+							   const std::string& status_text) {
+	ProxyRequest* request = conn->request;
+	Upstream* upstream = conn->upstream;
+	size_t peer = conn->peer;
+	bool stale = conn->reused && request && !request->received;
+
+	closeConnection(conn);
+	if (!request)
+		return;
+	if (stale)
+		request->tried.erase(peer);
+	else if (peer_failed)
+		markFailed(upstream, peer);
+
+	if (request->client_fd != -1 && !request->received
+		&& (stale || request->retryable || request->bytes_sent == 0) && dispatch(request))
+		return;
+	if (request->client_fd != -1) {
+		if (!request->head_done)
+			_web_server->queueCgiResponse(request->client_fd,
+					_web_server->generateErrorResponse(status_code, status_text));
+		_web_server->finishStreamedResponse(request->client_fd);
+	}
+	delete request;
+}
+
+void HttpProxy::checkTimeouts() {
+	time_t now = time(NULL);
+	std::vector<ProxyConnection*> idle;
+	std::vector<ProxyConnection*> timed_out;
+
+	for (std::map<int, ProxyConnection*>::iterator it = _connections.begin(); it != _connections.end(); ++it) {
+		ProxyConnection* conn = it->second;
+		if (!conn->request) {
+			if (now - conn->idle_since > IDLE_TIMEOUT)
+				idle.push_back(conn);
+			continue;
+		}
+		// a response held back for a slow client is not a quiet upstream; a
+		// client that stops reading altogether runs into its own timeout
+		if (conn->connected && _web_server->isClientBehind(conn->request->client_fd))
+			conn->request->last_activity = now;
+		if (now - conn->request->last_activity > (conn->connected ? READ_TIMEOUT : CONNECT_TIMEOUT))
+			timed_out.push_back(conn);
+	}
+	for (size_t i = 0; i < idle.size(); ++i)
+		closeConnection(idle[i]);
+	for (size_t i = 0; i < timed_out.size(); ++i) {
+		LOG_ERROR("proxy: " + timed_out[i]->upstream->peers[timed_out[i]->peer].address + " timed out");
+		timed_out[i]->request->received = true; // a slow peer is not retried
+		failConnection(timed_out[i], true, 504, "Gateway Timeout");
+	}
+
+	// requests only live on connections, an upstream nobody is connected to is unused
+	for (size_t i = 0; i < _retired_upstreams.size(); ) {
+		bool used = false;
+		for (std::map<int, ProxyConnection*>::iterator it = _connections.begin();
+			 it != _connections.end() && !used; ++it)
+			used = it->second->upstream == _retired_upstreams[i];
+		if (used) {
+			++i;
+			continue;
+		}
+		delete _retired_upstreams[i];
+		_retired_upstreams.erase(_retired_upstreams.begin() + i);
+	}
+}
+
+// upstream blocks may have changed: later requests build their upstreams
+// from the new config, requests in flight finish on the old peers
+void HttpProxy::reload() {
+	for (std::map<std::string, Upstream*>::iterator it = _upstreams.begin(); it != _upstreams.end(); ++it) {
+		Upstream* upstream = it->second;
+		for (size_t i = 0; i < upstream->peers.size(); ++i) {
+			std::vector<ProxyConnection*> idle = upstream->peers[i].idle;
+			for (size_t j = 0; j < idle.size(); ++j)
+				closeConnection(idle[j]);
+		}
+		upstream->retired = true;
+		_retired_upstreams.push_back(upstream);
+	}
+	_upstreams.clear();
+}
+
+// a half read response can't be reused, the connection goes
+void HttpProxy::abortClient(int client_fd) {
+	std::map<int, ProxyConnection*>::iterator it = _client_connections.find(client_fd);
+	if (it == _client_connections.end())
+		return;
+	ProxyConnection* conn = it->second;
+	ProxyRequest* request = conn->request;
+	LOG_DEBUG("client " + size_t_to_string(client_fd) + " gone, closing its upstream connection");
+	closeConnection(conn);
+	delete request;
+}
+
+void HttpProxy::shutdown() {
+	for (std::map<int, ProxyConnection*>::iterator it = _connections.begin(); it != _connections.end(); ++it) {
+		_web_server->removePollFd(it->first);
+		close(it->first);
+		delete it->second->request;
+		delete it->second;
+	}
+	_connections.clear();
+	_client_connections.clear();
+	for (std::map<std::string, Upstream*>::iterator it = _upstreams.begin(); it != _upstreams.end(); ++it) {
+		for (size_t i = 0; i < it->second->peers.size(); ++i) {
+			it->second->peers[i].idle.clear();
+			it->second->peers[i].active = 0;
+		}
+	}
+}
@@ -2,120 +2,192 @@
 #include "utils.hpp"
 #include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
 
 // HttpRequest::HttpRequest() : _method(UNKNOWN), _is_complete(false), _is_chunked(false), _bytes_remaining(0), _is_multipart(false) {
 // }
 
-HttpRequest::HttpRequest() : _method(UNKNOWN), _is_complete(false), _is_chunked(false), _is_multipart(false) {
+HttpRequest::HttpRequest() : _method(UNKNOWN), _length(0), _is_complete(false), _is_chunked(false), _is_multipart(false),
+    _client_fd(-1), _server_config(NULL), _location_config(NULL), _cgi_interpreter(NULL) {
+}
+
+// copies outlive the connection's request (cgi queue, cache fills), so
+// they get their own arena
+HttpRequest::HttpRequest(const HttpRequest& other) : _method(other._method), _uri(other._uri),
+    _version(other._version), _body(other._body), _length(other._length), _is_complete(other._is_complete),
+    _is_chunked(other._is_chunked), _chunk_buffer(other._chunk_buffer), _form_data(other._form_data),
+    _uploaded_files(other._uploaded_files), _is_multipart(other._is_multipart), _client_fd(other._client_fd),
+    _config(other._config), _server_config(other._server_config), _location_config(other._location_config),
+    _cgi_interpreter(other._cgi_interpreter) {
+    copyHeaders(other);
+}
+
+HttpRequest& HttpRequest::operator=(const HttpRequest& other) {
+    if (this == &other)
+        return *this;
+    _method = other._method;
+    _uri = other._uri;
+    _version = other._version;
+    _body = other._body;
+    _length = other._length;
+    _is_complete = other._is_complete;
+    _is_chunked = other._is_chunked;
+    _chunk_buffer = other._chunk_buffer;
+    _form_data = other._form_data;
+    _uploaded_files = other._uploaded_files;
+    _is_multipart = other._is_multipart;
+    _client_fd = other._client_fd;
+    _config = other._config;
+    _server_config = other._server_config;
+    _location_config = other._location_config;
+    _cgi_interpreter = other._cgi_interpreter;
+    _arena.reset();
+    copyHeaders(other);
+    return *this;
 }
 
 HttpRequest::~HttpRequest() {
 }
 
-bool HttpRequest::parseRequest(const std::string& raw_request) {
-    if (_is_complete)
-        return true;
-    
-    std::istringstream stream(raw_request);
-    std::string line;
+void HttpRequest::copyHeaders(const HttpRequest& other) {
+    _headers.clear();
+    for (size_t i = 0; i < other._headers.size(); ++i) {
+        HeaderField field = other._headers[i];
+        field.name = _arena.copy(field.name, field.name_length);
+        field.value = _arena.copy(field.value, field.value_length);
+        _headers.push_back(field);
+    }
+}
 
-    if (_uri.empty()) {
-        if (!std::getline(stream, line))
-            return false;
-        if (!line.empty() && line[line.length() - 1] == '\r')
-            line.erase(line.length() - 1);
-        
-        std::istringstream request_line(line);
-        std::string method_str;
-        
-        if (!(request_line >> method_str >> _uri >> _version)) {
-            return false;
-        }
-        if (_uri.length() > 2048) {
-            return false;
-        }
-        
-        if (method_str == "GET") {
-            _method = GET;
-        } else if (method_str == "POST") {
-            _method = POST;
-        } else if (method_str == "DELETE") {
-            _method = DELETE;
-        } else {
-            _method = UNKNOWN;
-        }
-        
-        // Parse headers
-        while (std::getline(stream, line) && line != "\r" && !line.empty()) {
-            if (!line.empty() && line[line.length() - 1] == '\r') {
-                line.erase(line.length() - 1);
-            }
-            
-            size_t colon_pos = line.find(':');
-            if (colon_pos != std::string::npos) {
-                std::string key = line.substr(0, colon_pos);
-                std::string value = line.substr(colon_pos + 1);
-                while (!value.empty() && value[0] == ' ') {
-                    value.erase(0, 1);
-                }
-                
-                _headers[key] = value;
-            }
-        }
-        std::string content_type = getHeader("Content-Type");
-        if (content_type.find("multipart/form-data") != std::string::npos){
-            _is_multipart = true;
-            LOG_DEBUG("Detected multipart form data");
-        }
-        
-        std::string transfer_encoding = getHeader("Transfer-Encoding");
-        if (!transfer_encoding.empty()) {
-            std::transform(transfer_encoding.begin(), transfer_encoding.end(), 
-                          transfer_encoding.begin(), ::tolower);
-            if (transfer_encoding.find("chunked") != std::string::npos) {
-                _is_chunked = true;
-                LOG_DEBUG("Detected chunked transfer encoding");
-            }
-        }
+// strings are cleared rather than freed, a keep-alive connection reuses them
+void HttpRequest::reset() {
+    _method = UNKNOWN;
+    _uri.clear();
+    _version.clear();
+    _headers.clear();
+    _arena.reset();
+    _body.clear();
+    _length = 0;
+    _is_complete = false;
+    _is_chunked = false;
+    _chunk_buffer.clear();
+    _form_data.clear();
+    _uploaded_files.clear();
+    _is_multipart = false;
+    _client_fd = -1;
+    _config.reset();
+    _server_config = NULL;
+    _location_config = NULL;
+    _cgi_interpreter = NULL;
+}
+
+static bool containsNoCase(const char* haystack, const char* needle) {
+    size_t length = std::strlen(needle);
+    for (; *haystack; ++haystack) {
+        if (strncasecmp(haystack, needle, length) == 0)
+            return true;
     }
+    return false;
+}
 
-    size_t body_start = raw_request.find("\r\n\r\n");
-    if (body_start == std::string::npos)
-        return false;
-    body_start += 4;
+static bool nextToken(const char* data, size_t& pos, size_t end, std::string& out) {
+    while (pos < end && data[pos] == ' ')
+        ++pos;
+    size_t start = pos;
+    while (pos < end && data[pos] != ' ')
+        ++pos;
+    out.assign(data + start, pos - start);
+    return pos > start;
+}
 
-    if (body_start == std::string::npos)
+// request line and headers are sliced straight out of the buffer into the arena
+bool HttpRequest::parseHead(const std::string& raw_request, size_t head_end) {
+    const char* data = raw_request.data();
+    size_t line_end = raw_request.find("\r\n");
+    size_t pos = 0;
+    std::string method_str;
+    if (!nextToken(data, pos, line_end, method_str) || !nextToken(data, pos, line_end, _uri)
+        || !nextToken(data, pos, line_end, _version) || _uri.length() > 2048) {
+        _uri.clear();
         return false;
-    if (_is_chunked) {
-        std::string body_data = raw_request.substr(body_start);
-        return processChunk(body_data);
+    }
+
+    if (method_str == "GET") {
+        _method = GET;
+    } else if (method_str == "POST") {
+        _method = POST;
+    } else if (method_str == "DELETE") {
+        _method = DELETE;
     } else {
-    std::string content_length_str = getHeader("Content-Length");
-    if (!content_length_str.empty()) {
-        size_t content_length = 0;
-        std::istringstream iss(content_length_str);
-        iss >> content_length;
-        
-        std::string body_data = raw_request.substr(body_start);
-        if (body_data.length() >= content_length) {
-            _body = body_data.substr(0, content_length);
-            _is_complete = true;
-            if (_is_multipart)
-                parseMultipartData();
-            return true;
-        }
+        _method = UNKNOWN;
+    }
+
+    // Parse headers
+    while (line_end < head_end) {
+        size_t start = line_end + 2;
+        line_end = raw_request.find("\r\n", start);
+        const char* colon = static_cast<const char*>(std::memchr(data + start, ':', line_end - start));
+        if (!colon)
+            continue;
+        const char* value = colon + 1;
+        while (value < data + line_end && *value == ' ')
+            ++value;
+        HeaderField field;
+        field.name_length = colon - (data + start);
+        field.value_length = data + line_end - value;
+        field.name = _arena.copy(data + start, field.name_length);
+        field.value = _arena.copy(value, field.value_length);
+        _headers.push_back(field);
+    }
+
+    const HeaderField* content_type = findHeader("Content-Type");
+    if (content_type && containsNoCase(content_type->value, "multipart/form-data")) {
+        _is_multipart = true;
+        LOG_DEBUG("Detected multipart form data");
+    }
+    const HeaderField* transfer_encoding = findHeader("Transfer-Encoding");
+    if (transfer_encoding && containsNoCase(transfer_encoding->value, "chunked")) {
+        _is_chunked = true;
+        LOG_DEBUG("Detected chunked transfer encoding");
+    }
+    return true;
+}
+
+bool HttpRequest::parseRequest(const std::string& raw_request) {
+    if (_is_complete)
+        return true;
+
+    size_t head_end = raw_request.find("\r\n\r\n");
+    if (head_end == std::string::npos)
         return false;
-    } else {
-        if (_method == GET || _method == DELETE || _method == UNKNOWN) {
-            _body = raw_request.substr(0, body_start - 8);
-            _is_complete = true;
-            return true;
-        }
+    if (_uri.empty() && !parseHead(raw_request, head_end))
         return false;
+    size_t body_start = head_end + 4;
+
+    if (_is_chunked)
+        return processChunk(raw_request.substr(body_start));
+
+    const HeaderField* content_length = findHeader("Content-Length");
+    if (content_length) {
+        size_t length = std::strtoul(content_length->value, NULL, 10);
+        if (raw_request.length() - body_start < length)
+            return false;
+        _body.assign(raw_request, body_start, length);
+        _length = body_start + length;
+        _is_complete = true;
+        if (_is_multipart)
+            parseMultipartData();
+        return true;
     }
+    if (_method == POST)
+        return false;
+    _length = body_start;
+    _is_complete = true;
+    return true;
 }
 
-}
 bool HttpRequest::parseMultipartData() {
     std::string content_type = getHeader("Content-Type");
     size_t boundary_pos = content_type.find("boundary=");
@@ -304,14 +376,32 @@ bool HttpRequest::processChunk(const std::string& chunk_data) {
     return true;
 }
 
-std::string HttpRequest::getHeader(const std::string& key) const {
-    std::map<std::string, std::string>::const_iterator it = _headers.find(key);
-    if (it != _headers.end()) {
-        return it->second;
+// names compare case-insensitively, a repeated header answers with the last one
+const HeaderField* HttpRequest::findHeader(const char* key) const {
+    size_t length = std::strlen(key);
+    for (size_t i = _headers.size(); i > 0; --i) {
+        const HeaderField& field = _headers[i - 1];
+        if (field.name_length == length && strncasecmp(field.name, key, length) == 0)
+            return &field;
     }
+    return NULL;
+}
+
+std::string HttpRequest::getHeader(const std::string& key) const {
+    const HeaderField* field = findHeader(key.c_str());
+    if (field)
+        return std::string(field->value, field->value_length);
     return "";
 }
 
+// HTTP/1.1 stays open unless the client says close, 1.0 only if it asks
+bool HttpRequest::wantsKeepAlive() const {
+    const HeaderField* connection = findHeader("Connection");
+    if (_version == "HTTP/1.1")
+        return !connection || !containsNoCase(connection->value, "close");
+    return _version == "HTTP/1.0" && connection && containsNoCase(connection->value, "keep-alive");
+}
+
 std::string HttpRequest::methodToString() const {
     switch (_method) {
         case GET: return "GET";
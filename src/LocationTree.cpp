@@ -0,0 +1,77 @@
+#include "LocationTree.hpp"
+
+LocationTree::LocationTree() {
+	clear();
+}
+
+void LocationTree::clear() {
+	_nodes.clear();
+	_nodes.push_back(LocationTreeNode());
+}
+
+void LocationTree::insert(const std::string& path, int location) {
+	size_t node = 0;
+	size_t pos = 0;
+
+	while (pos < path.length()) {
+		std::map<char, size_t>::iterator edge = _nodes[node].children.find(path[pos]);
+		if (edge == _nodes[node].children.end()) {
+			LocationTreeNode leaf;
+			leaf.label = path.substr(pos);
+			leaf.location = location;
+			_nodes.push_back(leaf);
+			_nodes[node].children[path[pos]] = _nodes.size() - 1;
+			return;
+		}
+
+		size_t child = edge->second;
+		const std::string& label = _nodes[child].label;
+		size_t common = 0;
+		while (common < label.length() && pos + common < path.length()
+			&& label[common] == path[pos + common])
+			++common;
+
+		if (common < label.length()) { // split the edge where the paths part
+			LocationTreeNode middle;
+			middle.label = label.substr(0, common);
+			middle.children[label[common]] = child;
+			_nodes[child].label.erase(0, common);
+			_nodes.push_back(middle); // invalidates edge
+			child = _nodes.size() - 1;
+			_nodes[node].children[path[pos]] = child;
+		}
+		node = child;
+		pos += common;
+	}
+	if (_nodes[node].location == -1)
+		_nodes[node].location = location;
+}
+
+// "/api" covers "/api", "/api/..." and "/api?...", a path ending in '/'
+// covers everything below it
+bool LocationTree::endsSegment(const std::string& uri, size_t pos) {
+	return pos == uri.length() || uri[pos] == '/' || uri[pos] == '?'
+		|| (pos > 0 && uri[pos - 1] == '/');
+}
+
+int LocationTree::match(const std::string& uri) const {
+	size_t node = 0;
+	size_t pos = 0;
+	int best = -1;
+
+	while (true) {
+		if (_nodes[node].location != -1 && endsSegment(uri, pos))
+			best = _nodes[node].location;
+		if (pos >= uri.length())
+			break;
+		std::map<char, size_t>::const_iterator edge = _nodes[node].children.find(uri[pos]);
+		if (edge == _nodes[node].children.end())
+			break;
+		const std::string& label = _nodes[edge->second].label;
+		if (uri.compare(pos, label.length(), label) != 0)
+			break;
+		pos += label.length();
+		node = edge->second;
+	}
+	return best;
+}
@@ -0,0 +1,361 @@
+#include "Logger.hpp"
+#include "utils.hpp"
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+	const size_t RING_SIZE = 256 * 1024;	// power of two
+	const size_t MAX_MESSAGE = 4096;		// longer lines are cut
+	const int FLUSH_INTERVAL_MS = 10;
+
+	struct RecordHead {
+		size_t length;
+		int level;
+		int target;		// access log id, -1 for the error log
+		time_t time;
+	};
+
+	// single producer, the owning thread, and single consumer, the writer.
+	// head and tail only grow, their difference is the bytes in use
+	struct LogRing {
+		char data[RING_SIZE];
+		volatile size_t head;
+		volatile size_t tail;
+		volatile size_t dropped;
+		size_t reported;		// dropped count the writer already logged
+		LogRing* next;
+
+		LogRing() : head(0), tail(0), dropped(0), reported(0), next(NULL) {}
+	};
+
+	struct LogTarget {
+		int out;
+		int err;
+		bool color;
+	};
+
+	__thread LogRing* t_ring = NULL;
+	LogRing* g_rings = NULL;
+	pthread_mutex_t g_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	pthread_t g_writer;
+	volatile bool g_running = false;
+	volatile bool g_stopping = false;
+	volatile sig_atomic_t g_reopen = 0;
+
+	// paths are shared, the files are only touched by the writer once it runs
+	pthread_mutex_t g_path_mutex = PTHREAD_MUTEX_INITIALIZER;
+	std::string g_path;
+	std::vector<std::string> g_access_paths;
+	int g_file = -1;
+	std::vector<int> g_access_files;	// opened on first use, -1 after a reopen
+	time_t g_stamp_time = -1;
+	char g_stamp[16];
+
+	LogRing* registerRing() {
+		LogRing* ring = new LogRing();
+		pthread_mutex_lock(&g_rings_mutex);
+		ring->next = g_rings;
+		g_rings = ring;
+		pthread_mutex_unlock(&g_rings_mutex);
+		t_ring = ring;
+		return ring;
+	}
+
+	void copyIn(LogRing* ring, size_t offset, const void* src, size_t length) {
+		size_t pos = offset & (RING_SIZE - 1);
+		size_t first = length < RING_SIZE - pos ? length : RING_SIZE - pos;
+		std::memcpy(ring->data + pos, src, first);
+		std::memcpy(ring->data, static_cast<const char*>(src) + first, length - first);
+	}
+
+	void copyOut(const LogRing* ring, size_t offset, void* dst, size_t length) {
+		size_t pos = offset & (RING_SIZE - 1);
+		size_t first = length < RING_SIZE - pos ? length : RING_SIZE - pos;
+		std::memcpy(dst, ring->data + pos, first);
+		std::memcpy(static_cast<char*>(dst) + first, ring->data, length - first);
+	}
+
+	void writeAll(int fd, const std::string& data) {
+		size_t sent = 0;
+		while (sent < data.length()) {
+			ssize_t n = ::write(fd, data.data() + sent, data.length() - sent);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return;
+			sent += n;
+		}
+	}
+
+	LogTarget currentTarget() {
+		LogTarget target;
+		target.out = g_file != -1 ? g_file : STDOUT_FILENO;
+		target.err = g_file != -1 ? g_file : STDERR_FILENO;
+		target.color = g_file == -1 && isatty(STDOUT_FILENO);
+		return target;
+	}
+
+	void formatTime(time_t now, char* stamp, size_t size) {
+		struct tm local;
+		localtime_r(&now, &local);
+		strftime(stamp, size, "%H:%M:%S", &local);
+	}
+
+	// the writer formats once a second, not once a line
+	const char* cachedTimestamp(time_t now) {
+		if (now != g_stamp_time) {
+			formatTime(now, g_stamp, sizeof(g_stamp));
+			g_stamp_time = now;
+		}
+		return g_stamp;
+	}
+
+	void format(std::string& out, int level, const char* stamp, const char* message, size_t length, bool color) {
+		out += "[";
+		out += stamp;
+		out += "]:[";
+		if (level == DEBUG_LEVEL)
+			out += color ? "\033[36mDEBUG\033[0m]   " : "DEBUG]   ";
+		else if (level == INFO_LEVEL)
+			out += color ? "\033[32mINFO\033[0m]    " : "INFO]    ";
+		else
+			out += color ? "\033[31mERROR\033[0m]   " : "ERROR]   ";
+		out.append(message, length);
+		out += "\n";
+	}
+
+	void closeAccessFiles() {
+		for (size_t i = 0; i < g_access_files.size(); ++i) {
+			if (g_access_files[i] != -1)
+				close(g_access_files[i]);
+			g_access_files[i] = -1;
+		}
+	}
+
+	void reopenFile() {
+		closeAccessFiles();	// reopened on their next line
+		pthread_mutex_lock(&g_path_mutex);
+		std::string path = g_path;
+		pthread_mutex_unlock(&g_path_mutex);
+		int fd = -1;
+		if (!path.empty()) {
+			fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+			if (fd == -1) {
+				std::string note = "cannot open log file " + path + ": " + strerror(errno);
+				std::string line;
+				format(line, ERROR_LEVEL, cachedTimestamp(time(NULL)), note.data(), note.length(), false);
+				writeAll(STDERR_FILENO, line);
+				return;
+			}
+		}
+		if (g_file != -1)
+			close(g_file);
+		g_file = fd;
+	}
+
+	int accessFile(int log) {
+		if (static_cast<size_t>(log) >= g_access_files.size())
+			g_access_files.resize(log + 1, -1);
+		if (g_access_files[log] != -1)
+			return g_access_files[log];
+		pthread_mutex_lock(&g_path_mutex);
+		std::string path = g_access_paths[log];
+		pthread_mutex_unlock(&g_path_mutex);
+		g_access_files[log] = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		return g_access_files[log];
+	}
+
+	// moves everything queued so far into out/err and the access logs,
+	// one batch per flush
+	void drain(std::string& out, std::string& err, std::vector<std::string>& access, const LogTarget& target) {
+		pthread_mutex_lock(&g_rings_mutex);
+		LogRing* rings = g_rings;
+		pthread_mutex_unlock(&g_rings_mutex);
+
+		std::string message;
+		for (LogRing* ring = rings; ring; ring = ring->next) {
+			size_t tail = ring->tail;
+			size_t head = ring->head;
+			__sync_synchronize();
+			while (tail != head) {
+				RecordHead record;
+				copyOut(ring, tail, &record, sizeof(record));
+				message.resize(record.length);
+				if (record.length)
+					copyOut(ring, tail + sizeof(record), &message[0], record.length);
+				if (record.target >= 0) {
+					if (static_cast<size_t>(record.target) >= access.size())
+						access.resize(record.target + 1);
+					access[record.target] += message;
+					access[record.target] += "\n";
+				} else
+					format(record.level == ERROR_LEVEL ? err : out, record.level, cachedTimestamp(record.time),
+							message.data(), message.length(), target.color);
+				tail += (sizeof(record) + record.length + 7) & ~static_cast<size_t>(7);
+			}
+			__sync_synchronize();
+			ring->tail = tail;
+
+			size_t dropped = ring->dropped;
+			if (dropped != ring->reported) {
+				std::string note = size_t_to_string(dropped - ring->reported) + " log messages dropped, the log ring was full";
+				format(err, ERROR_LEVEL, cachedTimestamp(time(NULL)), note.data(), note.length(), target.color);
+				ring->reported = dropped;
+			}
+		}
+	}
+
+	void* writerMain(void*) {
+		std::string out;
+		std::string err;
+		std::vector<std::string> access;
+		while (true) {
+			bool stopping = g_stopping;
+			__sync_synchronize();
+			if (g_reopen) {
+				g_reopen = 0;
+				reopenFile();
+			}
+			LogTarget target = currentTarget();
+			drain(out, err, access, target);
+			if (!out.empty())
+				writeAll(target.out, out);
+			if (!err.empty())
+				writeAll(target.err, err);
+			for (size_t i = 0; i < access.size(); ++i) {
+				if (!access[i].empty())
+					writeAll(accessFile(i), access[i]);
+				access[i].clear();
+			}
+			out.clear();
+			err.clear();
+			if (stopping)
+				break;
+			poll(NULL, 0, FLUSH_INTERVAL_MS);
+		}
+		return NULL;
+	}
+}
+
+void Logger::start() {
+	if (g_running)
+		return;
+	g_stopping = false;
+	// the writer takes no signals, they stay with the event loop
+	sigset_t all;
+	sigset_t previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	int error = pthread_create(&g_writer, NULL, writerMain, NULL);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (error != 0) {
+		log_error(std::string("cannot start the log writer: ") + strerror(error));
+		return;
+	}
+	__sync_synchronize();
+	g_running = true;
+}
+
+void Logger::stop() {
+	if (!g_running)
+		return;
+	g_running = false;
+	__sync_synchronize();
+	g_stopping = true;
+	pthread_join(g_writer, NULL);
+
+	pthread_mutex_lock(&g_rings_mutex);
+	while (g_rings) {
+		LogRing* next = g_rings->next;
+		delete g_rings;
+		g_rings = next;
+	}
+	pthread_mutex_unlock(&g_rings_mutex);
+	t_ring = NULL;
+	if (g_file != -1)
+		close(g_file);
+	g_file = -1;
+	closeAccessFiles();
+}
+
+void Logger::setFile(const std::string& path) {
+	pthread_mutex_lock(&g_path_mutex);
+	bool changed = path != g_path;
+	g_path = path;
+	pthread_mutex_unlock(&g_path_mutex);
+	if (!changed)
+		return;
+	if (g_running)
+		g_reopen = 1;
+	else
+		reopenFile();
+}
+
+void Logger::requestReopen() {
+	g_reopen = 1;
+}
+
+int Logger::openAccessLog(const std::string& path) {
+	pthread_mutex_lock(&g_path_mutex);
+	size_t log = 0;
+	while (log < g_access_paths.size() && g_access_paths[log] != path)
+		++log;
+	if (log == g_access_paths.size())
+		g_access_paths.push_back(path);
+	pthread_mutex_unlock(&g_path_mutex);
+	return log;
+}
+
+void Logger::writeAccess(int log, const std::string& line) {
+	if (!g_running) {
+		std::string text = line + "\n";
+		writeAll(accessFile(log), text);
+		return;
+	}
+	push(ERROR_LEVEL, log, line);
+}
+
+void Logger::write(int level, const std::string& message) {
+	if (!g_running) {
+		LogTarget target = currentTarget();
+		char stamp[16];
+		formatTime(time(NULL), stamp, sizeof(stamp));
+		std::string line;
+		size_t length = message.length() < MAX_MESSAGE ? message.length() : MAX_MESSAGE;
+		format(line, level, stamp, message.data(), length, target.color);
+		writeAll(level == ERROR_LEVEL ? target.err : target.out, line);
+		return;
+	}
+	push(level, -1, message);
+}
+
+void Logger::push(int level, int target, const std::string& message) {
+	time_t now = time(NULL);
+	size_t length = message.length() < MAX_MESSAGE ? message.length() : MAX_MESSAGE;
+	LogRing* ring = t_ring ? t_ring : registerRing();
+	size_t record_size = (sizeof(RecordHead) + length + 7) & ~static_cast<size_t>(7);
+	size_t head = ring->head;
+	size_t tail = ring->tail;
+	__sync_synchronize();
+	if (RING_SIZE - (head - tail) < record_size) {
+		ring->dropped = ring->dropped + 1;
+		return;
+	}
+	RecordHead record;
+	record.length = length;
+	record.level = level;
+	record.target = target;
+	record.time = now;
+	copyIn(ring, head, &record, sizeof(record));
+	copyIn(ring, head + sizeof(record), message.data(), length);
+	__sync_synchronize();
+	ring->head = head + record_size;
+}
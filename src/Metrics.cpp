@@ -0,0 +1,207 @@
+#include "Metrics.hpp"
+#include "utils.hpp"
+#include <vector>
+#include <cstdio>
+#include <pthread.h>
+
+namespace {
+	// upper bounds in microseconds, +Inf is implied
+	const long BUCKETS[] = {
+		1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+		1000000, 2500000, 5000000, 10000000
+	};
+	const size_t BUCKET_COUNT = sizeof(BUCKETS) / sizeof(BUCKETS[0]);
+
+	struct Histogram {
+		size_t buckets[BUCKET_COUNT + 1];	// not cumulative, the last one is +Inf
+		size_t count;
+		long long sum;					// microseconds
+
+		Histogram() : count(0), sum(0) {
+			for (size_t i = 0; i <= BUCKET_COUNT; ++i)
+				buckets[i] = 0;
+		}
+	};
+
+	struct MetricsBlock {
+		size_t counters[METRIC_COUNT];
+		std::vector<Histogram> histograms;	// by location slot
+		MetricsBlock* next;
+
+		MetricsBlock() : next(NULL) {
+			for (int i = 0; i < METRIC_COUNT; ++i)
+				counters[i] = 0;
+		}
+	};
+
+	struct LocationName {
+		std::string server;
+		std::string location;
+	};
+
+	__thread MetricsBlock* t_block = NULL;
+	MetricsBlock* g_blocks = NULL;
+	std::vector<LocationName> g_slots;	// slots outlive reloads, names come back
+	pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	MetricsBlock* block() {
+		if (t_block)
+			return t_block;
+		t_block = new MetricsBlock();
+		pthread_mutex_lock(&g_mutex);
+		t_block->next = g_blocks;
+		g_blocks = t_block;
+		pthread_mutex_unlock(&g_mutex);
+		return t_block;
+	}
+
+	std::string seconds(long long microseconds) {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%lld.%06lld", microseconds / 1000000, microseconds % 1000000);
+		return buffer;
+	}
+
+	// label values escape backslash, quote and newline
+	std::string label(const std::string& value) {
+		std::string out;
+		for (size_t i = 0; i < value.length(); ++i) {
+			if (value[i] == '\\' || value[i] == '"')
+				out += '\\';
+			if (value[i] == '\n')
+				out += "\\n";
+			else
+				out += value[i];
+		}
+		return out;
+	}
+
+	void counter(std::string& out, const char* name, const char* help, size_t value) {
+		out += std::string("# HELP ") + name + " " + help + "\n";
+		out += std::string("# TYPE ") + name + " counter\n";
+		out += std::string(name) + " " + size_t_to_string(value) + "\n";
+	}
+}
+
+void Metrics::add(MetricCounter counter, size_t value) {
+	block()->counters[counter] += value;
+}
+
+void Metrics::countResponse(int status) {
+	if (status >= 100 && status < 600)
+		block()->counters[METRIC_RESPONSES_1XX + status / 100 - 1]++;
+}
+
+int Metrics::locationSlot(const std::string& server, const std::string& location) {
+	pthread_mutex_lock(&g_mutex);
+	size_t slot = 0;
+	while (slot < g_slots.size() && (g_slots[slot].server != server || g_slots[slot].location != location))
+		++slot;
+	if (slot == g_slots.size()) {
+		LocationName name;
+		name.server = server;
+		name.location = location;
+		g_slots.push_back(name);
+	}
+	pthread_mutex_unlock(&g_mutex);
+	return slot;
+}
+
+void Metrics::observe(int slot, long microseconds) {
+	if (slot < 0)
+		return;
+	MetricsBlock* metrics = block();
+	if (static_cast<size_t>(slot) >= metrics->histograms.size())
+		metrics->histograms.resize(slot + 1);
+	Histogram& histogram = metrics->histograms[slot];
+	size_t bucket = 0;
+	while (bucket < BUCKET_COUNT && microseconds > BUCKETS[bucket])
+		++bucket;
+	histogram.buckets[bucket]++;
+	histogram.count++;
+	histogram.sum += microseconds;
+}
+
+// prometheus text format. counters are read without locking, a count that
+// is one increment behind is fine for a scrape. scrapes run on the event
+// loop, the only thread that records latencies today
+void Metrics::render(std::string& out, const MetricsGauges& gauges) {
+	size_t totals[METRIC_COUNT] = { 0 };
+	std::vector<Histogram> histograms;
+	pthread_mutex_lock(&g_mutex);
+	std::vector<LocationName> slots = g_slots;
+	for (MetricsBlock* metrics = g_blocks; metrics; metrics = metrics->next) {
+		for (int i = 0; i < METRIC_COUNT; ++i)
+			totals[i] += metrics->counters[i];
+		if (histograms.size() < metrics->histograms.size())
+			histograms.resize(metrics->histograms.size());
+		for (size_t slot = 0; slot < metrics->histograms.size(); ++slot) {
+			const Histogram& from = metrics->histograms[slot];
+			for (size_t i = 0; i <= BUCKET_COUNT; ++i)
+				histograms[slot].buckets[i] += from.buckets[i];
+			histograms[slot].count += from.count;
+			histograms[slot].sum += from.sum;
+		}
+	}
+	pthread_mutex_unlock(&g_mutex);
+
+	out += "# HELP webserv_connections Client connections by state.\n";
+	out += "# TYPE webserv_connections gauge\n";
+	out += "webserv_connections{state=\"active\"} " + size_t_to_string(gauges.active) + "\n";
+	out += "webserv_connections{state=\"reading\"} " + size_t_to_string(gauges.reading) + "\n";
+	out += "webserv_connections{state=\"writing\"} " + size_t_to_string(gauges.writing) + "\n";
+	out += "webserv_connections{state=\"idle\"} " + size_t_to_string(gauges.idle) + "\n";
+	counter(out, "webserv_connections_accepted_total", "Accepted client connections.", totals[METRIC_CONNECTIONS_ACCEPTED]);
+	counter(out, "webserv_connections_handled_total", "Client connections that were served.", totals[METRIC_CONNECTIONS_HANDLED]);
+	counter(out, "webserv_requests_total", "Complete requests received.", totals[METRIC_REQUESTS]);
+
+	out += "# HELP webserv_responses_total Responses by status class.\n";
+	out += "# TYPE webserv_responses_total counter\n";
+	for (int i = 0; i < 5; ++i)
+		out += "webserv_responses_total{class=\"" + int_to_string(i + 1) + "xx\"} "
+			+ size_t_to_string(totals[METRIC_RESPONSES_1XX + i]) + "\n";
+
+	counter(out, "webserv_received_bytes_total", "Bytes read from clients.", totals[METRIC_BYTES_RECEIVED]);
+	counter(out, "webserv_sent_bytes_total", "Bytes written to clients.", totals[METRIC_BYTES_SENT]);
+	counter(out, "webserv_cgi_spawns_total", "CGI processes and workers started.", totals[METRIC_CGI_SPAWNS]);
+	counter(out, "webserv_cgi_timeouts_total", "CGI scripts killed for going quiet.", totals[METRIC_CGI_TIMEOUTS]);
+	counter(out, "webserv_cgi_queue_timeouts_total", "CGI requests that waited too long for a slot.", totals[METRIC_CGI_QUEUE_TIMEOUTS]);
+
+	size_t hits = totals[METRIC_CGI_CACHE_HITS];
+	size_t stale = totals[METRIC_CGI_CACHE_STALE];
+	size_t misses = totals[METRIC_CGI_CACHE_MISSES];
+	out += "# HELP webserv_cgi_cache_lookups_total CGI cache lookups by result.\n";
+	out += "# TYPE webserv_cgi_cache_lookups_total counter\n";
+	out += "webserv_cgi_cache_lookups_total{result=\"hit\"} " + size_t_to_string(hits) + "\n";
+	out += "webserv_cgi_cache_lookups_total{result=\"stale\"} " + size_t_to_string(stale) + "\n";
+	out += "webserv_cgi_cache_lookups_total{result=\"miss\"} " + size_t_to_string(misses) + "\n";
+	char ratio[32];
+	size_t lookups = hits + stale + misses;
+	snprintf(ratio, sizeof(ratio), "%.4f", lookups ? static_cast<double>(hits + stale) / lookups : 0.0);
+	out += "# HELP webserv_cgi_cache_hit_ratio Lookups answered from the cache, stale ones included.\n";
+	out += "# TYPE webserv_cgi_cache_hit_ratio gauge\n";
+	out += std::string("webserv_cgi_cache_hit_ratio ") + ratio + "\n";
+
+	out += "# HELP webserv_request_duration_seconds Time from the first request byte to the last response byte.\n";
+	out += "# TYPE webserv_request_duration_seconds histogram\n";
+	for (size_t slot = 0; slot < histograms.size(); ++slot) {
+		const Histogram& histogram = histograms[slot];
+		if (histogram.count == 0)
+			continue;
+		std::string labels = "server=\"" + label(slots[slot].server) + "\",location=\"" + label(slots[slot].location) + "\"";
+		size_t cumulative = 0;
+		for (size_t i = 0; i <= BUCKET_COUNT; ++i) {
+			cumulative += histogram.buckets[i];
+			std::string le = "+Inf";
+			if (i < BUCKET_COUNT) {
+				le = seconds(BUCKETS[i]);
+				le.erase(le.find_last_not_of('0') + 1);
+				if (le[le.length() - 1] == '.')
+					le.erase(le.length() - 1);
+			}
+			out += "webserv_request_duration_seconds_bucket{" + labels + ",le=\"" + le + "\"} "
+				+ size_t_to_string(cumulative) + "\n";
+		}
+		out += "webserv_request_duration_seconds_sum{" + labels + "} " + seconds(histogram.sum) + "\n";
+		out += "webserv_request_duration_seconds_count{" + labels + "} " + size_t_to_string(histogram.count) + "\n";
+	}
+}
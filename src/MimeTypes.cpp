@@ -0,0 +1,234 @@
+#include "MimeTypes.hpp"
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+namespace {
+	// the first extension of a type is the one uploads are saved with
+	const char* BUILTIN[][2] = {
+		{ "text/html", "html htm shtml" },
+		{ "text/css", "css" },
+		{ "text/xml", "xml" },
+		{ "text/plain", "txt" },
+		{ "text/csv", "csv" },
+		{ "text/markdown", "md" },
+		{ "text/javascript", "mjs" },
+		{ "application/javascript", "js" },
+		{ "application/json", "json" },
+		{ "application/manifest+json", "webmanifest" },
+		{ "application/wasm", "wasm" },
+		{ "application/pdf", "pdf" },
+		{ "application/zip", "zip" },
+		{ "application/gzip", "gz" },
+		{ "application/x-tar", "tar" },
+		{ "application/x-7z-compressed", "7z" },
+		{ "application/rss+xml", "rss" },
+		{ "application/atom+xml", "atom" },
+		{ "image/png", "png" },
+		{ "image/jpeg", "jpg jpeg" },
+		{ "image/gif", "gif" },
+		{ "image/bmp", "bmp" },
+		{ "image/webp", "webp" },
+		{ "image/avif", "avif" },
+		{ "image/svg+xml", "svg svgz" },
+		{ "image/x-icon", "ico" },
+		{ "image/tiff", "tif tiff" },
+		{ "font/woff", "woff" },
+		{ "font/woff2", "woff2" },
+		{ "font/ttf", "ttf" },
+		{ "font/otf", "otf" },
+		{ "audio/mpeg", "mp3" },
+		{ "audio/ogg", "ogg" },
+		{ "audio/wav", "wav" },
+		{ "audio/aac", "aac" },
+		{ "audio/flac", "flac" },
+		{ "video/mp4", "mp4 m4v" },
+		{ "video/webm", "webm" },
+		{ "video/ogg", "ogv" },
+		{ "video/quicktime", "mov" },
+		{ "video/x-msvideo", "avi" }
+	};
+
+	const size_t MIN_SLOTS = 128;
+}
+
+MimeTypes::MimeTypes() : _default_type("application/octet-stream") {
+	for (size_t i = 0; i < sizeof(BUILTIN) / sizeof(BUILTIN[0]); ++i) {
+		std::istringstream extensions(BUILTIN[i][1]);
+		std::string extension;
+		while (extensions >> extension)
+			add(BUILTIN[i][0], extension);
+	}
+}
+
+// fnv-1a over the lowercased bytes
+size_t MimeTypes::hash(const char* data, size_t length) {
+	size_t h = 2166136261u;
+	for (size_t i = 0; i < length; ++i) {
+		h ^= static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(data[i])));
+		h *= 16777619u;
+	}
+	return h;
+}
+
+bool MimeTypes::sameNoCase(const std::string& stored, const char* data, size_t length) {
+	if (stored.length() != length)
+		return false;
+	for (size_t i = 0; i < length; ++i)
+		if (stored[i] != std::tolower(static_cast<unsigned char>(data[i])))
+			return false;
+	return true;
+}
+
+int MimeTypes::findExtension(const char* data, size_t length) const {
+	if (_by_extension.empty())
+		return -1;
+	size_t mask = _by_extension.size() - 1;
+	for (size_t slot = hash(data, length) & mask; _by_extension[slot] != -1; slot = (slot + 1) & mask)
+		if (sameNoCase(_entries[_by_extension[slot]].extension, data, length))
+			return _by_extension[slot];
+	return -1;
+}
+
+int MimeTypes::findType(const char* data, size_t length) const {
+	if (_by_type.empty())
+		return -1;
+	size_t mask = _by_type.size() - 1;
+	for (size_t slot = hash(data, length) & mask; _by_type[slot] != -1; slot = (slot + 1) & mask)
+		if (sameNoCase(_types[_by_type[slot]], data, length))
+			return _by_type[slot];
+	return -1;
+}
+
+// both tables stay at most half full
+void MimeTypes::rehash() {
+	size_t slots = MIN_SLOTS;
+	while (slots < 2 * _entries.size() || slots < 2 * _types.size())
+		slots *= 2;
+	_by_extension.assign(slots, -1);
+	_by_type.assign(slots, -1);
+	for (size_t i = 0; i < _entries.size(); ++i) {
+		size_t slot = hash(_entries[i].extension.data(), _entries[i].extension.length()) & (slots - 1);
+		while (_by_extension[slot] != -1)
+			slot = (slot + 1) & (slots - 1);
+		_by_extension[slot] = i;
+	}
+	for (size_t i = 0; i < _types.size(); ++i) {
+		size_t slot = hash(_types[i].data(), _types[i].length()) & (slots - 1);
+		while (_by_type[slot] != -1)
+			slot = (slot + 1) & (slots - 1);
+		_by_type[slot] = i;
+	}
+}
+
+size_t MimeTypes::internType(const std::string& type) {
+	int found = findType(type.data(), type.length());
+	if (found != -1)
+		return found;
+	std::string lower = type;
+	for (size_t i = 0; i < lower.length(); ++i)
+		lower[i] = std::tolower(static_cast<unsigned char>(lower[i]));
+	_types.push_back(lower);
+	_dotted.push_back("");
+	if (2 * _types.size() > _by_type.size())
+		rehash();
+	else {
+		size_t mask = _by_type.size() - 1;
+		size_t slot = hash(lower.data(), lower.length()) & mask;
+		while (_by_type[slot] != -1)
+			slot = (slot + 1) & mask;
+		_by_type[slot] = _types.size() - 1;
+	}
+	return _types.size() - 1;
+}
+
+void MimeTypes::add(const std::string& type, const std::string& extension) {
+	if (extension.empty() || type.empty())
+		return;
+	std::string name = extension[0] == '.' ? extension.substr(1) : extension;
+	if (name.empty())
+		return;
+	for (size_t i = 0; i < name.length(); ++i)
+		name[i] = std::tolower(static_cast<unsigned char>(name[i]));
+	size_t type_index = internType(type);
+	if (_dotted[type_index].empty())
+		_dotted[type_index] = "." + name;
+
+	int existing = findExtension(name.data(), name.length());
+	if (existing != -1) {
+		_entries[existing].type = type_index;
+		return;
+	}
+	Entry entry;
+	entry.extension = name;
+	entry.type = type_index;
+	_entries.push_back(entry);
+	if (2 * _entries.size() > _by_extension.size())
+		rehash();
+	else {
+		size_t mask = _by_extension.size() - 1;
+		size_t slot = hash(name.data(), name.length()) & mask;
+		while (_by_extension[slot] != -1)
+			slot = (slot + 1) & mask;
+		_by_extension[slot] = _entries.size() - 1;
+	}
+}
+
+// one statement per line, the trailing ';' is optional so apache style files
+// load too. the "types {" and "}" lines of an nginx file are skipped
+bool MimeTypes::addLine(const std::string& line) {
+	std::string text = line.substr(0, line.find('#'));
+	std::istringstream tokens(text);
+	std::string type;
+	if (!(tokens >> type) || type == "}" || type == "types")
+		return true;
+	if (type[type.length() - 1] == ';' || type.find('/') == std::string::npos)
+		return false;
+	std::string extension;
+	while (tokens >> extension) {
+		if (extension[extension.length() - 1] == ';')
+			extension.erase(extension.length() - 1);
+		if (!extension.empty())
+			add(type, extension);
+	}
+	return true;
+}
+
+bool MimeTypes::loadFile(const std::string& path, std::string& error) {
+	std::ifstream file(path.c_str());
+	if (!file.is_open()) {
+		error = "cannot open " + path;
+		return false;
+	}
+	std::string line;
+	int line_number = 0;
+	while (std::getline(file, line)) {
+		++line_number;
+		if (!addLine(line)) {
+			std::ostringstream message;
+			message << "bad mime type in " << path << " (line " << line_number << ")";
+			error = message.str();
+			return false;
+		}
+	}
+	return true;
+}
+
+const std::string& MimeTypes::typeFor(const std::string& path) const {
+	size_t dot = path.rfind('.');
+	if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+		return _default_type;
+	int entry = findExtension(path.data() + dot + 1, path.length() - dot - 1);
+	return entry == -1 ? _default_type : _types[_entries[entry].type];
+}
+
+const std::string& MimeTypes::extensionFor(const std::string& type) const {
+	static const std::string none;
+	size_t end = type.find(';');
+	if (end == std::string::npos)
+		end = type.length();
+	while (end > 0 && std::isspace(static_cast<unsigned char>(type[end - 1])))
+		--end;
+	int found = findType(type.data(), end);
+	return found == -1 ? none : _dotted[found];
+}
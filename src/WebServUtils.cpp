@@ -84,29 +84,9 @@ std::string WebServer::getFilePathWithRoot(const std::string& uri, const std::st
 	return root + clean_uri;
 }
 
-std::string WebServer::getContentType(const std::string& file_path) {
-    size_t dot_pos = file_path.find_last_of('.');
-    if (dot_pos == std::string::npos) {
-        return "application/octet-stream";
-    }
-    
-    std::string extension = file_path.substr(dot_pos);
-    
-    for (size_t i = 0; i < extension.length(); ++i) {
-        extension[i] = std::tolower(extension[i]);
-    }
-    
-    if (extension == ".html" || extension == ".htm") return "text/html";
-    if (extension == ".css") return "text/css";
-    if (extension == ".js") return "application/javascript";
-    if (extension == ".json") return "application/json";
-    if (extension == ".txt") return "text/plain";
-    if (extension == ".png") return "image/png";
-    if (extension == ".jpg" || extension == ".jpeg") return "image/jpeg";
-    if (extension == ".gif") return "image/gif";
-    if (extension == ".ico") return "image/x-icon";
-    
-    return "application/octet-stream";
+// the current config's table, lookups do not allocate
+const std::string& WebServer::getContentType(const std::string& file_path) {
+	return _config->getMimeTypes().typeFor(file_path);
 }
 
 std::string WebServer::getStatusMessage(int code) {
@@ -124,63 +104,82 @@ std::string WebServer::getStatusMessage(int code) {
         case 414: return "URI Too Long";
         case 500: return "Internal Server Error";
         case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 507: return "Insufficient Storage";
         default: return "Unknown Status";
     }
 }
 
-std::string WebServer::generateSuccessResponse(const std::string& content, const std::string& content_type) {
-    std::ostringstream response;
-    
-    response << "HTTP/1.1 200 OK\r\n";
-    response << "Content-Type: " << content_type << "\r\n";
-    response << "Content-Length: " << content.length() << "\r\n";
-    response << "Connection: close\r\n";
-    response << "Server: Webserv/1.0\r\n";
-	response << "Accept-Ranges: bytes\r\n";
-    response << "Cache-Control: no-cache\r\n";
-    response << "\r\n";
-    response << content;
-	
-	LOG_DEBUG("Generated response with headers: " + size_t_to_string(response.str().length()) + " total bytes");
+std::string WebServer::formatSuccessHead(const std::string& content_type, size_t content_length) const {
+	std::string head = "HTTP/1.1 200 OK\r\n";
+	head += "Content-Type: " + content_type + "\r\n";
+	head += "Content-Length: " + size_t_to_string(content_length) + "\r\n";
+	head += connectionHeader();
+	head += "Server: Webserv/1.0\r\n";
+	head += "Accept-Ranges: bytes\r\n";
+	head += "Cache-Control: no-cache\r\n";
+	head += "\r\n";
+	return head;
+}
 
-    return response.str();
+// the body is moved into the response, not copied
+BufferChain WebServer::generateSuccessResponse(std::string content, const std::string& content_type) {
+	BufferChain response;
+	response.append(formatSuccessHead(content_type, content.length()));
+	response.appendShared(content);
+	LOG_DEBUG("Generated response with headers: " + size_t_to_string(response.size()) + " total bytes");
+	return response;
 }
 
-std::string WebServer::generateErrorResponse(int status_code, const std::string& status_text) {
-	std::string body;
+// the file itself goes out with sendfile, only the head is built in memory
+BufferChain WebServer::generateFileResponse(const std::string& file_path) {
+	int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return generateErrorResponse(403, "Forbidden");
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+		close(fd);
+		return generateErrorResponse(500, "Internal Server Error");
+	}
+
+	BufferChain response;
+	response.append(formatSuccessHead(getContentType(file_path), file_stat.st_size));
+	response.appendFile(fd, 0, file_stat.st_size);
+	return response;
+}
+
+BufferChain WebServer::generateErrorResponse(int status_code, const std::string& status_text) {
 	(void) status_text;
-	// try to get custom error page from config
-	const ServerConfig* server_config = _config->findServerConfig("127.0.0.1", 8080, "");
+	// custom pages are read when the config loads, only the head is built here
+	const ServerConfig* server_config = _current_server;
+	if (!server_config && !_config->getServers().empty()) // answering for a backend, use the default
+		server_config = &_config->getServers()[0];
+	BufferChain response;
 	if (server_config) {
-		std::map<int, std::string>::const_iterator it = server_config->error_pages.find(status_code);
-		if (it != server_config->error_pages.end()) {
-			std::string error_file_path = server_config->root + it->second;
-			std::string custom_content = readFile(error_file_path);
-			if (!custom_content.empty()) {
-				body = custom_content;
-			}
+		std::map<int, BufferChain>::const_iterator it = server_config->error_bodies.find(status_code);
+		if (it != server_config->error_bodies.end()) {
+			response.append(formatErrorHead(status_code, it->second.size()));
+			response.append(it->second);
+			return response;
 		}
 	}
-	
-	// if no page, use default
-	if (body.empty()) {
-		body = "<html><body>";
-		body += "<h1>" + size_t_to_string(status_code) + " " + getStatusMessage(status_code) + "</h1>";
-		body += "</body></html>";
-	}
-	
-	std::ostringstream response;
-	
-	response << "HTTP/1.1 " << status_code << " " << getStatusMessage(status_code) << "\r\n";
-	response << "Content-Type: text/html\r\n";
-	response << "Content-Length: " << body.length() << "\r\n";
-	response << "Connection: close\r\n";
-	response << "Server: Webserv/1.0\r\n";
-	
-	response << "\r\n";
-	
-	response << body;
-	LOG_DEBUG("Generated error response: " + size_t_to_string(status_code) + " with " + size_t_to_string(response.str().length()) + " bytes");
-	
-	return response.str();
+
+	std::string body = "<html><body>";
+	body += "<h1>" + size_t_to_string(status_code) + " " + getStatusMessage(status_code) + "</h1>";
+	body += "</body></html>";
+	response.append(formatErrorHead(status_code, body.length()));
+	response.appendShared(body);
+	return response;
+}
+
+std::string WebServer::formatErrorHead(int status_code, size_t content_length) const {
+	std::string head = "HTTP/1.1 " + int_to_string(status_code) + " " + getStatusMessage(status_code) + "\r\n";
+	head += "Content-Type: text/html\r\n";
+	head += "Content-Length: " + size_t_to_string(content_length) + "\r\n";
+	head += connectionHeader();
+	head += "Server: Webserv/1.0\r\n";
+	head += "\r\n";
+	return head;
 }
\ No newline at end of file
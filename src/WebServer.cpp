@@ -15,45 +15,73 @@
 #include "HttpRequest.hpp"
 #include "utils.hpp"
 #include <sstream>
+#include <cerrno>
+#include <cstdlib>
 
-WebServer::WebServer() : _config(NULL){
+WebServer::WebServer() : _current_server(NULL), _keep_alive_response(false),
+	_connection_serial(0), _access_sequence(0) {
+	_signal_pipe[0] = -1;
+	_signal_pipe[1] = -1;
+	_upload_pipe[0] = -1;
+	_upload_pipe[1] = -1;
+#ifdef __linux__
+	if (pipe(_upload_pipe) == 0) {
+		for (int i = 0; i < 2; ++i) {
+			fcntl(_upload_pipe[i], F_SETFL, O_NONBLOCK);
+			fcntl(_upload_pipe[i], F_SETFD, FD_CLOEXEC);
+		}
+		fcntl(_upload_pipe[1], F_SETPIPE_SZ, static_cast<int>(UPLOAD_SPLICE_BUDGET)); // fewer splices per round
+	}
+#endif
 	_cgi_handler = new CgiHandler();
 	_cgi_handler->setWebServer(this);
+	_fastcgi_client = new FastCgiClient(this);
+	_http_proxy = new HttpProxy(this);
 }
 
 WebServer::~WebServer() {
 	cleanup();
-	delete _config;
 	delete _cgi_handler; 
+	delete _fastcgi_client;
+	delete _http_proxy;
 }
 
 bool WebServer::initialize(const std::string& config_file) {
-	_config = new Config();
+	Config* config = new Config();
+	_config = ConfigRef(config);
+	_config_file = config_file;
 	
-	if (!_config->parseConfigFile(config_file)) {
+	if (!config->parseConfigFile(config_file)) {
 		LOG_INFO("no such config file");
 		return false;
 	}
+	Logger::setFile(config->getErrorLog());
 	
-	const std::vector<ServerConfig>& servers = _config->getServers();
-	
-	for (size_t i = 0; i < servers.size(); ++i) {
-		int server_fd = createServerSocket(servers[i].host, servers[i].port);
+	if (pipe(_signal_pipe) == -1) {
+		LOG_ERROR("Failed to create signal pipe");
+		return false;
+	}
+	for (int i = 0; i < 2; ++i) {
+		fcntl(_signal_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(_signal_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	addPollFd(_signal_pipe[0]);
+
+	// one socket per listen address, shared by every server block on it
+	const std::map<std::string, ListenRoutes>& routes = _config->getRoutes();
+	for (std::map<std::string, ListenRoutes>::const_iterator it = routes.begin(); it != routes.end(); ++it) {
+		int server_fd = createServerSocket(it->second.host, it->second.port);
 		if (server_fd == -1) {
-			LOG_ERROR("Failed to create server socket for " + servers[i].host + ":" + size_t_to_string(servers[i].port));
+			LOG_ERROR("Failed to create server socket for " + it->first);
 			return false;
 		}
 		
-		_server_sockets.push_back(server_fd);
+		_listeners[server_fd] = &it->second;
+		addPollFd(server_fd);
 		
-		struct pollfd pfd;
-		pfd.fd = server_fd;
-		pfd.events = POLLIN;
-		pfd.revents = 0;
-		_poll_fds.push_back(pfd);
-		
-		LOG_INFO("Server listening on " + servers[i].host + ":" + size_t_to_string(servers[i].port));
+		LOG_INFO("Server listening on " + it->first);
 	}
+	_cgi_handler->startWorkerPools(_config->getServers());
 	
 	return true;
 }
@@ -72,7 +100,7 @@ int WebServer::createServerSocket(const std::string& host, int port) {
 		return -1;
 	}
 	
-	if (fcntl(server_fd, F_SETFL, O_NONBLOCK) == -1) {
+	if (fcntl(server_fd, F_SETFL, O_NONBLOCK) == -1 || fcntl(server_fd, F_SETFD, FD_CLOEXEC) == -1) {
 		LOG_ERROR("Failed to set socket to non-blocking");
 		close(server_fd);
 		return -1;
@@ -103,52 +131,288 @@ void WebServer::run() {
 	std::cout << "\nWebserver running..." << std::endl;
 	while (true) {
 		checkClientTimeouts();
-		// set up poll events for both read and write
-		for (size_t i = 0; i < _poll_fds.size(); ++i) {
-			_poll_fds[i].events = POLLIN;
-			
-			// check if client needs to write
-			if (_clients_ready_to_write.find(_poll_fds[i].fd) != _clients_ready_to_write.end() &&
-				_clients_ready_to_write[_poll_fds[i].fd]) {
-				_poll_fds[i].events |= POLLOUT;
-			}
-		}
+		if (_cgi_handler)
+			_cgi_handler->checkTimeouts();
+		if (_fastcgi_client)
+			_fastcgi_client->checkTimeouts();
+		if (_http_proxy)
+			_http_proxy->checkTimeouts();
+		updatePollEvents();
 		
 		LOG_DEBUG("Calling poll with " + size_t_to_string(_poll_fds.size()) + " file descriptors...");
 		int poll_count = poll(&_poll_fds[0], _poll_fds.size(), 2000);
 		LOG_DEBUG("Poll returned: " + size_t_to_string(poll_count));
 		
 		if (poll_count == -1) {
+			if (errno == EINTR) // SIGCHLD, the signal pipe has the details
+				continue;
 			LOG_ERROR("Poll error");
 			break;
 		}
 		
+		// handlers add and close fds while we dispatch, so work on a copy and
+		// skip anything that got closed earlier in this round
+		std::vector<struct pollfd> ready;
 		for (size_t i = 0; i < _poll_fds.size(); ++i) {
-			if (_poll_fds[i].revents & POLLIN) {
-				LOG_DEBUG("Activity on fd " + size_t_to_string(_poll_fds[i].fd));
-				bool is_server = false;
-				for (size_t j = 0; j < _server_sockets.size(); ++j) {
-					if (_poll_fds[i].fd == _server_sockets[j]) {
-						LOG_DEBUG("New connection on server socket " + size_t_to_string(_poll_fds[i].fd));
-						handleNewConnection(_poll_fds[i].fd);
-						is_server = true;
-						break;
-					}
-				}
-				
-				if (!is_server) {
-					LOG_DEBUG("Client data on fd " + size_t_to_string(_poll_fds[i].fd));
-					handleClientData(_poll_fds[i].fd, i);
+			if (_poll_fds[i].revents)
+				ready.push_back(_poll_fds[i]);
+		}
+		_removed_fds.clear();
+
+		for (size_t i = 0; i < ready.size(); ++i) {
+			int fd = ready[i].fd;
+			short revents = ready[i].revents;
+			if (_removed_fds.count(fd))
+				continue;
+
+			if (fd == _signal_pipe[0]) {
+				handleSignalPipe();
+				continue;
+			}
+			if (_cgi_handler && _cgi_handler->isCgiFd(fd)) {
+				_cgi_handler->handleCgiEvent(fd, revents);
+				continue;
+			}
+			if (_fastcgi_client && _fastcgi_client->isFastCgiFd(fd)) {
+				_fastcgi_client->handleEvent(fd, revents);
+				continue;
+			}
+			if (_http_proxy && _http_proxy->isProxyFd(fd)) {
+				_http_proxy->handleEvent(fd, revents);
+				continue;
+			}
+			if (revents & POLLIN) {
+				LOG_DEBUG("Activity on fd " + size_t_to_string(fd));
+				if (isServerSocket(fd)) {
+					LOG_DEBUG("New connection on server socket " + size_t_to_string(fd));
+					handleNewConnection(fd);
+				} else {
+					LOG_DEBUG("Client data on fd " + size_t_to_string(fd));
+					handleClientData(fd);
 				}
 			}
 			
-			if (_poll_fds[i].revents & POLLOUT) { // write events
-				handleClientWrite(_poll_fds[i].fd, i);
-			}
+			if ((revents & POLLOUT) && !_removed_fds.count(fd)) // write events
+				handleClientWrite(fd);
 		}
 	}
 }
 
+void WebServer::updatePollEvents() {
+	for (size_t i = 0; i < _poll_fds.size(); ++i) {
+		int fd = _poll_fds[i].fd;
+		_poll_fds[i].revents = 0;
+		if (_cgi_handler && _cgi_handler->isCgiFd(fd)) {
+			_poll_fds[i].events = _cgi_handler->getPollEvents(fd);
+			continue;
+		}
+		if (_fastcgi_client && _fastcgi_client->isFastCgiFd(fd)) {
+			_poll_fds[i].events = _fastcgi_client->getPollEvents(fd);
+			continue;
+		}
+		if (_http_proxy && _http_proxy->isProxyFd(fd)) {
+			_poll_fds[i].events = _http_proxy->getPollEvents(fd);
+			continue;
+		}
+		_poll_fds[i].events = POLLIN;
+		
+		// check if client needs to write
+		std::map<int, bool>::iterator it = _clients_ready_to_write.find(fd);
+		if (it != _clients_ready_to_write.end() && it->second)
+			_poll_fds[i].events |= POLLOUT;
+	}
+}
+
+bool WebServer::isServerSocket(int fd) const {
+	return _listeners.find(fd) != _listeners.end();
+}
+
+void WebServer::addPollFd(int fd) {
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	_poll_fds.push_back(pfd);
+}
+
+void WebServer::removePollFd(int fd) {
+	for (size_t i = 0; i < _poll_fds.size(); ++i) {
+		if (_poll_fds[i].fd == fd) {
+			_poll_fds.erase(_poll_fds.begin() + i);
+			break;
+		}
+	}
+	_removed_fds.insert(fd);
+}
+
+// async-signal-safe, only pokes the loop
+void WebServer::notifyChildExited() {
+	int saved_errno = errno;
+	if (_signal_pipe[1] != -1) {
+		ssize_t ret = write(_signal_pipe[1], "c", 1);
+		(void) ret;
+	}
+	errno = saved_errno;
+}
+
+// SIGHUP, same pipe
+void WebServer::notifyReload() {
+	int saved_errno = errno;
+	if (_signal_pipe[1] != -1) {
+		ssize_t ret = write(_signal_pipe[1], "h", 1);
+		(void) ret;
+	}
+	errno = saved_errno;
+}
+
+void WebServer::handleSignalPipe() {
+	char buffer[64];
+	ssize_t bytes_read;
+	bool reload = false;
+	while ((bytes_read = read(_signal_pipe[0], buffer, sizeof(buffer))) > 0) {
+		if (std::memchr(buffer, 'h', bytes_read))
+			reload = true;
+	}
+	if (_cgi_handler)
+		_cgi_handler->reapChildren();
+	if (reload)
+		reloadConfig();
+}
+
+// parses the file again and swaps the snapshot. a broken file changes
+// nothing. listeners whose address stays are kept with their queued
+// connections, new addresses are bound before anything is closed so a
+// failed bind leaves the old set intact. running requests keep the
+// snapshot they were routed with
+void WebServer::reloadConfig() {
+	LOG_INFO("reloading " + _config_file);
+	Config* config = new Config();
+	ConfigRef next(config);
+	if (!config->parseConfigFile(_config_file)) {
+		LOG_ERROR("reload failed, keeping the running configuration");
+		return;
+	}
+
+	const std::map<std::string, ListenRoutes>& routes = next->getRoutes();
+	std::map<std::string, int> current; // "host:port" -> listening socket
+	for (std::map<int, const ListenRoutes*>::iterator it = _listeners.begin(); it != _listeners.end(); ++it)
+		current[it->second->host + ":" + int_to_string(it->second->port)] = it->first;
+
+	std::map<int, const ListenRoutes*> listeners;
+	std::vector<int> opened;
+	for (std::map<std::string, ListenRoutes>::const_iterator it = routes.begin(); it != routes.end(); ++it) {
+		std::map<std::string, int>::iterator kept = current.find(it->first);
+		if (kept != current.end()) {
+			listeners[kept->second] = &it->second;
+			current.erase(kept);
+			continue;
+		}
+		int server_fd = createServerSocket(it->second.host, it->second.port);
+		if (server_fd == -1) {
+			LOG_ERROR("reload failed, can't listen on " + it->first);
+			for (size_t i = 0; i < opened.size(); ++i)
+				close(opened[i]);
+			return;
+		}
+		opened.push_back(server_fd);
+		listeners[server_fd] = &it->second;
+		LOG_INFO("Server listening on " + it->first);
+	}
+	for (size_t i = 0; i < opened.size(); ++i)
+		addPollFd(opened[i]);
+	for (std::map<std::string, int>::iterator it = current.begin(); it != current.end(); ++it) {
+		LOG_INFO("No longer listening on " + it->first);
+		removePollFd(it->second);
+		close(it->second);
+	}
+
+	// connections not routed yet follow their address into the new config
+	for (std::map<int, const ListenRoutes*>::iterator it = _client_listeners.begin();
+		 it != _client_listeners.end(); ++it) {
+		if (!it->second)
+			continue;
+		std::map<std::string, ListenRoutes>::const_iterator found =
+			routes.find(it->second->host + ":" + int_to_string(it->second->port));
+		it->second = found == routes.end() ? NULL : &found->second;
+	}
+	_listeners.swap(listeners);
+	_config = next;
+	_autoindex.clear();
+	_cgi_handler->startWorkerPools(_config->getServers());
+	_http_proxy->reload();
+	Logger::setFile(_config->getErrorLog());
+	LOG_INFO("configuration reloaded");
+}
+
+void WebServer::queueCgiResponse(int client_fd, const BufferChain& response) {
+	if (!isClientConnected(client_fd))
+		return;
+	noteUpstreamDone(client_fd);
+	queueResponse(client_fd, response);
+}
+
+// streamed responses: data is appended as a backend produces it, the
+// connection is only closed once the buffer drained after finishStreamedResponse
+void WebServer::queueResponseData(int client_fd, const std::string& data) {
+	if (data.empty() || !isClientConnected(client_fd))
+		return;
+	queueResponseData(client_fd, data.data(), data.length());
+}
+
+void WebServer::queueResponseData(int client_fd, const char* data, size_t length) {
+	if (length == 0 || !isClientConnected(client_fd))
+		return;
+	noteResponseHead(client_fd, data, length);
+	_client_streaming[client_fd] = true;
+	_client_write_buffers[client_fd].append(data, length);
+	_clients_ready_to_write[client_fd] = true;
+	_client_expect_continue.erase(client_fd);
+}
+
+void WebServer::finishStreamedResponse(int client_fd) {
+	if (!isClientConnected(client_fd))
+		return;
+	noteUpstreamDone(client_fd);
+	_client_streaming.erase(client_fd);
+	_clients_ready_to_write[client_fd] = true;
+}
+
+size_t WebServer::getPendingOutput(int client_fd) const {
+	std::map<int, BufferChain>::const_iterator it = _client_write_buffers.find(client_fd);
+	return it == _client_write_buffers.end() ? 0 : it->second.size();
+}
+
+// cgi, fastcgi and the proxy stop reading from their backend while this
+// holds, so a slow client never makes the server buffer a whole response
+bool WebServer::isClientBehind(int client_fd) const {
+	return getPendingOutput(client_fd) > MAX_CLIENT_BACKLOG;
+}
+
+// splice() writes to the socket behind the write buffer's back
+void WebServer::touchClient(int client_fd, size_t sent) {
+	if (!isClientConnected(client_fd))
+		return;
+	_client_timeouts[client_fd] = time(NULL);
+	Metrics::add(METRIC_BYTES_SENT, sent);
+	ClientConnection* conn = findConnection(client_fd);
+	if (conn)
+		conn->access.bytes_sent += sent;
+}
+
+bool WebServer::isClientConnected(int client_fd) const {
+	return _client_timeouts.find(client_fd) != _client_timeouts.end();
+}
+
+bool WebServer::isAwaitingOutput(int client_fd) const {
+	return _client_expect_continue.count(client_fd) || _client_streaming.count(client_fd);
+}
+
+bool WebServer::hasPendingResponse(int client_fd) const {
+	return (_cgi_handler && _cgi_handler->hasPendingResponse(client_fd))
+		|| (_fastcgi_client && _fastcgi_client->hasPendingResponse(client_fd))
+		|| (_http_proxy && _http_proxy->hasPendingResponse(client_fd));
+}
+
 void WebServer::checkClientTimeouts() {
 	time_t current_time = time(NULL);
 	std::vector<int> timed_out_clients;
@@ -160,13 +424,8 @@ void WebServer::checkClientTimeouts() {
 			}
 		}
 	for (size_t i = 0; i < timed_out_clients.size(); i++) {
-		for(size_t j = 0; j < _poll_fds.size(); ++j) {
-			if (_poll_fds[j].fd == timed_out_clients[i]) {
-				LOG_INFO("Client " + size_t_to_string(timed_out_clients[i]) + " timed out");
-				cleanupClient(timed_out_clients[i], j);
-				break ;
-			}
-		}
+		LOG_INFO("Client " + size_t_to_string(timed_out_clients[i]) + " timed out");
+		cleanupClient(timed_out_clients[i]);
 	}
 }
 
@@ -180,54 +439,97 @@ void WebServer::handleNewConnection(int server_fd) {
 		LOG_ERROR("Accept failed");
 		return;
 	}
+	Metrics::add(METRIC_CONNECTIONS_ACCEPTED);
 
-	LOG_INFO("New client connected: fd = " + size_t_to_string(client_fd));
+	LOG_DEBUG("New client connected: fd = " + size_t_to_string(client_fd));
 	
-	if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1) {
+	// cgi children and pooled workers must not keep client sockets open
+	if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1 || fcntl(client_fd, F_SETFD, FD_CLOEXEC) == -1) {
 		LOG_ERROR("fcntl failed");
 		close(client_fd);
 		return;
 	}
+	// a head and a body written separately would otherwise wait out the
+	// client's delayed ack on every keep-alive response
+	int nodelay = 1;
+	setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 	
-	struct pollfd pfd;
-	pfd.fd = client_fd;
-	pfd.events = POLLIN;
-	pfd.revents = 0;
-	_poll_fds.push_back(pfd);
+	addPollFd(client_fd);
+	Metrics::add(METRIC_CONNECTIONS_HANDLED);
 	
-	_client_buffers[client_fd] = "";
+	_client_listeners[client_fd] = _listeners[server_fd];
+	ClientConnection* conn = acquireConnection();
+	conn->access.remote_addr = inet_ntoa(client_addr.sin_addr);
+	conn->access.connection = ++_connection_serial;
+	_connections[client_fd] = conn;
 	_client_timeouts[client_fd] = time(NULL);
 
 	LOG_DEBUG("Client " + size_t_to_string(client_fd) + " added to poll list");
 }
 
-void WebServer::handleClientWrite(int client_fd, int poll_index) {
+void WebServer::handleClientWrite(int client_fd) {
 	if (_client_write_buffers.find(client_fd) == _client_write_buffers.end())
 		return;
 		
-	std::string& response = _client_write_buffers[client_fd];
+	BufferChain& response = _client_write_buffers[client_fd];
 	if (response.empty()) {
-		cleanupClient(client_fd, poll_index);
+		if (isAwaitingOutput(client_fd)) {
+			_clients_ready_to_write[client_fd] = false;
+			return;
+		}
+		finishResponse(client_fd);
 		return;
 	}
-	LOG_DEBUG("Sending response (first 200 chars): " + response.substr(0, 200));
-
-	ssize_t bytes_sent = send(client_fd, response.c_str(), response.length(), MSG_DONTWAIT);
-	
+	ssize_t bytes_sent = response.writeTo(client_fd);
 	if (bytes_sent <= 0) {
 		LOG_ERROR("send() failed for client " + size_t_to_string(client_fd));
-		cleanupClient(client_fd, poll_index);
+		cleanupClient(client_fd);
 		return;
 	}
 	
 	LOG_DEBUG("Sent " + size_t_to_string(bytes_sent) + " bytes to client " + size_t_to_string(client_fd));
-	response.erase(0, bytes_sent);  // removes sent data
+	Metrics::add(METRIC_BYTES_SENT, bytes_sent);
+	ClientConnection* conn = findConnection(client_fd);
+	if (conn)
+		conn->access.bytes_sent += bytes_sent;
+	_client_timeouts[client_fd] = time(NULL); // a long streamed response is fine as long as it moves
 	
-	if (response.empty())
-		cleanupClient(client_fd, poll_index);
+	if (response.empty()) {
+		if (isAwaitingOutput(client_fd)) { // interim 100 or a partial streamed response went out
+			_clients_ready_to_write[client_fd] = false;
+			return;
+		}
+		finishResponse(client_fd);
+	}
+}
+
+// the response is out: close, or wait for the next request on the same
+// connection. one that was pipelined behind it is already buffered
+void WebServer::finishResponse(int client_fd) {
+	ClientConnection* conn = findConnection(client_fd);
+	if (conn)
+		completeRequest(conn);
+	if (!conn || !conn->keep_alive) {
+		cleanupClient(client_fd);
+		return;
+	}
+	conn->busy = false;
+	conn->keep_alive = false;
+	_clients_ready_to_write[client_fd] = false;
+	_client_timeouts[client_fd] = time(NULL);
+	LOG_DEBUG("Client " + size_t_to_string(client_fd) + " kept alive after "
+			+ size_t_to_string(conn->requests) + " requests");
+	if (!conn->read_buffer.empty()) {
+		gettimeofday(&conn->access.start, NULL);
+		processRequest(client_fd);
+	}
 }
 
-void WebServer::handleClientData(int client_fd, int poll_index) {
+void WebServer::handleClientData(int client_fd) {
+	if (_connections[client_fd]->upload_fd != -1) {
+		spliceUpload(client_fd);
+		return;
+	}
 	LOG_DEBUG("Reading data from client " + size_t_to_string(client_fd));
 	char buffer[8192];
 	ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
@@ -235,49 +537,53 @@ void WebServer::handleClientData(int client_fd, int poll_index) {
 
 	if (bytes_read <= 0) {
 		if (bytes_read == 0)
-			LOG_INFO("Client " + size_t_to_string(client_fd) + " disconnected");
+			LOG_DEBUG("Client " + size_t_to_string(client_fd) + " disconnected");
 		else
 			LOG_ERROR("recv() failed for client " + size_t_to_string(client_fd));
-		cleanupClient(client_fd, poll_index);
+		cleanupClient(client_fd);
+		return;
+	}
+	Metrics::add(METRIC_BYTES_RECEIVED, bytes_read);
+	ClientConnection* conn = _connections[client_fd];
+	if (conn->busy) {
+		// the next request on a keep-alive connection, read once this response is out
+		if (conn->read_buffer.length() + bytes_read > MAX_PIPELINED)
+			conn->keep_alive = false;
+		else if (conn->keep_alive)
+			conn->read_buffer.append(buffer, bytes_read);
+		LOG_DEBUG("Final response already queued, holding data from client " + size_t_to_string(client_fd));
 		return;
 	}
-	buffer[bytes_read] = '\0';
-	_client_buffers[client_fd].append(buffer, bytes_read);
-	LOG_DEBUG("Buffer for client " + size_t_to_string(client_fd) + " now has " + size_t_to_string(_client_buffers[client_fd].length()) + " bytes");
+	if (conn->read_buffer.empty())
+		gettimeofday(&conn->access.start, NULL);
+	conn->read_buffer.append(buffer, bytes_read);
+	LOG_DEBUG("Buffer for client " + size_t_to_string(client_fd) + " now has " + size_t_to_string(conn->read_buffer.length()) + " bytes");
+	processRequest(client_fd);
+}
 
-	std::string& client_buffer = _client_buffers[client_fd];
+// parses what is buffered for the client and answers it once complete
+void WebServer::processRequest(int client_fd) {
+	ClientConnection* conn = _connections[client_fd];
+	std::string& client_buffer = conn->read_buffer;
 	size_t header_end_pos = client_buffer.find("\r\n\r\n");
-	if (header_end_pos != std::string::npos) {
-		header_end_pos += 4;
-	}
     if (header_end_pos == std::string::npos) {
         LOG_DEBUG("Headers not complete yet, waiting for more data from client " + size_t_to_string(client_fd));
         return;
     }
-    std::string headers = client_buffer.substr(0, header_end_pos);
-    std::istringstream header_stream(headers);
-    std::string header_line;
-    while (std::getline(header_stream, header_line)) {
-        if (!header_line.empty() && header_line[header_line.length() - 1] == '\r')
-            header_line.erase(header_line.length() - 1);
-        
-        std::string header_lower = header_line;
-        std::transform(header_lower.begin(), header_lower.end(), header_lower.begin(), ::tolower);
-        
-        if (header_lower.find("transfer-encoding:") == 0 && header_lower.find("chunked") != std::string::npos) {
-            LOG_DEBUG("Detected chunked transfer encoding in headers");
-            break;
-        }
-    }
-    
-    HttpRequest* request = NULL;
-    if (_client_requests.find(client_fd) == _client_requests.end()) {
-        request = new HttpRequest();
-        _client_requests[client_fd] = request;
-     } else
-        request = _client_requests[client_fd];
+    header_end_pos += 4;
+
+    HttpRequest* request = &conn->request;
+    bool head_parsed = !request->getUri().empty();
     if (!request->parseRequest(client_buffer)) {
        		LOG_DEBUG("Request parsing failed, waiting for more data from client " + size_t_to_string(client_fd));
+       		if (client_buffer.length() == header_end_pos && !handleExpectContinue(client_fd, *request)) {
+       			conn->busy = true;	// the body is never read, the connection closes
+       			request->reset();
+       			client_buffer.clear();
+       			return;
+       		}
+       		if (!head_parsed && !request->getUri().empty())
+       			startUpload(client_fd, *request, header_end_pos);
        		return;
     	}
     if (request->needsMoreChunks()) {
@@ -285,57 +591,481 @@ void WebServer::handleClientData(int client_fd, int poll_index) {
         return;
     }
     LOG_DEBUG("Complete HTTP request received from client " + size_t_to_string(client_fd));
-    const ServerConfig* server_config = _config->findServerConfig("127.0.0.1", 8080, "");
+    conn->busy = true;
+    conn->requests++;
+    // chunked requests have no known end in the buffer, those connections close
+    conn->keep_alive = request->wantsKeepAlive() && request->getLength() > 0;
+    routeRequest(client_fd, *request);
+    Metrics::add(METRIC_REQUESTS);
+    conn->answering = true;
+    conn->metrics_slot = request->getLocationConfig() ? request->getLocationConfig()->metrics_slot : -1;
+    beginAccess(conn, *request);
+    if (!request->getLength())
+        conn->access.bytes_received = client_buffer.length();
+    const ServerConfig* server_config = request->getServerConfig();
     if (server_config && request->getBody().length() > server_config->client_max_body_size) {
-        std::string error_response = generateErrorResponse(413, "Request Entity Too Large");
+        conn->keep_alive = false;
+        _current_server = server_config;
+        BufferChain error_response = generateErrorResponse(413, "Request Entity Too Large");
+        _current_server = NULL;
         queueResponse(client_fd, error_response);
-        delete request;
-        _client_requests.erase(client_fd);
-        _client_buffers.erase(client_fd);
+        request->reset();
+        client_buffer.clear();
         return;
     }
     LOG_DEBUG("Request parsed successfully");
-    std::string response = generateResponse(*request);
-    LOG_DEBUG("Generated response for client " + size_t_to_string(client_fd));
-    
-    queueResponse(client_fd, response);
-    
-    delete request;
-    _client_requests.erase(client_fd);
-    _client_buffers.erase(client_fd);
+    request->setClientFd(client_fd);
+    bool backend = isBackendRequest(*request);
+    if (backend) {
+        conn->keep_alive = false;
+        if (conn->access.active)
+            gettimeofday(&conn->access.upstream_start, NULL);
+    }
+    _current_server = server_config;
+    _keep_alive_response = conn->keep_alive;
+    BufferChain response = generateResponse(*request);
+    _keep_alive_response = false;
+    _current_server = NULL;
+    if (backend && !response.empty())
+        noteUpstreamDone(client_fd);	// cached or refused without running
+    if (response.empty())
+        conn->keep_alive = false;
+    if (response.empty() && hasPendingResponse(client_fd))
+        LOG_DEBUG("Response for client " + size_t_to_string(client_fd) + " deferred to a backend");
+    else {
+        LOG_DEBUG("Generated response for client " + size_t_to_string(client_fd));
+        queueResponse(client_fd, response);
+    }
+
+    if (conn->keep_alive)
+        client_buffer.erase(0, request->getLength());
+    else
+        client_buffer.clear();
+    request->reset();
+}
+
+// connections are recycled with their buffers and request, so a busy
+// server stops allocating per connection
+ClientConnection* WebServer::acquireConnection() {
+	if (_connection_pool.empty())
+		return new ClientConnection();
+	ClientConnection* conn = _connection_pool.back();
+	_connection_pool.pop_back();
+	return conn;
+}
+
+void WebServer::releaseConnection(ClientConnection* conn) {
+	if (_connection_pool.size() >= MAX_POOLED_CONNECTIONS || conn->read_buffer.capacity() > MAX_PIPELINED) {
+		delete conn;
+		return;
+	}
+	conn->read_buffer.clear();
+	conn->request.reset();
+	conn->busy = false;
+	conn->keep_alive = false;
+	conn->requests = 0;
+	conn->answering = false;
+	conn->access.reset();
+	conn->access_config.reset();
+	conn->access_server = NULL;
+	_connection_pool.push_back(conn);
+}
+
+ClientConnection* WebServer::findConnection(int client_fd) const {
+	std::map<int, ClientConnection*>::const_iterator it = _connections.find(client_fd);
+	return it == _connections.end() ? NULL : it->second;
 }
 
+// copies what the access log needs off the request, which is reset long
+// before the response is out. requests left out by sampling cost nothing more
+void WebServer::beginAccess(ClientConnection* conn, const HttpRequest& request) {
+	const ServerConfig* server = request.getServerConfig();
+	if (!server || server->access_log_id == -1)
+		return;
+	if (server->access_log_sample > 1 && _access_sequence++ % server->access_log_sample != 0)
+		return;
+	AccessEntry& entry = conn->access;
+	entry.active = true;
+	entry.method = request.methodToString();
+	entry.uri = request.getUri();
+	entry.protocol = request.getVersion();
+	entry.host = request.getHeader("Host");
+	entry.server_name = server->server_names.empty() ? "" : server->server_names[0];
+	if (server->access_format.needsHeaders()) {
+		entry.referer = request.getHeader("Referer");
+		entry.user_agent = request.getHeader("User-Agent");
+	}
+	entry.bytes_received = request.getLength();
+	entry.connection_requests = conn->requests;
+	conn->access_config = request.getConfig();
+	conn->access_server = server;
+}
+
+// the status and head size come from the first bytes queued for the request
+void WebServer::noteResponseHead(int client_fd, const char* data, size_t length) {
+	ClientConnection* conn = findConnection(client_fd);
+	if (!conn || !conn->answering || conn->access.status != 0)
+		return;
+	if (length < 12 || std::memcmp(data, "HTTP/1.", 7) != 0)
+		return;
+	conn->access.status = (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+	if (!conn->access.active)
+		return;
+	const char* end = static_cast<const char*>(memmem(data, length, "\r\n\r\n", 4));
+	conn->access.head_length = end ? end - data + 4 : 0;
+}
+
+void WebServer::noteUpstreamDone(int client_fd) {
+	ClientConnection* conn = findConnection(client_fd);
+	if (conn && conn->access.active && conn->access.upstream_start.tv_sec && !conn->access.upstream_end.tv_sec)
+		gettimeofday(&conn->access.upstream_end, NULL);
+}
+
+// once the response is out, or the client is gone
+void WebServer::completeRequest(ClientConnection* conn) {
+	if (conn->answering) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		Metrics::countResponse(conn->access.status ? conn->access.status : 499);
+		Metrics::observe(conn->metrics_slot, (now.tv_sec - conn->access.start.tv_sec) * 1000000L
+				+ (now.tv_usec - conn->access.start.tv_usec));
+		conn->answering = false;
+	}
+	writeAccess(conn);
+}
+
+void WebServer::writeAccess(ClientConnection* conn) {
+	if (!conn->access.active) {
+		conn->access.status = 0;
+		conn->access.bytes_sent = 0;
+		return;
+	}
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	std::string line;
+	conn->access_server->access_format.render(line, conn->access, now);
+	Logger::writeAccess(conn->access_server->access_log_id, line);
+	conn->access.reset();
+	conn->access_config.reset();
+	conn->access_server = NULL;
+}
+
+// backends frame their own responses, cached ones included, and say close
+bool WebServer::isBackendRequest(const HttpRequest& request) const {
+	const LocationConfig* location = request.getLocationConfig();
+	if (location && (!location->proxy_pass.empty() || !location->fastcgi_pass.empty()))
+		return true;
+	return _cgi_handler && _cgi_handler->isCgiRequest(request);
+}
+
+// the stub_status page, in the prometheus text format
+BufferChain WebServer::generateMetricsResponse() {
+	MetricsGauges gauges;
+	gauges.active = _connections.size();
+	gauges.reading = 0;
+	gauges.writing = 0;
+	gauges.idle = 0;
+	for (std::map<int, ClientConnection*>::const_iterator it = _connections.begin(); it != _connections.end(); ++it) {
+		if (it->second->busy)
+			gauges.writing++;
+		else if (!it->second->read_buffer.empty())
+			gauges.reading++;
+		else
+			gauges.idle++;
+	}
+	std::string body;
+	Metrics::render(body, gauges);
+	return generateSuccessResponse(body, "text/plain; version=0.0.4");
+}
+
+std::string WebServer::connectionHeader() const {
+	return _keep_alive_response ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
 
-void WebServer::cleanupClient(int client_fd, int poll_index) {
+
+void WebServer::cleanupClient(int client_fd) {
+    if (_cgi_handler)
+        _cgi_handler->abortClient(client_fd);
+    if (_fastcgi_client)
+        _fastcgi_client->abortClient(client_fd);
+    if (_http_proxy)
+        _http_proxy->abortClient(client_fd);
     close(client_fd);
-    _poll_fds.erase(_poll_fds.begin() + poll_index);
-    _client_buffers.erase(client_fd);
+    removePollFd(client_fd);
     _client_write_buffers.erase(client_fd);
     _clients_ready_to_write.erase(client_fd);
     _client_timeouts.erase(client_fd);
+    _client_expect_continue.erase(client_fd);
+    _client_streaming.erase(client_fd);
+    _client_listeners.erase(client_fd);
 
-    if (_client_requests.find(client_fd) != _client_requests.end()) {
-        delete _client_requests[client_fd];
-        _client_requests.erase(client_fd);
+    std::map<int, ClientConnection*>::iterator conn = _connections.find(client_fd);
+    if (conn != _connections.end()) {
+        abortUpload(conn->second);
+        completeRequest(conn->second);
+        releaseConnection(conn->second);
+        _connections.erase(conn);
     }
     
-    LOG_INFO("Client " + size_t_to_string(client_fd) + " connection closed");
+    LOG_DEBUG("Client " + size_t_to_string(client_fd) + " connection closed");
+}
+
+void WebServer::queueResponse(int client_fd, const BufferChain& response) {
+	char head[4096];
+	noteResponseHead(client_fd, head, response.peek(head, sizeof(head)));
+	_client_write_buffers[client_fd].append(response); // may still hold an unsent 100 Continue
+	_clients_ready_to_write[client_fd] = true;
+	_client_expect_continue.erase(client_fd);
+	LOG_DEBUG("Queued " + size_t_to_string(response.size()) + " bytes for writing to client " + size_t_to_string(client_fd));
 }
 
-void WebServer::queueResponse(int client_fd, const std::string& response) {
-	_client_write_buffers[client_fd] = response;
+void WebServer::queueContinue(int client_fd) {
+	_client_write_buffers[client_fd].append("HTTP/1.1 100 Continue\r\n\r\n");
 	_clients_ready_to_write[client_fd] = true;
-	LOG_DEBUG("Queued " + size_t_to_string(response.length()) + " bytes for writing to client " + size_t_to_string(client_fd));
+	_client_expect_continue[client_fd] = true;
+	LOG_DEBUG("Queued 100 Continue for client " + size_t_to_string(client_fd));
+}
+
+// called once the headers are in but the body is not. answers "Expect: 100-continue"
+// with either the interim 100 or the final error, so rejected uploads are never read.
+// returns false if a final response was queued and the request should be dropped
+bool WebServer::handleExpectContinue(int client_fd, HttpRequest& request) {
+	if (_client_expect_continue.count(client_fd))
+		return true;
+	std::string expect = request.getHeader("Expect");
+	std::transform(expect.begin(), expect.end(), expect.begin(), ::tolower);
+	if (expect != "100-continue" || request.getVersion() != "HTTP/1.1")
+		return true;
+
+	routeRequest(client_fd, request);
+	_current_server = request.getServerConfig();
+	BufferChain error_response = checkRequestHeaders(request);
+	_current_server = NULL;
+	if (!error_response.empty()) {
+		LOG_DEBUG("Rejecting body of client " + size_t_to_string(client_fd) + " before it is sent");
+		queueResponse(client_fd, error_response);
+		return false;
+	}
+	queueContinue(client_fd);
+	return true;
+}
+
+// picks the virtual host from the listener the client came in on and its
+// Host header, then the location and cgi handler; handlers read them off the request
+void WebServer::routeRequest(int client_fd, HttpRequest& request) {
+	std::map<int, const ListenRoutes*>::const_iterator it = _client_listeners.find(client_fd);
+	const ServerConfig* server = NULL;
+	if (it != _client_listeners.end() && it->second)
+		server = it->second->resolve(request.getHeader("Host"));
+	else if (!_config->getServers().empty())
+		server = &_config->getServers()[0];
+	const LocationConfig* location = server ? _config->findLocationConfig(*server, request.getUri()) : NULL;
+	request.setRoute(_config, server, location, _config->findCgiHandler(location, request.getUri()));
+}
+
+// large identity bodies for the raw upload handlers go socket -> pipe -> file
+// with splice and never enter user space. decided once, when the head is in;
+// false leaves the request to the buffered path
+bool WebServer::startUpload(int client_fd, HttpRequest& request, size_t body_start) {
+#ifdef __linux__
+	if (_upload_pipe[0] == -1 || request.getMethod() != POST || request.isChunked())
+		return false;
+	size_t length = std::strtoul(request.getHeader("Content-Length").c_str(), NULL, 10);
+	if (length < DIRECT_UPLOAD_MIN)
+		return false;
+	routeRequest(client_fd, request);
+	std::string upload_dir = uploadDirectory(request);
+	if (upload_dir.empty())
+		return false;
+
+	ClientConnection* conn = _connections[client_fd];
+	_current_server = request.getServerConfig();
+	BufferChain error_response = checkRequestHeaders(request);
+	int file_fd = -1;
+	std::string file_path;
+	if (error_response.empty()) {
+		file_fd = createUploadFile(upload_dir, client_fd, file_path);
+		if (file_fd == -1) {
+			_current_server = NULL;
+			return false;	// the buffered path answers it
+		}
+		// the blocks are reserved up front, a full disk fails before the body is read
+		if (fallocate(file_fd, 0, 0, length) == -1 && errno == ENOSPC) {
+			close(file_fd);
+			unlink(file_path.c_str());
+			error_response = generateErrorResponse(507, "Insufficient Storage");
+		}
+	}
+	_current_server = NULL;
+	if (!error_response.empty()) {
+		queueResponse(client_fd, error_response);
+		conn->busy = true;	// the body is never read, the connection closes
+		request.reset();
+		conn->read_buffer.clear();
+		return true;
+	}
+
+	// what came in with the head is written out, the rest never leaves the kernel
+	const std::string& buffer = conn->read_buffer;
+	size_t written = body_start;
+	while (written < buffer.length()) {
+		ssize_t bytes = write(file_fd, buffer.data() + written, buffer.length() - written);
+		if (bytes <= 0)
+			break;
+		written += bytes;
+	}
+	bool copied = written == buffer.length();
+	conn->upload_fd = file_fd;
+	conn->upload_remaining = length - (buffer.length() - body_start);
+	conn->upload_path = file_path;
+	conn->requests++;
+	Metrics::add(METRIC_REQUESTS);
+	conn->answering = true;
+	conn->metrics_slot = request.getLocationConfig() ? request.getLocationConfig()->metrics_slot : -1;
+	beginAccess(conn, request);
+	conn->access.bytes_received = body_start + length;
+	conn->read_buffer.clear();
+	LOG_DEBUG("Splicing " + size_t_to_string(length) + " byte body of client " + size_t_to_string(client_fd)
+		+ " into " + conn->upload_path);
+	if (!copied)
+		finishUpload(client_fd, false);
+	return true;
+#else
+	(void)client_fd;
+	(void)request;
+	(void)body_start;
+	return false;
+#endif
+}
+
+// moves what the socket has, up to a budget so one upload cannot hold the loop
+void WebServer::spliceUpload(int client_fd) {
+#ifdef __linux__
+	ClientConnection* conn = _connections[client_fd];
+	size_t budget = UPLOAD_SPLICE_BUDGET;
+	while (conn->upload_remaining > 0 && budget > 0) {
+		ssize_t moved = splice(client_fd, NULL, _upload_pipe[1], NULL,
+				std::min(conn->upload_remaining, budget), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved == -1 && errno == EAGAIN)
+			break;
+		if (moved <= 0) {
+			LOG_DEBUG("Client " + size_t_to_string(client_fd) + " closed during an upload");
+			cleanupClient(client_fd);
+			return;
+		}
+		Metrics::add(METRIC_BYTES_RECEIVED, moved);
+		conn->upload_remaining -= moved;
+		budget -= moved;
+		if (!drainUploadPipe(conn->upload_fd, moved)) {
+			finishUpload(client_fd, false);
+			return;
+		}
+	}
+	_client_timeouts[client_fd] = time(NULL); // a long upload is fine as long as it moves
+	if (conn->upload_remaining == 0)
+		finishUpload(client_fd, true);
+#else
+	(void)client_fd;
+#endif
+}
+
+// empties the shared pipe into the file. file systems without splice support
+// get a plain copy; on a write error the rest is discarded so the pipe is
+// empty for the next upload either way
+bool WebServer::drainUploadPipe(int file_fd, size_t length) {
+#ifdef __linux__
+	char buffer[65536];
+	bool copy = false;
+	while (length > 0) {
+		ssize_t bytes = copy ? -1 : splice(_upload_pipe[0], NULL, file_fd, NULL, length, SPLICE_F_MOVE);
+		if (bytes == -1 && !copy && errno == EINVAL) {
+			copy = true;
+			continue;
+		}
+		if (copy) {
+			bytes = read(_upload_pipe[0], buffer, std::min(length, sizeof(buffer)));
+			for (ssize_t written = 0; bytes > 0 && written < bytes; ) {
+				ssize_t out = write(file_fd, buffer + written, bytes - written);
+				if (out <= 0) {
+					length -= bytes;
+					bytes = -1;
+					break;
+				}
+				written += out;
+			}
+		}
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			LOG_ERROR("Upload write failed: " + std::string(strerror(errno)));
+			while (length > 0 && (bytes = read(_upload_pipe[0], buffer, std::min(length, sizeof(buffer)))) > 0)
+				length -= bytes;
+			return false;
+		}
+		length -= bytes;
+	}
+	return true;
+#else
+	(void)file_fd;
+	(void)length;
+	return false;
+#endif
+}
+
+// the body is in the file, or could not be written; answered like processRequest
+// would. the next request on the connection is still unread in the socket
+void WebServer::finishUpload(int client_fd, bool saved) {
+	ClientConnection* conn = _connections[client_fd];
+	HttpRequest* request = &conn->request;
+	if (close(conn->upload_fd) == -1)
+		saved = false;
+	conn->upload_fd = -1;
+	if (!saved)
+		unlink(conn->upload_path.c_str());
+	conn->busy = true;
+	conn->keep_alive = saved && conn->upload_remaining == 0 && request->wantsKeepAlive();
+	size_t length = std::strtoul(request->getHeader("Content-Length").c_str(), NULL, 10);
+	_current_server = request->getServerConfig();
+	_keep_alive_response = conn->keep_alive;
+	BufferChain response = saved ? uploadResponse(*request, conn->upload_path, length)
+		: generateErrorResponse(500, "Internal Server Error");
+	_keep_alive_response = false;
+	_current_server = NULL;
+	queueResponse(client_fd, response);
+	conn->upload_path.clear();
+	conn->upload_remaining = 0;
+	request->reset();
+}
+
+// the client is gone before its body was: the partial file goes too
+void WebServer::abortUpload(ClientConnection* conn) {
+	if (conn->upload_fd == -1)
+		return;
+	close(conn->upload_fd);
+	unlink(conn->upload_path.c_str());
+	conn->upload_fd = -1;
+	conn->upload_remaining = 0;
+	conn->upload_path.clear();
 }
 
 void WebServer::cleanup() {
     LOG_INFO("Cleaning up WebServer...");
     
-    for (std::map<int, HttpRequest*>::iterator it = _client_requests.begin();
-         it != _client_requests.end(); ++it) {
+    for (std::map<int, ClientConnection*>::iterator it = _connections.begin();
+         it != _connections.end(); ++it) {
+        abortUpload(it->second);
         delete it->second;
     }
-    _client_requests.clear();
+    _connections.clear();
+    for (size_t i = 0; i < _connection_pool.size(); ++i)
+        delete _connection_pool[i];
+    _connection_pool.clear();
+    if (_cgi_handler)
+        _cgi_handler->shutdown(); // closes and unregisters its own pipes
+    if (_fastcgi_client)
+        _fastcgi_client->shutdown();
+    if (_http_proxy)
+        _http_proxy->shutdown();
     
     for (size_t i = 0; i < _poll_fds.size(); ++i) {
         if (_poll_fds[i].fd > 0) {
@@ -344,22 +1074,40 @@ void WebServer::cleanup() {
         }
     }
     
+    if (_signal_pipe[1] != -1)
+        close(_signal_pipe[1]);
+    _signal_pipe[0] = -1;
+    _signal_pipe[1] = -1;
+    if (_upload_pipe[0] != -1) {
+        close(_upload_pipe[0]);
+        close(_upload_pipe[1]);
+    }
+    _upload_pipe[0] = -1;
+    _upload_pipe[1] = -1;
+    
     std::vector<struct pollfd>().swap(_poll_fds);
-    std::vector<int>().swap(_server_sockets);
+    _listeners.clear();
+    _client_listeners.clear();
     
-    _client_buffers.clear();
     _client_write_buffers.clear();
     _clients_ready_to_write.clear();
     _client_timeouts.clear();
+    _client_expect_continue.clear();
+    _client_streaming.clear();
     
-    if (_config) {
-        delete _config;
-        _config = NULL;
-    }
+    _config.reset();
     if (_cgi_handler) {
         delete _cgi_handler;
         _cgi_handler = NULL;
     }
+    if (_fastcgi_client) {
+        delete _fastcgi_client;
+        _fastcgi_client = NULL;
+    }
+    if (_http_proxy) {
+        delete _http_proxy;
+        _http_proxy = NULL;
+    }
     
     std::cout << "\nCleanup complete. Stopping server..." << std::endl;
 }
@@ -5,7 +5,7 @@
 #include "utils.hpp"
 #include <sstream>
 
-std::string WebServer::generateResponse(const HttpRequest& request) {
+BufferChain WebServer::generateResponse(const HttpRequest& request) {
     std::string method = request.methodToString();
     std::string uri = request.getUri();
     
@@ -22,13 +22,24 @@ std::string WebServer::generateResponse(const HttpRequest& request) {
 	}
 }
 
-std::string WebServer::handleGetRequest(const HttpRequest& request) {
+BufferChain WebServer::handleGetRequest(const HttpRequest& request) {
     std::string uri = request.getUri();
+    std::string path = uri.substr(0, uri.find('?'));
     std::string host = request.getHeader("Host");
 
+    const ServerConfig* server_config = request.getServerConfig();
+    if (!server_config) {
+        LOG_ERROR("no server config found");
+        return generateErrorResponse(500, "Internal Server Error");
+    }
+
+    const LocationConfig* location_config = request.getLocationConfig();
+    if (location_config && location_config->stub_status)
+        return generateMetricsResponse();
+
     // Special handling for uploads directory
     if (uri.find("/uploads/") == 0) {
-        std::string filename = uri.substr(9);
+        std::string filename = path.substr(9);
         
         if (filename.empty()) {
             std::string upload_dir = "./www/uploads";
@@ -51,16 +62,12 @@ std::string WebServer::handleGetRequest(const HttpRequest& request) {
         if (access(file_path.c_str(), R_OK) != 0)
             return generateErrorResponse(403, "Forbidden");
         
-        std::string content = readFile(file_path);
-        if (content.empty() && fileExists(file_path))
-            return generateErrorResponse(500, "Internal Server Error");
-        
-        return generateSuccessResponse(content, getContentType(file_path));
+        return generateFileResponse(file_path);
     }
 
     // Special handling for CGI-bin directory
     if (uri.find("/cgi-bin/") == 0) {
-        std::string script_name = uri.substr(9);
+        std::string script_name = path.substr(9);
         
         if (script_name.empty()) {
             std::string cgi_dir = "./www/cgi-bin";
@@ -72,45 +79,34 @@ std::string WebServer::handleGetRequest(const HttpRequest& request) {
             return generateDirectoryListing(cgi_dir, uri);
         }
         
-        if (_cgi_handler && _cgi_handler->isCgiRequest(uri))
-            return _cgi_handler->handleCgiRequest(request);
+        if (_cgi_handler && _cgi_handler->isCgiRequest(request))
+            return _cgi_handler->handleCgiRequest(request, location_config);
     }
-
-    const ServerConfig* server_config = _config->findServerConfig("127.0.0.1", 8080, "");
-    if (!server_config) {
-        LOG_ERROR("no server config found");
-        return generateErrorResponse(500, "Internal Server Error");
-    }
-
-    const LocationConfig* location_config = _config->findLocationConfig(*server_config, uri);
     
     // CHANGE: Check redirects BEFORE file existence
     if (location_config){
-        std::string redirect_response = handleRedirect(location_config);
+        BufferChain redirect_response = handleRedirect(location_config);
         if (!redirect_response.empty())
             return redirect_response;
     }
 
-    if (location_config) {
-        bool method_allowed = false;
-        for (size_t i = 0; i < location_config->allowed_methods.size(); ++i) {
-            if (location_config->allowed_methods[i] == "GET") {
-                method_allowed = true;
-                break;
-            }
-        }
-        if (!method_allowed)
-            return generateErrorResponse(405, "Method Not Allowed");
-    }
+    if (!isMethodAllowed(location_config, "GET"))
+        return generateErrorResponse(405, "Method Not Allowed");
 
-    if (_cgi_handler && _cgi_handler->isCgiRequest(uri))
-        return _cgi_handler->handleCgiRequest(request);
+    if (location_config && !location_config->proxy_pass.empty())
+        return handleProxyRequest(request, location_config);
+
+    if (location_config && !location_config->fastcgi_pass.empty())
+        return handleFastCgiRequest(request, server_config, location_config);
+
+    if (_cgi_handler && _cgi_handler->isCgiRequest(request))
+        return _cgi_handler->handleCgiRequest(request, location_config);
 
     std::string root = server_config->root;
     if (location_config && !location_config->root.empty())
         root = location_config->root;
     
-    std::string file_path = getFilePathWithRoot(uri, root);
+    std::string file_path = getFilePathWithRoot(path, root);
     // file_path = root;
     // std::string redir_root = root;
     
@@ -123,46 +119,39 @@ std::string WebServer::handleGetRequest(const HttpRequest& request) {
     if (access(file_path.c_str(), R_OK) != 0)
         return generateErrorResponse(403, "Forbidden");
     
-    std::string content = readFile(file_path);
-    if (content.empty() && fileExists(file_path))
-        return generateErrorResponse(500, "Internal Server Error");
-    
-    return generateSuccessResponse(content, getContentType(file_path));
+    return generateFileResponse(file_path);
 }
 
-std::string WebServer::handlePostRequest(const HttpRequest& request) {
+BufferChain WebServer::handlePostRequest(const HttpRequest& request) {
     std::string uri = request.getUri();
 
-    const ServerConfig* server_config = _config->findServerConfig("127.0.0.1", 8080, "");
+    const ServerConfig* server_config = request.getServerConfig();
     if (!server_config)
         return generateErrorResponse(500, "Internal Server Error");
 
-    const LocationConfig* location_config = _config->findLocationConfig(*server_config, uri);
+    const LocationConfig* location_config = request.getLocationConfig();
 
     if (location_config) {
-        std::string redirect_response = handleRedirect(location_config);
+        BufferChain redirect_response = handleRedirect(location_config);
         if (!redirect_response.empty())
             return redirect_response;
     }
     
-    if (location_config) {
-        bool method_allowed = false;
-        for (size_t i = 0; i < location_config->allowed_methods.size(); ++i) {
-            if (location_config->allowed_methods[i] == "POST") {
-                method_allowed = true;
-                break;
-            }
-        }
-        if (!method_allowed)
-            return generateErrorResponse(405, "Method Not Allowed");
-    }
+    if (!isMethodAllowed(location_config, "POST"))
+        return generateErrorResponse(405, "Method Not Allowed");
 
     size_t max_body_size = server_config->client_max_body_size;
     if (request.getBody().length() > max_body_size)
         return generateErrorResponse(413, "Request Entity Too Large");
 
-    if (_cgi_handler && _cgi_handler->isCgiRequest(uri))
-        return _cgi_handler->handleCgiRequest(request);
+    if (location_config && !location_config->proxy_pass.empty())
+        return handleProxyRequest(request, location_config);
+
+    if (location_config && !location_config->fastcgi_pass.empty())
+        return handleFastCgiRequest(request, server_config, location_config);
+
+    if (_cgi_handler && _cgi_handler->isCgiRequest(request))
+        return _cgi_handler->handleCgiRequest(request, location_config);
 
     if (location_config && !location_config->upload_path.empty())
         return handleFileUploadToLocation(request, location_config);
@@ -180,32 +169,29 @@ std::string WebServer::handlePostRequest(const HttpRequest& request) {
 }
 
 
-std::string WebServer::handleDeleteRequest(const HttpRequest& request) {
+BufferChain WebServer::handleDeleteRequest(const HttpRequest& request) {
 	std::string uri = request.getUri();
 	
-	const ServerConfig* server_config = _config->findServerConfig("127.0.0.1", 8080, "");
+	const ServerConfig* server_config = request.getServerConfig();
 	if (!server_config)
 		return generateErrorResponse(500, "Internal Server Error");
 
-	const LocationConfig* location_config = _config->findLocationConfig(*server_config, uri);
+	const LocationConfig* location_config = request.getLocationConfig();
 
 	if (location_config) {
-		std::string redirect_response = handleRedirect(location_config);
+		BufferChain redirect_response = handleRedirect(location_config);
 		if(!redirect_response.empty())
 			return redirect_response;
 	}
 
-	if (location_config) {
-		bool method_allowed = false;
-		for (size_t i = 0; i < location_config->allowed_methods.size(); ++i) {
-			if (location_config->allowed_methods[i] == "DELETE") {
-				method_allowed = true;
-				break;
-			}
-		}
-		if (!method_allowed)
-			return generateErrorResponse(405, "Method Not Allowed");
-	}
+	if (!isMethodAllowed(location_config, "DELETE"))
+		return generateErrorResponse(405, "Method Not Allowed");
+
+	if (location_config && !location_config->proxy_pass.empty())
+		return handleProxyRequest(request, location_config);
+
+	if (location_config && !location_config->fastcgi_pass.empty())
+		return handleFastCgiRequest(request, server_config, location_config);
 
 	std::string root = server_config->root;
 	if (location_config && !location_config->root.empty())
@@ -227,22 +213,93 @@ std::string WebServer::handleDeleteRequest(const HttpRequest& request) {
 		return generateErrorResponse(403, "Forbidden - No write permission");
 	
 	if (unlink(file_path.c_str()) == 0) {
-		std::ostringstream response;
-		response << "HTTP/1.1 200 OK\r\n";
-		response << "Content-Type: text/html\r\n";
-		response << "Content-Length: 47\r\n";
-		response << "Connection: close\r\n";
-		response << "Server: Webserv/1.0\r\n";
-		response << "\r\n";
-		response << "<html><body><h1>File deleted</h1></body></html>";
-		return response.str();
+		BufferChain response;
+		response.append("HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/html\r\n"
+			"Content-Length: 47\r\n");
+		response.append(connectionHeader());
+		response.append("Server: Webserv/1.0\r\n"
+			"\r\n"
+			"<html><body><h1>File deleted</h1></body></html>");
+		return response;
 	} else
 		return generateErrorResponse(500, "Internal Server Error - Delete failed");
 }
 
-std::string WebServer::handleRedirect(const LocationConfig* location) {
+bool WebServer::isMethodAllowed(const LocationConfig* location, const std::string& method) {
+    if (!location)
+        return true;
+    for (size_t i = 0; i < location->allowed_methods.size(); ++i) {
+        if (location->allowed_methods[i] == method)
+            return true;
+    }
+    return false;
+}
+
+// header-time version of the checks the handlers run on a complete request:
+// routing, redirects, method and declared body size. returns the final response
+// to send instead of reading the body, or an empty one if the body should be accepted
+BufferChain WebServer::checkRequestHeaders(const HttpRequest& request) {
+    if (request.getMethod() == UNKNOWN)
+        return generateErrorResponse(501, "Not Implemented");
+
+    const ServerConfig* server_config = request.getServerConfig();
+    if (!server_config)
+        return generateErrorResponse(500, "Internal Server Error");
+
+    const LocationConfig* location_config = request.getLocationConfig();
+    BufferChain redirect_response = handleRedirect(location_config);
+    if (!redirect_response.empty())
+        return redirect_response;
+
+    if (!isMethodAllowed(location_config, request.methodToString()))
+        return generateErrorResponse(405, "Method Not Allowed");
+
+    std::string content_length_str = request.getHeader("Content-Length");
+    if (!content_length_str.empty()) {
+        size_t content_length = 0;
+        std::istringstream iss(content_length_str);
+        iss >> content_length;
+        if (content_length > server_config->client_max_body_size)
+            return generateErrorResponse(413, "Request Entity Too Large");
+    }
+    return BufferChain();
+}
+
+// "http://name" picks an upstream block, anything else is a single host:port
+BufferChain WebServer::handleProxyRequest(const HttpRequest& request, const LocationConfig* location_config) {
+    std::string target = location_config->proxy_pass;
+    if (target.find("http://") == 0)
+        target = target.substr(7);
+    target = target.substr(0, target.find('/'));
+    return _http_proxy->handleRequest(request, target, _config->findUpstream(target));
+}
+
+// hands the request to a persistent backend, the response is streamed back
+// by FastCgiClient as records arrive
+BufferChain WebServer::handleFastCgiRequest(const HttpRequest& request, const ServerConfig* server_config,
+		const LocationConfig* location_config) {
+    std::string uri = request.getUri();
+    size_t query_pos = uri.find('?');
+    if (query_pos != std::string::npos)
+        uri = uri.substr(0, query_pos);
+
+    std::string root = server_config->root;
+    if (!location_config->root.empty())
+        root = location_config->root;
+    std::string script_path = getFilePathWithRoot(uri, root);
+
+    std::vector<std::string> env = _cgi_handler->setupEnvironment(request, script_path);
+    std::string body;
+    if (request.getMethod() == POST)
+        body = request.getBody();
+    return _fastcgi_client->handleRequest(location_config->fastcgi_pass, request.getClientFd(),
+            request.getVersion(), env, body);
+}
+
+BufferChain WebServer::handleRedirect(const LocationConfig* location) {
     if (!location || location->redirect.empty())
-        return "";
+        return BufferChain();
     
     std::string redirect_url = location->redirect;
     
@@ -266,18 +323,17 @@ std::string WebServer::handleRedirect(const LocationConfig* location) {
         default: status_text = "Moved Permanently"; status_code = 301; break;
     }
     
-    std::ostringstream response;
-    response << "HTTP/1.1 " << status_code << " " << status_text << "\r\n";
-    response << "Location: " << redirect_url << "\r\n";
-    response << "Content-Length: 0\r\n";
-    response << "Connection: close\r\n";
-    response << "Server: Webserv/1.0\r\n";
-    response << "\r\n";
-    
-    return response.str();
+    BufferChain response;
+    response.append("HTTP/1.1 " + int_to_string(status_code) + " " + status_text + "\r\n");
+    response.append("Location: " + redirect_url + "\r\n");
+    response.append("Content-Length: 0\r\n");
+    response.append(connectionHeader());
+    response.append("Server: Webserv/1.0\r\n"
+        "\r\n");
+    return response;
 }
 
-std::string WebServer::handleFileUpload(const HttpRequest& request) {
+BufferChain WebServer::handleFileUpload(const HttpRequest& request) {
     std::string upload_dir = "./www/uploads";
     mkdir(upload_dir.c_str(), 0755);
     if (request.isMultipart() && !request.getUploadedFiles().empty())
@@ -286,7 +342,7 @@ std::string WebServer::handleFileUpload(const HttpRequest& request) {
         return handleSimpleUpload(request);
 }
 
-std::string WebServer::handleMultipartUpload(const HttpRequest& request) {
+BufferChain WebServer::handleMultipartUpload(const HttpRequest& request) {
     std::string upload_dir = "./www/uploads";
     const std::vector<FormFile>& uploaded_files = request.getUploadedFiles();
     const std::map<std::string, std::string>& form_data = request.getFormData();
@@ -352,34 +408,89 @@ std::string WebServer::handleMultipartUpload(const HttpRequest& request) {
     return generateSuccessResponse(html.str(), "text/html");
 }
 
-std::string WebServer::handleSimpleUpload(const HttpRequest& request) {
-    std::string body = request.getBody();
+BufferChain WebServer::handleSimpleUpload(const HttpRequest& request) {
     std::string upload_dir = "./www/uploads";
     mkdir(upload_dir.c_str(), 0755);
 
-    std::ostringstream filename;
-    filename << "upload_" << time(NULL) << ".txt";
-    
-    std::string file_path = upload_dir + "/" + filename.str();
-    
-    std::ofstream outfile(file_path.c_str());
-    if (!outfile.is_open()) {
+    std::string file_path;
+    if (!storeUpload(upload_dir, request, file_path))
         return generateErrorResponse(500, "Internal Server Error");
+    return uploadResponse(request, file_path, request.getBody().length());
+}
+
+// where handlePostRequest stores a raw body, empty when the request goes to
+// a backend, a script or any other handler
+std::string WebServer::uploadDirectory(const HttpRequest& request) {
+    const LocationConfig* location_config = request.getLocationConfig();
+    if (location_config && (!location_config->proxy_pass.empty() || !location_config->fastcgi_pass.empty()))
+        return "";
+    if (_cgi_handler && _cgi_handler->isCgiRequest(request))
+        return "";
+    if (location_config && !location_config->upload_path.empty())
+        return location_config->upload_path;
+    if (request.getUri().find("/upload") == 0 && !request.isMultipart()) {
+        mkdir("./www/uploads", 0755);
+        return "./www/uploads";
     }
-    
-    outfile << body;
-    outfile.close();
-
-    std::ostringstream html_content;
-    html_content << "<html><body><h1>File uploaded successfully</h1>";
-    html_content << "<p>Saved as: " << filename.str() << "</p>";
-    html_content << "<p>Size: " << body.length() << " bytes</p>";
-    if (request.isChunked()) {
-        html_content << "<p>Transfer: Chunked encoding</p>";
+    return "";
+}
+
+// upload_<time>.txt, or with the connection serial and a counter added when
+// that is taken. created exclusively: a spliced upload keeps writing to its
+// file over many poll rounds and must not share it with another upload
+int WebServer::createUploadFile(const std::string& upload_dir, int client_fd, std::string& file_path) {
+    std::string stamp = upload_dir + "/upload_" + size_t_to_string(time(NULL));
+    std::string base = stamp;
+    ClientConnection* conn = findConnection(client_fd);
+    if (conn)
+        base += "_" + size_t_to_string(conn->access.connection);
+    file_path = stamp + ".txt";
+    for (size_t attempt = 1; ; ++attempt) {
+        int fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1 || errno != EEXIST || attempt == 100)
+            return fd;
+        file_path = base + (attempt > 1 ? "_" + size_t_to_string(attempt) : "") + ".txt";
     }
-    html_content << "</body></html>";
-    
-    return generateSuccessResponse(html_content.str(), "text/html");
+}
+
+// writes a buffered body to a new upload file, a partial file is removed
+bool WebServer::storeUpload(const std::string& upload_dir, const HttpRequest& request, std::string& file_path) {
+    int fd = createUploadFile(upload_dir, request.getClientFd(), file_path);
+    if (fd == -1)
+        return false;
+    const std::string& body = request.getBody();
+    size_t written = 0;
+    while (written < body.length()) {
+        ssize_t n = write(fd, body.data() + written, body.length() - written);
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    close(fd);
+    if (written < body.length()) {
+        unlink(file_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// the page both raw upload handlers answer with, also used once a spliced body is in
+BufferChain WebServer::uploadResponse(const HttpRequest& request, const std::string& file_path, size_t size) {
+    const LocationConfig* location_config = request.getLocationConfig();
+    std::string filename = file_path.substr(file_path.rfind('/') + 1);
+    std::ostringstream html;
+    html << "<html><body><h1>File uploaded successfully</h1>";
+    if (location_config && !location_config->upload_path.empty()) {
+        html << "<p>Saved to: " << location_config->upload_path << "/" << filename << "</p>";
+        html << "<p><a href='/'>Back to home</a></p>";
+    } else {
+        html << "<p>Saved as: " << filename << "</p>";
+        html << "<p>Size: " << size << " bytes</p>";
+        if (request.isChunked())
+            html << "<p>Transfer: Chunked encoding</p>";
+    }
+    html << "</body></html>";
+    return generateSuccessResponse(html.str(), "text/html");
 }
 
 std::string WebServer::getFileExtension(const std::string& filename) {
@@ -391,49 +502,18 @@ std::string WebServer::getFileExtension(const std::string& filename) {
 }
 
 std::string WebServer::getExtensionFromContentType(const std::string& content_type) {
-    if (content_type == "image/png") return ".png";
-    if (content_type == "image/jpeg") return ".jpg";
-    if (content_type == "image/gif") return ".gif";
-    if (content_type == "image/bmp") return ".bmp";
-    if (content_type == "image/webp") return ".webp";
-    if (content_type == "text/plain") return ".txt";
-    if (content_type == "text/html") return ".html";
-    if (content_type == "text/css") return ".css";
-    if (content_type == "application/javascript") return ".js";
-    if (content_type == "application/json") return ".json";
-    if (content_type == "application/pdf") return ".pdf";
-    if (content_type == "application/zip") return ".zip";
-    if (content_type == "video/mp4") return ".mp4";
-    if (content_type == "audio/mpeg") return ".mp3";
-    return ".bin";
+    const std::string& extension = _config->getMimeTypes().extensionFor(content_type);
+    return extension.empty() ? ".bin" : extension;
 }
 
-std::string WebServer::handleFileUploadToLocation(const HttpRequest& request, const LocationConfig* location_config) {
-	std::string body = request.getBody();
-	std::string upload_dir = location_config->upload_path;
-	
-	std::ostringstream filename;
-	filename << "upload_" << time(NULL) << ".txt";
-	
-	std::string file_path = upload_dir + "/" + filename.str();
-	
-	std::ofstream outfile(file_path.c_str());
-	if (!outfile.is_open())
+BufferChain WebServer::handleFileUploadToLocation(const HttpRequest& request, const LocationConfig* location_config) {
+	std::string file_path;
+	if (!storeUpload(location_config->upload_path, request, file_path))
 		return generateErrorResponse(500, "Internal Server Error - Cannot create file");
-	
-	outfile << body;
-	outfile.close();
-	
-	std::ostringstream html;
-	html << "<html><body><h1>File uploaded successfully</h1>";
-	html << "<p>Saved to: " << location_config->upload_path << "/" << filename.str() << "</p>";
-	html << "<p><a href='/'>Back to home</a></p>";
-	html << "</body></html>";
-	
-	return generateSuccessResponse(html.str(), "text/html");
+	return uploadResponse(request, file_path, request.getBody().length());
 }
 
-std::string WebServer::handleFormSubmission(const HttpRequest& request) {
+BufferChain WebServer::handleFormSubmission(const HttpRequest& request) {
     std::string body = request.getBody();
     
     std::cout << "Form data received: " << body << std::endl;
@@ -448,7 +528,7 @@ std::string WebServer::handleFormSubmission(const HttpRequest& request) {
     return generateSuccessResponse(html.str(), "text/html");
 }
 
-std::string WebServer::handlePostEcho(const HttpRequest& request) {
+BufferChain WebServer::handlePostEcho(const HttpRequest& request) {
     std::string body = request.getBody();
     
     std::ostringstream html;
@@ -462,7 +542,7 @@ std::string WebServer::handlePostEcho(const HttpRequest& request) {
     return generateSuccessResponse(html.str(), "text/html");
 }
 
-std::string WebServer::handleDirectoryRequest(const std::string& dir_path, const std::string& uri,
+BufferChain WebServer::handleDirectoryRequest(const std::string& dir_path, const std::string& uri,
 			const LocationConfig* location_config) {
 	std::vector<std::string> index_files;
 	
@@ -479,11 +559,8 @@ std::string WebServer::handleDirectoryRequest(const std::string& dir_path, const
 			index_path += "/";
 		index_path += index_files[i];
 		
-		if (fileExists(index_path) && access(index_path.c_str(), R_OK) == 0) {
-			std::string content = readFile(index_path);
-			if (!content.empty())
-				return generateSuccessResponse(content, "text/html");
-		}
+		if (fileExists(index_path) && access(index_path.c_str(), R_OK) == 0)
+			return generateFileResponse(index_path);
 	}
 
 	if (location_config && location_config->autoindex)	// autoindex check
@@ -493,73 +570,19 @@ std::string WebServer::handleDirectoryRequest(const std::string& dir_path, const
 }
 
 
-std::string WebServer::generateDirectoryListing(const std::string& dir_path, const std::string& uri) {
-    std::ostringstream html;
+BufferChain WebServer::generateDirectoryListing(const std::string& dir_path, const std::string& uri) {
+    size_t query_pos = uri.find('?');
+    std::string path = uri.substr(0, query_pos);
+    std::string query = query_pos == std::string::npos ? "" : uri.substr(query_pos + 1);
 
-    html << "<!DOCTYPE html><html><head><title>Index of " << uri << "</title>";
-    html << "<style>body{font-family:Arial,sans-serif;margin:40px;} ";
-    html << "table{border-collapse:collapse;width:100%;} ";
-    html << "th,td{text-align:left;padding:8px;border-bottom:1px solid #ddd;} ";
-    html << "a{text-decoration:none;color:#3498db;} a:hover{text-decoration:underline;}</style>";
-    html << "</head><body>";
-    html << "<h1>Index of " << uri << "</h1><hr>";
-    
-    DIR* dir = opendir(dir_path.c_str());
-    if (dir == NULL) {
-        LOG_ERROR("Cannot open directory: " + dir_path);
-        html << "<p>Error: Cannot read directory</p>";
-        html << "</body></html>";
-        return generateSuccessResponse(html.str(), "text/html");
-    }
-    
-    html << "<table>";
-    html << "<tr><th>Name</th><th>Size</th><th>Type</th></tr>";
-    
-    if (uri != "/")
-        html << "<tr><td><a href=\"../\">../</a></td><td>-</td><td>Directory</td></tr>";
-    
-    struct dirent* entry;
-    std::vector<std::string> files;
-    std::vector<std::string> directories;
-    
-    while ((entry = readdir(dir)) != NULL) {
-        std::string name = entry->d_name;
-        if (name == "." || (name[0] == '.' && name != ".."))
-            continue;
-        
-        std::string full_path = dir_path + "/" + name;
-        if (isDirectory(full_path))
-            directories.push_back(name);
-		else
-            files.push_back(name);
-    }
-    closedir(dir);
-    
-    std::sort(directories.begin(), directories.end());
-    std::sort(files.begin(), files.end());
-    
-    for (size_t i = 0; i < directories.size(); ++i) {
-        std::string name = directories[i];
-        html << "<tr><td><a href=\"" << name << "/\">" << name << "/</a></td>";
-        html << "<td>-</td><td>Directory</td></tr>";
-    }
-    
-    for (size_t i = 0; i < files.size(); ++i) {
-        std::string name = files[i];
-        std::string full_path = dir_path + "/" + name;
-        struct stat file_stat;
-        std::string size_str = "-";
-        if (stat(full_path.c_str(), &file_stat) == 0) {
-            size_str = size_t_to_string(file_stat.st_size) + " bytes";
-        }
-        std::string type = getContentType(name);
-        
-        html << "<tr><td><a href=\"" << name << "\">" << name << "</a></td>";
-        html << "<td>" << size_str << "</td><td>" << type << "</td></tr>";
+    BufferChain body;
+    std::string error;
+    if (!_autoindex.render(dir_path, path, query, _config->getMimeTypes(), body, error)) {
+        log_error(error);
+        return generateErrorResponse(403, "Forbidden");
     }
-    html << "</table>";
-    html << "<hr><p>Generated by Webserv/1.0</p>";
-    html << "</body></html>";
-    
-    return generateSuccessResponse(html.str(), "text/html");
+    BufferChain response;
+    response.append(formatSuccessHead("text/html", body.size()));
+    response.append(body);
+    return response;
 }
\ No newline at end of file
@@ -9,9 +9,28 @@ void signal_handler(int sig) {
         LOG_INFO("Received signal " + size_t_to_string(sig) + ", shutting down gracefully...");
         g_server_instance->cleanup();
         g_server_instance = NULL;
+        Logger::stop();
         exit(0);
     }
 }
+
+void sigchld_handler(int sig) {
+    (void) sig;
+    if (g_server_instance)
+        g_server_instance->notifyChildExited();
+}
+
+void sighup_handler(int sig) {
+    (void) sig;
+    if (g_server_instance)
+        g_server_instance->notifyReload();
+}
+
+void sigusr1_handler(int sig) {
+    (void) sig;
+    Logger::requestReopen();
+}
+
 int main(int argc, char* argv[]) {
     if (argc != 2){
         std::cerr << "Usage: " << argv[0] << " <config_file>" << std::endl;
@@ -22,15 +41,30 @@ int main(int argc, char* argv[]) {
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = sighup_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = sigusr1_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    Logger::start();
+
     WebServer server;
     g_server_instance = &server;
 
     if (!server.initialize(argv[1])) {
+        Logger::stop();
         std::cerr << "Server initialization failed" << std::endl;
         return 1;
     }
     server.run();
 
     server.cleanup();
+    Logger::stop();
     return 0;
 }
\ No newline at end of file
@@ -11,37 +11,23 @@
 /* ************************************************************************** */
 
 #include "utils.hpp"
+#include "Logger.hpp"
 #include <fstream>
 
-std::string get_timestamp()
-{
-	time_t rawtime;
-	struct tm * timeinfo;
-	char buffer[80];
-
-	time(&rawtime);
-	timeinfo = localtime(&rawtime);
-
-	strftime(buffer, sizeof(buffer), "%H:%M:%S", timeinfo);
-	return std::string(buffer);
-}
-
+// queued for the log writer, see Logger.cpp
 void log_debug(const std::string &message)
 {
-	std::string timestamp = get_timestamp();
-	std::cout << "[" << timestamp << "]:[\033[36mDEBUG\033[0m]   " << message << std::endl;
+	Logger::write(DEBUG_LEVEL, message);
 }
 
 void log_info(const std::string &message)
 {
-	std::string timestamp = get_timestamp();
-	std::cout << "[" << timestamp << "]:[\033[32mINFO\033[0m]    " << message << std::endl;
+	Logger::write(INFO_LEVEL, message);
 }
 
 void log_error(const std::string &message)
 {
-	std::string timestamp = get_timestamp();
-	std::cerr << "[" << timestamp << "]:[\033[31mERROR\033[0m]   " << message << std::endl;
+	Logger::write(ERROR_LEVEL, message);
 }
 
 std::string int_to_string(int value){
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+# persistent cgi worker for webserv (location directive: cgi_worker).
+# runs one cgi script per request without starting a new interpreter.
+#
+# frames on stdin:  "<env bytes> <body bytes>\n" env ("KEY=value\0"...) body
+# frames on stdout: "<output bytes>\n" cgi output (headers, blank line, body)
+# the worker exits when stdin is closed.
+
+import io
+import os
+import runpy
+import sys
+import traceback
+
+
+def read_exact(stream, size):
+    data = b""
+    while len(data) < size:
+        chunk = stream.read(size - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def run_script(environ, body):
+    out = io.BytesIO()
+    text_out = io.TextIOWrapper(out, encoding="utf-8", write_through=True)
+    saved = (sys.stdin, sys.stdout, dict(os.environ), os.getcwd())
+
+    os.environ.clear()
+    os.environ.update(environ)
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body), encoding="utf-8")
+    sys.stdout = text_out
+    try:
+        runpy.run_path(environ.get("SCRIPT_FILENAME", ""), run_name="__main__")
+    except SystemExit:
+        pass
+    except Exception:
+        traceback.print_exc(file=sys.stderr)
+        if out.tell() == 0:
+            text_out.write("Status: 500 Internal Server Error\r\n\r\n")
+    finally:
+        text_out.flush()
+        sys.stdin, sys.stdout = saved[0], saved[1]
+        os.environ.clear()
+        os.environ.update(saved[2])
+        os.chdir(saved[3])
+    return out.getvalue()
+
+
+def main():
+    stdin = sys.stdin.buffer
+    stdout = sys.stdout.buffer
+    while True:
+        line = stdin.readline()
+        if not line:
+            return
+        try:
+            env_len, body_len = (int(n) for n in line.split())
+            env_block = read_exact(stdin, env_len)
+            body = read_exact(stdin, body_len)
+        except (ValueError, EOFError):
+            return
+        environ = {}
+        for entry in env_block.decode("latin-1").split("\0"):
+            if "=" in entry:
+                key, value = entry.split("=", 1)
+                environ[key] = value
+        output = run_script(environ, body)
+        stdout.write(b"%d\n" % len(output))
+        stdout.write(output)
+        stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
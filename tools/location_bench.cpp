@@ -0,0 +1,102 @@
+// location lookup: linear longest-prefix scan against the radix tree.
+// build with "make location_bench", run as: ./location_bench [locations] [lookups]
+//
+// both use the same segment boundary rule, the results are compared so the
+// benchmark doubles as a consistency check.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <sys/time.h>
+#include "LocationTree.hpp"
+
+static double now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static std::string number(size_t value) {
+	std::string out;
+	do {
+		out.insert(out.begin(), static_cast<char>('0' + value % 10));
+		value /= 10;
+	} while (value);
+	return out;
+}
+
+static int linearMatch(const std::vector<std::string>& paths, const std::string& uri) {
+	int best = -1;
+	size_t best_length = 0;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		const std::string& path = paths[i];
+		if (uri.compare(0, path.length(), path) != 0 || (best != -1 && path.length() <= best_length))
+			continue;
+		size_t pos = path.length();
+		if (pos == uri.length() || uri[pos] == '/' || uri[pos] == '?' || (pos > 0 && uri[pos - 1] == '/')) {
+			best = i;
+			best_length = path.length();
+		}
+	}
+	return best;
+}
+
+int main(int argc, char** argv) {
+	size_t count = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 10000;
+	size_t lookups = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 100000;
+
+	// a realistic mix: a root, service prefixes and versioned api paths below them
+	std::vector<std::string> paths;
+	paths.push_back("/");
+	for (size_t i = 0; paths.size() < count; ++i) {
+		std::string service = "/service" + number(i);
+		paths.push_back(service);
+		for (size_t v = 1; v <= 4 && paths.size() < count; ++v)
+			paths.push_back(service + "/api/v" + number(v));
+	}
+
+	LocationTree tree;
+	double start = now_us();
+	for (size_t i = 0; i < paths.size(); ++i)
+		tree.insert(paths[i], i);
+	double build = now_us() - start;
+
+	std::vector<std::string> uris;
+	std::srand(42);
+	for (size_t i = 0; i < 1000; ++i) {
+		std::string uri = paths[std::rand() % paths.size()];
+		switch (std::rand() % 4) {
+			case 0: uri += "/users/42?page=2"; break;
+			case 1: uri += "x/not-a-boundary"; break;
+			case 2: uri = "/unknown" + uri; break;
+			default: break;
+		}
+		uris.push_back(uri);
+	}
+
+	for (size_t i = 0; i < uris.size(); ++i) {
+		if (tree.match(uris[i]) != linearMatch(paths, uris[i])) {
+			std::cerr << "mismatch for " << uris[i] << std::endl;
+			return 1;
+		}
+	}
+
+	volatile int sink = 0;
+	start = now_us();
+	for (size_t i = 0; i < lookups; ++i)
+		sink += linearMatch(paths, uris[i % uris.size()]);
+	double linear = (now_us() - start) * 1000 / lookups;
+
+	start = now_us();
+	for (size_t i = 0; i < lookups; ++i)
+		sink += tree.match(uris[i % uris.size()]);
+	double radix = (now_us() - start) * 1000 / lookups;
+
+	std::cout << paths.size() << " locations, tree built in " << std::fixed << std::setprecision(1)
+			  << build / 1000 << " ms" << std::endl;
+	std::cout << "linear scan   " << std::setw(10) << linear << " ns/lookup" << std::endl;
+	std::cout << "radix tree    " << std::setw(10) << radix << " ns/lookup" << std::endl;
+	return 0;
+}
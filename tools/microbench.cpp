@@ -0,0 +1,292 @@
+// micro-benchmarks for the request path: parsing, routing and response building.
+// build with "make microbench", run as: ./microbench [name filter] [ms per case]
+//
+// every case is calibrated until a run takes the requested time, then reports
+// ns/op and heap allocations/op counted by the operator new below. the server
+// is built without -O, so compare numbers between builds, not against other
+// servers.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/time.h>
+#include "WebServer.hpp"
+#include "Config.hpp"
+#include "HttpRequest.hpp"
+
+static size_t g_allocations = 0;
+static size_t g_allocated_bytes = 0;
+
+void* operator new(std::size_t size) throw(std::bad_alloc) {
+	++g_allocations;
+	g_allocated_bytes += size;
+	void* memory = std::malloc(size ? size : 1);
+	if (!memory)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void* operator new[](std::size_t size) throw(std::bad_alloc) {
+	return operator new(size);
+}
+
+void operator delete(void* memory) throw() {
+	std::free(memory);
+}
+
+void operator delete[](void* memory) throw() {
+	std::free(memory);
+}
+
+static const size_t SCALE = 1000;	// server names and locations in the routing config
+
+static double now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static std::string number(size_t value) {
+	std::string out;
+	do {
+		out.insert(out.begin(), static_cast<char>('0' + value % 10));
+		value /= 10;
+	} while (value);
+	return out;
+}
+
+// keeps results alive so the calls are not optimised away
+static volatile size_t g_sink = 0;
+
+// has access to the WebServer helpers, see the friend declaration there
+class MicroBench {
+private:
+	typedef void (MicroBench::*Case)(size_t iterations);
+
+	struct Entry {
+		const char* name;
+		Case run;
+	};
+
+	WebServer _server;
+	Config* _config;
+	const ServerConfig* _routing_server;
+	std::vector<std::string> _uris;
+	std::vector<std::string> _hosts;
+	std::string _simple_get;
+	std::string _large_headers;
+	std::string _chunked;
+	std::string _chunks;
+	std::string _multipart;
+	std::string _page;
+
+	void parse(const std::string& raw, size_t iterations) {
+		HttpRequest request;
+		for (size_t i = 0; i < iterations; ++i) {
+			request.reset();
+			g_sink += request.parseRequest(raw);
+		}
+	}
+
+	void parseSimpleGet(size_t iterations) { parse(_simple_get, iterations); }
+	void parseLargeHeaders(size_t iterations) { parse(_large_headers, iterations); }
+	void parseChunked(size_t iterations) { parse(_chunked, iterations); }
+	void parseMultipart(size_t iterations) { parse(_multipart, iterations); }
+
+	// the head is parsed once, only the chunk decoding is timed
+	void processChunk(size_t iterations) {
+		HttpRequest request;
+		std::string head = _chunked.substr(0, _chunked.find("\r\n\r\n") + 4);
+		for (size_t i = 0; i < iterations; ++i) {
+			request.reset();
+			request.parseRequest(head);
+			g_sink += request.processChunk(_chunks);
+		}
+	}
+
+	void findServerConfig(size_t iterations) {
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += reinterpret_cast<size_t>(_config->findServerConfig("127.0.0.1", 8080, _hosts[i % _hosts.size()]));
+	}
+
+	void findLocationConfig(size_t iterations) {
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += reinterpret_cast<size_t>(_config->findLocationConfig(*_routing_server, _uris[i % _uris.size()]));
+	}
+
+	void getContentType(size_t iterations) {
+		static const char* paths[] = { "/index.html", "/style.css", "/app.js", "/photo.JPEG", "/archive.tar.gz", "/README" };
+		std::vector<std::string> files(paths, paths + 6);
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += _server.getContentType(files[i % files.size()]).length();
+	}
+
+	void getFilePathWithRoot(size_t iterations) {
+		std::string root = "./www";
+		std::string uri = "/static/css//site/../main.css";
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += _server.getFilePathWithRoot(uri, root).length();
+	}
+
+	void formatSuccessHead(size_t iterations) {
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += _server.formatSuccessHead("text/html", 12345).length();
+	}
+
+	void formatErrorHead(size_t iterations) {
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += _server.formatErrorHead(404, 512).length();
+	}
+
+	void generateSuccessResponse(size_t iterations) {
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += _server.generateSuccessResponse(_page, "text/html").size();
+	}
+
+	void generateErrorResponse(size_t iterations) {
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += _server.generateErrorResponse(404, "Not Found").size();
+	}
+
+	// open, fstat and the head, the body is left to sendfile
+	void generateFileResponse(size_t iterations) {
+		for (size_t i = 0; i < iterations; ++i)
+			g_sink += _server.generateFileResponse("./www/index.html").size();
+	}
+
+	void buildRequests() {
+		_simple_get = "GET /index.html HTTP/1.1\r\nHost: localhost:8080\r\n\r\n";
+
+		_large_headers = "GET /api/v1/items?page=2&sort=name HTTP/1.1\r\nHost: localhost:8080\r\n"
+			"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+			"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+			"Accept-Language: en-US,en;q=0.9\r\nAccept-Encoding: gzip, deflate, br\r\n"
+			"Referer: http://localhost:8080/index.html\r\nConnection: keep-alive\r\n";
+		for (size_t i = 0; i < 16; ++i)
+			_large_headers += "X-Custom-Header-" + number(i) + ": " + std::string(40, 'a' + i) + "\r\n";
+		_large_headers += "Cookie: session=" + std::string(200, 'c') + "\r\n\r\n";
+
+		for (size_t i = 0; i < 16; ++i)
+			_chunks += "100\r\n" + std::string(256, 'x') + "\r\n";
+		_chunks += "0\r\n\r\n";
+		_chunked = "POST /upload HTTP/1.1\r\nHost: localhost:8080\r\nTransfer-Encoding: chunked\r\n\r\n" + _chunks;
+
+		std::string body = "--bench\r\nContent-Disposition: form-data; name=\"title\"\r\n\r\nhello\r\n"
+			"--bench\r\nContent-Disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\n"
+			"Content-Type: application/octet-stream\r\n\r\n" + std::string(4096, 'y') + "\r\n--bench--\r\n";
+		_multipart = "POST /upload HTTP/1.1\r\nHost: localhost:8080\r\n"
+			"Content-Type: multipart/form-data; boundary=bench\r\n"
+			"Content-Length: " + number(body.length()) + "\r\n\r\n" + body;
+
+		_page = "<html><body>" + std::string(4096, 'p') + "</body></html>";
+	}
+
+	// one listen address with SCALE server names, the last of them with SCALE locations
+	bool buildConfig() {
+		char path[] = "/tmp/microbench.XXXXXX";
+		int fd = mkstemp(path);
+		if (fd == -1)
+			return false;
+		close(fd);
+		std::ofstream out(path);
+		for (size_t s = 0; s < SCALE; ++s) {
+			std::string host = "site" + number(s) + ".example.com";
+			_hosts.push_back(host);
+			out << "server {\n    listen 127.0.0.1:8080;\n    server_name " << host << ";\n    root ./www;\n"
+				<< "    location / {\n        allow_methods GET;\n    }\n";
+			if (s == SCALE - 1) {
+				for (size_t l = 0; l < SCALE; ++l) {
+					std::string location = "/service" + number(l / 4) + (l % 4 ? "/api/v" + number(l % 4) : "");
+					out << "    location " << location << " {\n        allow_methods GET;\n    }\n";
+					_uris.push_back(location + "/items/42");
+				}
+			}
+			out << "}\n";
+		}
+		out.close();
+		_config = new Config();
+		bool parsed = _config->parseConfigFile(path);
+		unlink(path);
+		if (!parsed)
+			return false;
+		_server._config = ConfigRef(_config);
+		_routing_server = _config->findServerConfig("127.0.0.1", 8080, _hosts.back());
+		_server._current_server = _routing_server;
+		return _routing_server != NULL;
+	}
+
+	void measure(const Entry& entry, double budget_us) {
+		size_t iterations = 1;
+		double elapsed = 0;
+		while (true) {
+			double start = now_us();
+			(this->*entry.run)(iterations);
+			elapsed = now_us() - start;
+			if (elapsed >= budget_us / 4 || iterations >= (static_cast<size_t>(1) << 30))
+				break;
+			iterations *= elapsed < budget_us / 100 ? 10 : 2;
+		}
+		iterations = elapsed > 0 ? static_cast<size_t>(iterations * budget_us / elapsed) + 1 : iterations;
+
+		size_t allocations = g_allocations;
+		size_t bytes = g_allocated_bytes;
+		double start = now_us();
+		(this->*entry.run)(iterations);
+		elapsed = now_us() - start;
+		allocations = g_allocations - allocations;
+		bytes = g_allocated_bytes - bytes;
+
+		std::cout << std::left << std::setw(28) << entry.name << std::right
+				  << std::setw(12) << std::setprecision(1) << elapsed * 1000 / iterations
+				  << std::setw(12) << std::setprecision(2) << static_cast<double>(allocations) / iterations
+				  << std::setw(14) << std::setprecision(0) << static_cast<double>(bytes) / iterations
+				  << std::setw(12) << iterations << std::endl;
+	}
+
+public:
+	MicroBench() : _config(NULL), _routing_server(NULL) {}
+
+	int run(const std::string& filter, double budget_ms) {
+		buildRequests();
+		if (!buildConfig()) {
+			std::cerr << "microbench: could not build the routing config" << std::endl;
+			return 1;
+		}
+		static const Entry entries[] = {
+			{ "parse_simple_get", &MicroBench::parseSimpleGet },
+			{ "parse_large_headers", &MicroBench::parseLargeHeaders },
+			{ "parse_chunked", &MicroBench::parseChunked },
+			{ "parse_multipart", &MicroBench::parseMultipart },
+			{ "process_chunk", &MicroBench::processChunk },
+			{ "find_server_config", &MicroBench::findServerConfig },
+			{ "find_location_config", &MicroBench::findLocationConfig },
+			{ "get_content_type", &MicroBench::getContentType },
+			{ "get_file_path_with_root", &MicroBench::getFilePathWithRoot },
+			{ "format_success_head", &MicroBench::formatSuccessHead },
+			{ "format_error_head", &MicroBench::formatErrorHead },
+			{ "generate_success_response", &MicroBench::generateSuccessResponse },
+			{ "generate_error_response", &MicroBench::generateErrorResponse },
+			{ "generate_file_response", &MicroBench::generateFileResponse }
+		};
+		std::cout << std::fixed << std::left << std::setw(28) << "case" << std::right << std::setw(12) << "ns/op"
+				  << std::setw(12) << "allocs/op" << std::setw(14) << "bytes/op" << std::setw(12) << "runs" << std::endl;
+		for (size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); ++i)
+			if (std::string(entries[i].name).find(filter) != std::string::npos)
+				measure(entries[i], budget_ms * 1000);
+		return 0;
+	}
+};
+
+int main(int argc, char** argv) {
+	std::string filter = argc > 1 ? argv[1] : "";
+	double budget_ms = argc > 2 ? std::atof(argv[2]) : 200;
+	if (budget_ms <= 0)
+		budget_ms = 200;
+	MicroBench bench;
+	return bench.run(filter, budget_ms);
+}
@@ -0,0 +1,393 @@
+// connection scaling soak: what do held connections cost a running server.
+// build with "make soak", run as:
+//   ./soak [-h host] [-p port] [-P server pid] [-m idle|half|slow] [-u path]
+//          [-s stages] [-t hold seconds] [-L probe ms]
+//
+// connections are opened in stages (-s 1000,5000,10000 by default) and kept
+// in one of three states:
+//   idle  a request was answered, the connection sits in keep-alive
+//   half  the request head is sent without its final blank line
+//   slow  a request for -u is read at 512 bytes a second per connection
+// after each stage has been held for -t seconds the server's RSS and open
+// fds are read from /proc and a fresh connection times a few requests, which
+// shows how long the event loop takes to get around to a new client.
+// the run stops at the first stage that fails to open, loses connections or
+// answers the probe slower than -L ms; the stage before it is the maximum
+// sustainable count. held connections are still subject to the server's
+// request timeout, so a stage that takes long to open (the "open s" column)
+// can lose its first connections to it. the server's RSS is compared with
+// the one at start, run against a freshly started server.
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+static const size_t SLOW_BYTES = 512;				// per connection per second
+static const size_t CONNECTIONS_PER_SOURCE = 20000;	// below the ephemeral port range
+static const size_t PROBES = 5;
+
+struct Options {
+	std::string host;
+	int port;
+	pid_t pid;
+	std::string mode;
+	std::string path;
+	std::vector<size_t> stages;
+	int hold;
+	double probe_limit_ms;
+};
+
+struct Held {
+	int fd;
+	bool answered;		// idle: the response has been read
+	std::string head;	// idle: response bytes until the head is complete
+	size_t remaining;	// idle: body bytes still to read
+};
+
+struct Sample {
+	long rss_kb;
+	long fds;
+};
+
+static double now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static void usage() {
+	std::cerr << "usage: soak [-h host] [-p port] [-P server pid] [-m idle|half|slow] [-u path]\n"
+			  << "            [-s stages] [-t hold seconds] [-L probe ms]" << std::endl;
+	exit(2);
+}
+
+// the only process called webserv, if -P was not given
+static pid_t findServer() {
+	DIR* proc = opendir("/proc");
+	if (!proc)
+		return -1;
+	pid_t found = -1;
+	int matches = 0;
+	struct dirent* entry;
+	while ((entry = readdir(proc)) != NULL) {
+		pid_t pid = std::atoi(entry->d_name);
+		if (pid <= 0)
+			continue;
+		std::ifstream comm(("/proc/" + std::string(entry->d_name) + "/comm").c_str());
+		std::string name;
+		if (std::getline(comm, name) && name == "webserv") {
+			found = pid;
+			++matches;
+		}
+	}
+	closedir(proc);
+	return matches == 1 ? found : -1;
+}
+
+static bool sample(pid_t pid, Sample& out) {
+	std::ostringstream base;
+	base << "/proc/" << pid;
+	std::ifstream status((base.str() + "/status").c_str());
+	if (!status.is_open())
+		return false;
+	out.rss_kb = 0;
+	std::string line;
+	while (std::getline(status, line))
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			out.rss_kb = std::atol(line.c_str() + 6);
+
+	out.fds = 0;
+	DIR* fds = opendir((base.str() + "/fd").c_str());
+	if (!fds)
+		return false;
+	while (readdir(fds) != NULL)
+		++out.fds;
+	closedir(fds);
+	out.fds -= 2;	// . and ..
+	return true;
+}
+
+static std::string request(const Options& options, const std::string& path, bool close) {
+	return "GET " + path + " HTTP/1.1\r\nHost: " + options.host + "\r\nUser-Agent: soak\r\n"
+		+ (close ? "Connection: close\r\n" : "") + "\r\n";
+}
+
+// n-th connection; to loopback it binds a source address of its own run,
+// 127.x.y.1 and up, so every address stays within its ephemeral ports and
+// connects do not run into TIME_WAIT left behind by an earlier run
+static in_addr_t g_source = htonl(0x7f000001);
+
+static int openConnection(const Options& options, size_t n, bool small_buffer) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	struct timeval timeout = { 2, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (small_buffer) {
+		int size = 4096;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	if (options.host.compare(0, 4, "127.") == 0) {
+		struct sockaddr_in source;
+		std::memset(&source, 0, sizeof(source));
+		source.sin_family = AF_INET;
+		source.sin_addr.s_addr = htonl(ntohl(g_source) + n / CONNECTIONS_PER_SOURCE);
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		int one = 1;
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+		bind(fd, reinterpret_cast<struct sockaddr*>(&source), sizeof(source));
+	}
+	struct sockaddr_in address;
+	std::memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(options.port);
+	inet_pton(AF_INET, options.host.c_str(), &address.sin_addr);
+	if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// a fresh connection and a full request, ms until the server closes it
+static double probe(const Options& options) {
+	double start = now_us();
+	int fd = openConnection(options, 0, false);
+	if (fd == -1)
+		return -1;
+	struct timeval timeout = { 10, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	std::string out = request(options, "/", true);
+	if (send(fd, out.data(), out.length(), MSG_NOSIGNAL) != static_cast<ssize_t>(out.length())) {
+		close(fd);
+		return -1;
+	}
+	char buffer[16384];
+	ssize_t got;
+	size_t total = 0;
+	while ((got = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+		total += got;
+	close(fd);
+	if (got < 0 || total == 0)
+		return -1;
+	return (now_us() - start) / 1000;
+}
+
+// reads what each connection's mode allows; false if the server closed it
+static bool service(const Options& options, Held& held) {
+	char buffer[16384];
+	size_t budget = options.mode == "slow" ? SLOW_BYTES : sizeof(buffer);
+	while (budget > 0) {
+		ssize_t got = recv(held.fd, buffer, std::min(budget, sizeof(buffer)), MSG_DONTWAIT);
+		if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR))
+			return false;
+		if (got < 0)
+			return true;
+		if (options.mode == "slow")
+			budget -= got;
+		if (options.mode != "idle" || held.answered)
+			continue;
+		size_t used = got;
+		if (held.remaining == static_cast<size_t>(-1)) {
+			held.head.append(buffer, got);
+			size_t end = held.head.find("\r\n\r\n");
+			if (end == std::string::npos)
+				continue;
+			std::string lower = held.head.substr(0, end);
+			std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+			size_t length = lower.find("content-length:");
+			held.remaining = length == std::string::npos ? 0 : std::strtoul(lower.c_str() + length + 15, NULL, 10);
+			used = held.head.length() - (end + 4);
+			held.head.clear();
+		}
+		held.remaining -= std::min(held.remaining, used);
+		held.answered = held.remaining == 0;
+	}
+	return true;
+}
+
+static size_t serviceAll(const Options& options, std::vector<Held>& held) {
+	size_t dropped = 0;
+	for (size_t i = 0; i < held.size(); ) {
+		if (service(options, held[i])) {
+			++i;
+			continue;
+		}
+		close(held[i].fd);
+		held[i] = held.back();
+		held.pop_back();
+		++dropped;
+	}
+	return dropped;
+}
+
+static std::vector<size_t> parseStages(const std::string& spec) {
+	std::vector<size_t> stages;
+	std::string part;
+	std::istringstream in(spec);
+	while (std::getline(in, part, ','))
+		stages.push_back(std::strtoul(part.c_str(), NULL, 10));
+	for (size_t i = 0; i < stages.size(); ++i)
+		if (stages[i] == 0 || (i && stages[i] <= stages[i - 1]))
+			usage();
+	return stages;
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	options.host = "127.0.0.1";
+	options.port = 8080;
+	options.pid = -1;
+	options.mode = "idle";
+	options.path = "/";
+	options.stages = parseStages("1000,5000,10000");
+	options.hold = 5;
+	options.probe_limit_ms = 100;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:P:m:u:s:t:L:")) != -1) {
+		switch (opt) {
+			case 'h': options.host = optarg; break;
+			case 'p': options.port = std::atoi(optarg); break;
+			case 'P': options.pid = std::atoi(optarg); break;
+			case 'm': options.mode = optarg; break;
+			case 'u': options.path = optarg; break;
+			case 's': options.stages = parseStages(optarg); break;
+			case 't': options.hold = std::atoi(optarg); break;
+			case 'L': options.probe_limit_ms = std::atof(optarg); break;
+			default: usage();
+		}
+	}
+	if ((options.mode != "idle" && options.mode != "half" && options.mode != "slow") || options.hold < 1)
+		usage();
+	if (options.pid == -1)
+		options.pid = findServer();
+	Sample baseline;
+	if (options.pid <= 0 || !sample(options.pid, baseline)) {
+		std::cerr << "soak: cannot read /proc for the server, pass its pid with -P" << std::endl;
+		return 1;
+	}
+	struct in_addr check;
+	if (inet_pton(AF_INET, options.host.c_str(), &check) != 1)
+		usage();
+
+	g_source = htonl(0x7f000001 + ((getpid() % 0xfff0) << 8));
+
+	// the client needs one fd per connection too
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	if (options.stages.back() + 64 > limit.rlim_cur)
+		std::cerr << "soak: only " << limit.rlim_cur << " fds available here, the last stages will stop early" << std::endl;
+
+	std::string half = request(options, options.path, false);
+	half.erase(half.length() - 2);
+	std::string full = request(options, options.path, false);
+
+	std::cout << "server pid " << options.pid << ", " << options.mode << " connections to "
+			  << options.host << ":" << options.port << options.path << ", held " << options.hold << "s per stage\n"
+			  << "baseline rss " << baseline.rss_kb << " kB, " << baseline.fds << " fds\n\n"
+			  << std::setw(10) << "target" << std::setw(10) << "held" << std::setw(10) << "dropped"
+			  << std::setw(12) << "rss kB" << std::setw(10) << "fds" << std::setw(12) << "bytes/conn"
+			  << std::setw(12) << "probe p50" << std::setw(12) << "probe max" << std::setw(10) << "open s" << std::endl;
+
+	std::vector<Held> held;
+	size_t opened = 0;
+	size_t sustained = 0;
+	std::string stop_reason = "all stages held";
+	for (size_t stage = 0; stage < options.stages.size(); ++stage) {
+		size_t target = options.stages[stage];
+		bool open_failed = false;
+		double open_start = now_us();
+		while (held.size() < target) {
+			Held conn;
+			conn.fd = openConnection(options, ++opened, options.mode == "slow");
+			if (conn.fd == -1) {
+				open_failed = true;
+				break;
+			}
+			const std::string& out = options.mode == "half" ? half : full;
+			send(conn.fd, out.data(), out.length(), MSG_NOSIGNAL);
+			conn.answered = false;
+			conn.remaining = static_cast<size_t>(-1);
+			held.push_back(conn);
+		}
+		double open_seconds = (now_us() - open_start) / 1e6;
+
+		size_t dropped = 0;
+		for (int second = 0; second < options.hold; ++second) {
+			double tick = now_us();
+			dropped += serviceAll(options, held);
+			double spent = now_us() - tick;
+			if (spent < 1e6)
+				usleep(static_cast<useconds_t>(1e6 - spent));
+		}
+		dropped += serviceAll(options, held);
+		size_t waiting = 0;
+		if (options.mode == "idle")
+			for (size_t i = 0; i < held.size(); ++i)
+				waiting += !held[i].answered;
+
+		Sample now;
+		if (!sample(options.pid, now)) {
+			stop_reason = "server exited";
+			break;
+		}
+		std::vector<double> probes;
+		for (size_t i = 0; i < PROBES; ++i)
+			probes.push_back(probe(options));
+		std::sort(probes.begin(), probes.end());
+		bool probe_failed = probes.front() < 0;
+		long per_connection = held.empty() ? 0 : (now.rss_kb - baseline.rss_kb) * 1024 / static_cast<long>(held.size());
+
+		std::cout << std::fixed << std::setprecision(1)
+				  << std::setw(10) << target << std::setw(10) << held.size() << std::setw(10) << dropped
+				  << std::setw(12) << now.rss_kb << std::setw(10) << now.fds << std::setw(12) << per_connection;
+		if (probe_failed)
+			std::cout << std::setw(12) << "failed" << std::setw(12) << "-";
+		else
+			std::cout << std::setw(12) << probes[PROBES / 2] << std::setw(12) << probes.back();
+		std::cout << std::setw(10) << open_seconds << std::endl;
+
+		if (open_failed) {
+			stop_reason = "could not open more connections: " + std::string(strerror(errno));
+			break;
+		}
+		if (dropped) {
+			stop_reason = "the server closed held connections";
+			break;
+		}
+		if (waiting) {
+			std::ostringstream reason;
+			reason << waiting << " idle connections never got their response";
+			stop_reason = reason.str();
+			break;
+		}
+		if (probe_failed || probes[PROBES / 2] > options.probe_limit_ms) {
+			stop_reason = "new clients wait longer than the probe limit";
+			break;
+		}
+		sustained = target;
+	}
+
+	std::cout << "\nmax sustainable: " << sustained << " " << options.mode << " connections (" << stop_reason << ")" << std::endl;
+	for (size_t i = 0; i < held.size(); ++i)
+		close(held[i].fd);
+	return 0;
+}
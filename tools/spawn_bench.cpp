@@ -0,0 +1,93 @@
+// spawn latency of fork+exec against posix_spawn while the parent's RSS grows.
+// build with "make spawn_bench", run as: ./spawn_bench [runs] [rss MB...]
+//
+// fork has to copy the parent's page tables, so its cost follows RSS;
+// posix_spawn (a vfork-style clone in glibc) should stay flat.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+static const char* TARGET = "/bin/true";
+
+static double now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static pid_t spawn_fork() {
+	pid_t pid = fork();
+	if (pid == 0) {
+		char* argv[] = { const_cast<char*>(TARGET), NULL };
+		execve(TARGET, argv, environ);
+		_exit(127);
+	}
+	return pid;
+}
+
+static pid_t spawn_posix() {
+	char* argv[] = { const_cast<char*>(TARGET), NULL };
+	pid_t pid;
+	if (posix_spawn(&pid, TARGET, NULL, NULL, argv, environ) != 0)
+		return -1;
+	return pid;
+}
+
+// average time until the child is running and reaped
+static double measure(pid_t (*spawn)(), int runs) {
+	double total = 0;
+	for (int i = 0; i < runs; ++i) {
+		double start = now_us();
+		pid_t pid = spawn();
+		if (pid == -1) {
+			std::cerr << "spawn failed" << std::endl;
+			exit(1);
+		}
+		double spawned = now_us();
+		waitpid(pid, NULL, 0);
+		total += spawned - start;
+	}
+	return total / runs;
+}
+
+int main(int argc, char** argv) {
+	int runs = argc > 1 ? std::atoi(argv[1]) : 200;
+	std::vector<size_t> sizes;
+	for (int i = 2; i < argc; ++i)
+		sizes.push_back(std::strtoul(argv[i], NULL, 10));
+	if (sizes.empty()) {
+		sizes.push_back(0);
+		sizes.push_back(64);
+		sizes.push_back(256);
+		sizes.push_back(1024);
+	}
+
+	std::vector<char*> blocks;
+	size_t resident = 0;
+	std::cout << "rss MB    fork+exec us    posix_spawn us" << std::endl;
+	for (size_t i = 0; i < sizes.size(); ++i) {
+		while (resident < sizes[i]) { // touch every page so it is really resident
+			char* block = static_cast<char*>(std::malloc(1024 * 1024));
+			std::memset(block, 1, 1024 * 1024);
+			blocks.push_back(block);
+			++resident;
+		}
+		double forked = measure(spawn_fork, runs);
+		double spawned = measure(spawn_posix, runs);
+		std::cout << std::setw(6) << resident
+				  << std::setw(16) << std::fixed << std::setprecision(1) << forked
+				  << std::setw(18) << spawned << std::endl;
+	}
+	for (size_t i = 0; i < blocks.size(); ++i)
+		std::free(blocks[i]);
+	return 0;
+}
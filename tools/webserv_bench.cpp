@@ -0,0 +1,573 @@
+// http/1.1 load generator for comparing builds over loopback.
+// build with "make webserv-bench", run as:
+//   ./webserv-bench [-h host] [-p port] [-c connections] [-d seconds | -n requests]
+//                   [-P depth] [-K] [-j] [-m weight:method:path[:bytes]]...
+//
+// -P pipelines that many requests per connection, -K sends "Connection: close"
+// and opens a connection per request, -j prints json instead of text.
+// -m adds to the request mix, methods are get, post (urlencoded body), upload
+// (multipart body) and delete; bytes sizes the body. the mix is walked in
+// weighted round robin, so runs are repeatable. the default mix is
+// "1:get:/index.html".
+//
+// latency is measured from the request being queued on its connection to the
+// last byte of its response. requests still in flight on a connection the
+// server closed are sent again on a new one and timed from there.
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+struct MixEntry {
+	int weight;
+	std::string method;
+	std::string path;
+	size_t bytes;
+	std::string request;	// complete request, built once
+	std::vector<double> latencies;
+};
+
+struct InFlight {
+	size_t entry;
+	double queued_at;
+};
+
+struct Connection {
+	int fd;
+	bool connecting;
+	bool want_write;
+	std::string out;
+	size_t out_sent;
+	std::string in;
+	std::deque<InFlight> inflight;
+	size_t schedule_pos;
+};
+
+struct Options {
+	std::string host;
+	int port;
+	int connections;
+	double duration;
+	size_t requests;		// 0 = run for duration
+	size_t depth;
+	bool keep_alive;
+	bool json;
+};
+
+struct Totals {
+	size_t completed;
+	size_t issued;
+	size_t errors;
+	size_t reconnects;
+	size_t bytes;
+	std::map<int, size_t> statuses;
+};
+
+static double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static std::string number(size_t value) {
+	std::ostringstream out;
+	out << value;
+	return out.str();
+}
+
+static void usage() {
+	std::cerr << "usage: webserv-bench [-h host] [-p port] [-c connections] [-d seconds | -n requests]\n"
+			  << "                     [-P depth] [-K] [-j] [-m weight:method:path[:bytes]]..." << std::endl;
+	exit(2);
+}
+
+static bool parseMix(const std::string& spec, MixEntry& entry) {
+	std::vector<std::string> parts;
+	std::string part;
+	std::istringstream in(spec);
+	while (std::getline(in, part, ':'))
+		parts.push_back(part);
+	if (parts.size() < 3 || parts.size() > 4)
+		return false;
+	entry.weight = std::atoi(parts[0].c_str());
+	entry.method = parts[1];
+	entry.path = parts[2];
+	entry.bytes = parts.size() == 4 ? std::strtoul(parts[3].c_str(), NULL, 10) : 1024;
+	return entry.weight > 0 && !entry.path.empty() && entry.path[0] == '/'
+		&& (entry.method == "get" || entry.method == "post" || entry.method == "upload" || entry.method == "delete");
+}
+
+static void buildRequest(MixEntry& entry, const Options& options) {
+	std::string head;
+	std::string body;
+	std::string type;
+	if (entry.method == "post") {
+		body = "data=" + std::string(entry.bytes > 5 ? entry.bytes - 5 : 0, 'x');
+		type = "application/x-www-form-urlencoded";
+	} else if (entry.method == "upload") {
+		std::string boundary = "----webservbench";
+		body = "--" + boundary + "\r\n"
+			"Content-Disposition: form-data; name=\"file\"; filename=\"bench.bin\"\r\n"
+			"Content-Type: application/octet-stream\r\n\r\n"
+			+ std::string(entry.bytes, 'x') + "\r\n--" + boundary + "--\r\n";
+		type = "multipart/form-data; boundary=" + boundary;
+	}
+	std::string method = entry.method == "get" ? "GET" : entry.method == "delete" ? "DELETE" : "POST";
+	head = method + " " + entry.path + " HTTP/1.1\r\n";
+	head += "Host: " + options.host + ":" + number(options.port) + "\r\n";
+	head += "User-Agent: webserv-bench\r\n";
+	if (!options.keep_alive)
+		head += "Connection: close\r\n";
+	if (method == "POST") {
+		head += "Content-Type: " + type + "\r\n";
+		head += "Content-Length: " + number(body.length()) + "\r\n";
+	}
+	entry.request = head + "\r\n" + body;
+}
+
+// 1 with the response's length in consumed, 0 if more is needed, -1 if it is
+// not http. a response without length or chunking ends at eof
+static int parseResponse(const std::string& in, bool eof, size_t& consumed, int& status, bool& close) {
+	size_t head_end = in.find("\r\n\r\n");
+	if (head_end == std::string::npos)
+		return 0;
+	if (in.compare(0, 7, "HTTP/1.") != 0 || in.length() < 12)
+		return -1;
+	status = std::atoi(in.c_str() + 9);
+	close = in.compare(0, 8, "HTTP/1.0") == 0;
+
+	long length = -1;
+	bool chunked = false;
+	size_t pos = in.find("\r\n") + 2;
+	while (pos < head_end) {
+		size_t end = in.find("\r\n", pos);
+		std::string line = in.substr(pos, end - pos);
+		pos = end + 2;
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+			continue;
+		std::string name = line.substr(0, colon);
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+		std::string value = line.substr(colon + 1);
+		std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+		if (name == "content-length")
+			length = std::atol(value.c_str());
+		else if (name == "transfer-encoding" && value.find("chunked") != std::string::npos)
+			chunked = true;
+		else if (name == "connection")
+			close = value.find("close") != std::string::npos;
+	}
+
+	size_t body = head_end + 4;
+	if (status / 100 == 1 || status == 204 || status == 304) {
+		consumed = body;
+		return 1;
+	}
+	if (chunked) {
+		size_t at = body;
+		while (true) {
+			size_t line_end = in.find("\r\n", at);
+			if (line_end == std::string::npos)
+				return 0;
+			size_t size = std::strtoul(in.c_str() + at, NULL, 16);
+			if (size == 0) {
+				size_t trailer_end = in.find("\r\n\r\n", line_end);
+				if (trailer_end == std::string::npos)
+					return 0;
+				consumed = trailer_end + 4;
+				return 1;
+			}
+			at = line_end + 2 + size + 2;
+			if (at > in.length())
+				return 0;
+		}
+	}
+	if (length >= 0) {
+		if (in.length() < body + length)
+			return 0;
+		consumed = body + length;
+		return 1;
+	}
+	if (!eof)
+		return 0;
+	consumed = in.length();
+	close = true;
+	return 1;
+}
+
+class Bench {
+private:
+	Options _options;
+	std::vector<MixEntry> _mix;
+	std::vector<size_t> _schedule;	// mix indexes, each repeated by its weight
+	std::vector<Connection> _connections;
+	struct sockaddr_in _address;
+	int _epoll;
+	Totals _totals;
+	bool _issuing;
+
+	void watch(Connection& conn, bool write) {
+		if (conn.want_write == write)
+			return;
+		struct epoll_event event;
+		event.events = write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		event.data.ptr = &conn;
+		epoll_ctl(_epoll, EPOLL_CTL_MOD, conn.fd, &event);
+		conn.want_write = write;
+	}
+
+	bool open(Connection& conn) {
+		conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (conn.fd == -1)
+			return false;
+		int one = 1;
+		setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (connect(conn.fd, reinterpret_cast<struct sockaddr*>(&_address), sizeof(_address)) == -1
+				&& errno != EINPROGRESS) {
+			::close(conn.fd);
+			conn.fd = -1;
+			return false;
+		}
+		conn.connecting = true;
+		conn.want_write = true;
+		conn.out.clear();
+		conn.out_sent = 0;
+		conn.in.clear();
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT;
+		event.data.ptr = &conn;
+		epoll_ctl(_epoll, EPOLL_CTL_ADD, conn.fd, &event);
+		return true;
+	}
+
+	// unanswered requests go out again on the new connection
+	void reopen(Connection& conn, bool error) {
+		epoll_ctl(_epoll, EPOLL_CTL_DEL, conn.fd, NULL);
+		::close(conn.fd);
+		if (error)
+			_totals.errors++;
+		_totals.reconnects++;
+		std::deque<InFlight> pending;
+		pending.swap(conn.inflight);
+		if (!open(conn)) {
+			_totals.errors++;
+			return;
+		}
+		for (size_t i = 0; i < pending.size(); ++i)
+			queue(conn, pending[i].entry);
+	}
+
+	void queue(Connection& conn, size_t entry) {
+		InFlight request;
+		request.entry = entry;
+		request.queued_at = now_us();
+		conn.inflight.push_back(request);
+		conn.out += _mix[entry].request;
+	}
+
+	void fill(Connection& conn) {
+		size_t depth = _options.keep_alive ? _options.depth : 1;
+		while (_issuing && conn.inflight.size() < depth) {
+			if (_options.requests && _totals.issued >= _options.requests) {
+				_issuing = false;
+				break;
+			}
+			queue(conn, _schedule[conn.schedule_pos++ % _schedule.size()]);
+			_totals.issued++;
+		}
+	}
+
+	void flush(Connection& conn) {
+		while (conn.out_sent < conn.out.length()) {
+			ssize_t sent = send(conn.fd, conn.out.data() + conn.out_sent, conn.out.length() - conn.out_sent, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EAGAIN)
+				break;
+			if (sent <= 0) {
+				reopen(conn, true);
+				return;
+			}
+			conn.out_sent += sent;
+		}
+		if (conn.out_sent == conn.out.length()) {
+			conn.out.clear();
+			conn.out_sent = 0;
+		}
+		watch(conn, !conn.out.empty());
+	}
+
+	void readable(Connection& conn) {
+		char buffer[65536];
+		bool eof = false;
+		while (true) {
+			ssize_t got = recv(conn.fd, buffer, sizeof(buffer), 0);
+			if (got > 0) {
+				conn.in.append(buffer, got);
+				_totals.bytes += got;
+				continue;
+			}
+			if (got == 0 || errno != EAGAIN)
+				eof = true;
+			break;
+		}
+
+		double now = now_us();
+		while (!conn.inflight.empty()) {
+			size_t consumed = 0;
+			int status = 0;
+			bool close = false;
+			int parsed = parseResponse(conn.in, eof, consumed, status, close);
+			if (parsed == 0)
+				break;
+			if (parsed < 0) {
+				reopen(conn, true);
+				return;
+			}
+			InFlight done = conn.inflight.front();
+			conn.inflight.pop_front();
+			conn.in.erase(0, consumed);
+			_mix[done.entry].latencies.push_back(now - done.queued_at);
+			_totals.statuses[status]++;
+			_totals.completed++;
+			if (close || !_options.keep_alive) {
+				reopen(conn, false);
+				fill(conn);
+				return;
+			}
+		}
+		if (eof) {
+			reopen(conn, !conn.inflight.empty());
+			fill(conn);
+			return;
+		}
+		fill(conn);
+		flush(conn);
+	}
+
+	void writable(Connection& conn) {
+		if (conn.connecting) {
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+			if (error != 0) {
+				reopen(conn, true);
+				return;
+			}
+			conn.connecting = false;
+		}
+		flush(conn);
+	}
+
+public:
+	Bench(const Options& options, const std::vector<MixEntry>& mix)
+		: _options(options), _mix(mix), _epoll(-1), _issuing(true) {
+		for (size_t i = 0; i < _mix.size(); ++i) {
+			buildRequest(_mix[i], _options);
+			for (int w = 0; w < _mix[i].weight; ++w)
+				_schedule.push_back(i);
+		}
+		_totals.completed = 0;
+		_totals.issued = 0;
+		_totals.errors = 0;
+		_totals.reconnects = 0;
+		_totals.bytes = 0;
+		std::memset(&_address, 0, sizeof(_address));
+		_address.sin_family = AF_INET;
+		_address.sin_port = htons(_options.port);
+	}
+
+	bool run(double& elapsed) {
+		if (inet_pton(AF_INET, _options.host.c_str(), &_address.sin_addr) != 1) {
+			std::cerr << "webserv-bench: bad address " << _options.host << std::endl;
+			return false;
+		}
+		_epoll = epoll_create(1);
+		_connections.resize(_options.connections);
+		for (size_t i = 0; i < _connections.size(); ++i) {
+			_connections[i].schedule_pos = i;
+			if (!open(_connections[i])) {
+				std::cerr << "webserv-bench: cannot connect: " << strerror(errno) << std::endl;
+				return false;
+			}
+			fill(_connections[i]);
+		}
+
+		double start = now_us();
+		double deadline = start + _options.duration * 1e6;
+		struct epoll_event events[256];
+		while (true) {
+			double now = now_us();
+			if (_options.requests ? _totals.completed >= _options.requests : now >= deadline)
+				break;
+			if (_totals.completed == 0 && _totals.errors > 1000 && now - start > 1e6) {
+				std::cerr << "webserv-bench: nothing answers on " << _options.host << ":" << _options.port << std::endl;
+				return false;
+			}
+			int count = epoll_wait(_epoll, events, 256, 100);
+			for (int i = 0; i < count; ++i) {
+				Connection& conn = *static_cast<Connection*>(events[i].data.ptr);
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					readable(conn);
+				else if (events[i].events & EPOLLOUT)
+					writable(conn);
+			}
+		}
+		elapsed = (now_us() - start) / 1e6;
+		for (size_t i = 0; i < _connections.size(); ++i)
+			if (_connections[i].fd != -1)
+				::close(_connections[i].fd);
+		::close(_epoll);
+		return true;
+	}
+
+	const std::vector<MixEntry>& mix() const { return _mix; }
+	const Totals& totals() const { return _totals; }
+};
+
+static double percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty())
+		return 0;
+	size_t index = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static const double PERCENTILES[] = { 50, 90, 99, 99.9 };
+static const char* PERCENTILE_NAMES[] = { "p50", "p90", "p99", "p99.9" };
+static const size_t PERCENTILE_COUNT = 4;
+
+static void report(const Options& options, const Bench& bench, double elapsed) {
+	const Totals& totals = bench.totals();
+	std::vector<double> all;
+	for (size_t i = 0; i < bench.mix().size(); ++i)
+		all.insert(all.end(), bench.mix()[i].latencies.begin(), bench.mix()[i].latencies.end());
+	std::sort(all.begin(), all.end());
+	double rps = elapsed > 0 ? totals.completed / elapsed : 0;
+
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(1);
+	if (options.json) {
+		out << "{\"host\":\"" << options.host << "\",\"port\":" << options.port
+			<< ",\"connections\":" << options.connections << ",\"pipeline\":" << options.depth
+			<< ",\"keep_alive\":" << (options.keep_alive ? "true" : "false")
+			<< ",\"seconds\":" << std::setprecision(3) << elapsed << std::setprecision(1)
+			<< ",\"requests\":" << totals.completed << ",\"errors\":" << totals.errors
+			<< ",\"reconnects\":" << totals.reconnects << ",\"rps\":" << rps
+			<< ",\"received_bytes\":" << totals.bytes << ",\"latency_us\":{";
+		for (size_t p = 0; p < PERCENTILE_COUNT; ++p)
+			out << "\"" << PERCENTILE_NAMES[p] << "\":" << percentile(all, PERCENTILES[p]) << ",";
+		out << "\"max\":" << (all.empty() ? 0 : all.back()) << "},\"status\":{";
+		for (std::map<int, size_t>::const_iterator it = totals.statuses.begin(); it != totals.statuses.end(); ++it)
+			out << (it == totals.statuses.begin() ? "" : ",") << "\"" << it->first << "\":" << it->second;
+		out << "},\"mix\":[";
+		for (size_t i = 0; i < bench.mix().size(); ++i) {
+			std::vector<double> sorted = bench.mix()[i].latencies;
+			std::sort(sorted.begin(), sorted.end());
+			out << (i ? "," : "") << "{\"method\":\"" << bench.mix()[i].method << "\",\"path\":\""
+				<< bench.mix()[i].path << "\",\"requests\":" << sorted.size();
+			for (size_t p = 0; p < PERCENTILE_COUNT; ++p)
+				out << ",\"" << PERCENTILE_NAMES[p] << "\":" << percentile(sorted, PERCENTILES[p]);
+			out << "}";
+		}
+		out << "]}";
+		std::cout << out.str() << std::endl;
+		return;
+	}
+
+	out << options.host << ":" << options.port << ", " << options.connections << " connections, pipeline "
+		<< options.depth << ", " << (options.keep_alive ? "keep-alive" : "close") << "\n";
+	out << "requests    " << totals.completed << " in " << std::setprecision(2) << elapsed << "s"
+		<< " (errors " << totals.errors << ", reconnects " << totals.reconnects << ")\n";
+	out << std::setprecision(1);
+	out << "rps         " << rps << "\n";
+	out << "received    " << totals.bytes / elapsed / (1024 * 1024) << " MB/s\n";
+	out << "status     ";
+	for (std::map<int, size_t>::const_iterator it = totals.statuses.begin(); it != totals.statuses.end(); ++it)
+		out << " " << it->first << ":" << it->second;
+	out << "\n\nlatency us  ";
+	for (size_t p = 0; p < PERCENTILE_COUNT; ++p)
+		out << std::setw(10) << PERCENTILE_NAMES[p];
+	out << std::setw(10) << "max" << "\n" << std::setw(12) << std::left << "all" << std::right;
+	for (size_t p = 0; p < PERCENTILE_COUNT; ++p)
+		out << std::setw(10) << percentile(all, PERCENTILES[p]);
+	out << std::setw(10) << (all.empty() ? 0 : all.back()) << "\n";
+	if (bench.mix().size() > 1) {
+		for (size_t i = 0; i < bench.mix().size(); ++i) {
+			std::vector<double> sorted = bench.mix()[i].latencies;
+			std::sort(sorted.begin(), sorted.end());
+			out << bench.mix()[i].method << " " << bench.mix()[i].path << " (" << sorted.size() << ")\n"
+				<< std::setw(12) << "";
+			for (size_t p = 0; p < PERCENTILE_COUNT; ++p)
+				out << std::setw(10) << percentile(sorted, PERCENTILES[p]);
+			out << std::setw(10) << (sorted.empty() ? 0 : sorted.back()) << "\n";
+		}
+	}
+	std::cout << out.str();
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	options.host = "127.0.0.1";
+	options.port = 8080;
+	options.connections = 32;
+	options.duration = 10;
+	options.requests = 0;
+	options.depth = 1;
+	options.keep_alive = true;
+	options.json = false;
+	std::vector<MixEntry> mix;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:c:d:n:P:Kjm:")) != -1) {
+		switch (opt) {
+			case 'h': options.host = optarg; break;
+			case 'p': options.port = std::atoi(optarg); break;
+			case 'c': options.connections = std::atoi(optarg); break;
+			case 'd': options.duration = std::atof(optarg); break;
+			case 'n': options.requests = std::strtoul(optarg, NULL, 10); break;
+			case 'P': options.depth = std::strtoul(optarg, NULL, 10); break;
+			case 'K': options.keep_alive = false; break;
+			case 'j': options.json = true; break;
+			case 'm': {
+				MixEntry entry;
+				if (!parseMix(optarg, entry)) {
+					std::cerr << "webserv-bench: bad mix entry " << optarg << std::endl;
+					usage();
+				}
+				mix.push_back(entry);
+				break;
+			}
+			default: usage();
+		}
+	}
+	if (options.connections <= 0 || options.depth == 0 || options.port <= 0 || (!options.requests && options.duration <= 0))
+		usage();
+	if (mix.empty()) {
+		MixEntry entry;
+		parseMix("1:get:/index.html", entry);
+		mix.push_back(entry);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	Bench bench(options, mix);
+	double elapsed = 0;
+	if (!bench.run(elapsed))
+		return 1;
+	report(options, bench, elapsed);
+	return bench.totals().errors ? 3 : 0;
+}
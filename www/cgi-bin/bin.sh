@@ -0,0 +1,5 @@
+#!/bin/bash
+echo "Content-Type: application/octet-stream"
+echo "Content-Length: 20971520"
+echo
+head -c 20971520 /tmp/wst/blob
@@ -0,0 +1,7 @@
+#!/bin/bash
+n=$(( $(cat /tmp/wst/count 2>/dev/null || echo 0) + 1 )); echo $n > /tmp/wst/count
+sleep 1
+echo "Content-Type: text/plain"
+[ -n "$QUERY_STRING" ] && echo "Cache-Control: $QUERY_STRING"
+echo
+echo "run $n"
@@ -0,0 +1,6 @@
+#!/usr/bin/env python3
+import sys
+d=sys.stdin.read()
+print("Content-Type: text/plain")
+print()
+print("got", len(d))
@@ -0,0 +1,6 @@
+#!/usr/bin/env python3
+import os,sys
+d=sys.stdin.read()
+print("Content-Type: text/plain")
+print()
+print("pid", os.getpid(), "got", len(d), os.environ.get("QUERY_STRING"))
@@ -0,0 +1,5 @@
+#!/bin/bash
+sleep 2
+echo "Content-Type: text/plain"
+echo
+echo slow done
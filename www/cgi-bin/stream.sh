@@ -0,0 +1,6 @@
+#!/bin/bash
+echo "Content-Type: text/plain"
+echo
+echo first
+sleep 2
+echo second